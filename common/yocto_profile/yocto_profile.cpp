@@ -0,0 +1,267 @@
+//
+// Implementation for Yocto/Profile.
+//
+
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2020 Fabio Pellacini
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+
+#include "yocto_profile.h"
+
+#include <yocto_tasks/yocto_tasks.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#include <sys/resource.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF PHASE TRACING
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+using namespace std::string_literals;
+
+// Kind of recorded events
+enum struct profile_kind { phase, counter, memory };
+
+// Recorded event
+struct profile_event {
+  string       name        = "";
+  profile_kind kind        = profile_kind::phase;
+  int          thread      = 0;
+  int64_t      start       = 0;
+  int64_t      duration    = 0;
+  double       value       = 0;
+  double       utilization = -1;
+  size_t       rss         = 0;
+  size_t       peak_rss    = 0;
+};
+
+// Recording state. Events are few, one per phase or counter update, so they
+// share one list.
+static std::atomic<bool>     profiling      = false;
+static std::mutex            profile_mutex  = {};
+static vector<profile_event> profile_events = {};
+static std::atomic<int>      profile_ids    = 0;
+static thread_local int      profile_thread = -1;
+
+// Time since the first call, in microseconds
+static int64_t profile_time() {
+  static const auto origin = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - origin)
+      .count();
+}
+
+// Small id of the calling thread, in order of first event
+static int profile_thread_id() {
+  if (profile_thread < 0) profile_thread = profile_ids++;
+  return profile_thread;
+}
+
+// Starts and stops recording events
+void start_profiling() {
+  profile_time();
+  profiling = true;
+}
+void stop_profiling() { profiling = false; }
+bool is_profiling() { return profiling.load(); }
+
+// Scoped timer for a phase
+profile_scope::profile_scope(const char* name) : name{name} {
+  if (!profiling) return;
+  previous = set_task_timer(&busy);
+  start    = profile_time();
+}
+profile_scope::~profile_scope() { end(); }
+void profile_scope::end() {
+  if (start < 0) return;
+  auto event     = profile_event{};
+  event.name     = name;
+  event.thread   = profile_thread_id();
+  event.start    = start;
+  event.duration = profile_time() - start;
+  start          = -1;
+  set_task_timer(previous);
+  if (previous) *previous += busy.load();
+  // the scheduler is started if tasks ran, so asking its threads is cheap
+  if (busy.load() > 0 && event.duration > 0) {
+    auto threads      = get_thread_count();
+    auto busy_us      = busy.load() / 1000.0 + event.duration;
+    event.utilization = std::min(
+        busy_us / ((double)event.duration * threads), 1.0);
+  }
+  // the peak is updated lazily by some kernels, so it may lag the current
+  event.rss      = get_current_rss();
+  event.peak_rss = std::max(get_peak_rss(), event.rss);
+  auto memory    = event;
+  memory.name    = "memory";
+  memory.kind    = profile_kind::memory;
+  memory.start   = event.start + event.duration;
+  auto lock      = std::lock_guard{profile_mutex};
+  profile_events.push_back(event);
+  profile_events.push_back(memory);
+}
+
+// Records the value of a counter
+void profile_counter(const char* name, double value) {
+  if (!profiling) return;
+  auto event   = profile_event{};
+  event.name   = name;
+  event.kind   = profile_kind::counter;
+  event.thread = profile_thread_id();
+  event.start  = profile_time();
+  event.value  = value;
+  auto lock    = std::lock_guard{profile_mutex};
+  profile_events.push_back(event);
+}
+
+// Memory used by the process now
+size_t get_current_rss() {
+#if defined(_WIN32)
+  auto counters = PROCESS_MEMORY_COUNTERS{};
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    return 0;
+  return (size_t)counters.WorkingSetSize;
+#elif defined(__APPLE__)
+  auto info  = mach_task_basic_info_data_t{};
+  auto count = (mach_msg_type_number_t)MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info,
+          &count) != KERN_SUCCESS)
+    return 0;
+  return (size_t)info.resident_size;
+#else
+  auto fs = fopen("/proc/self/statm", "r");
+  if (!fs) return 0;
+  auto pages = (long)0, resident = (long)0;
+  auto found = fscanf(fs, "%ld %ld", &pages, &resident);
+  fclose(fs);
+  if (found != 2) return 0;
+  return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Memory used by the process at its peak
+size_t get_peak_rss() {
+#if defined(_WIN32)
+  auto counters = PROCESS_MEMORY_COUNTERS{};
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    return 0;
+  return (size_t)counters.PeakWorkingSetSize;
+#else
+  auto usage = rusage{};
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#if defined(__APPLE__)
+  return (size_t)usage.ru_maxrss;
+#else
+  return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+// Json string, escaping the characters json reserves
+static string profile_string(const string& value) {
+  auto json = "\""s;
+  for (auto c : value) {
+    if (c == '"' || c == '\\') json += '\\';
+    if ((unsigned char)c < 0x20) continue;
+    json += c;
+  }
+  return json + "\"";
+}
+
+// Saves the recorded events in Chrome trace format. Phases are complete
+// events on the thread that ran them, counters and memory are counter tracks.
+bool save_profile(const string& filename, string& error) {
+  auto events = vector<profile_event>{};
+  {
+    auto lock = std::lock_guard{profile_mutex};
+    events    = profile_events;
+  }
+  std::stable_sort(events.begin(), events.end(),
+      [](const profile_event& a, const profile_event& b) {
+        return a.start < b.start;
+      });
+  auto megabytes = [](size_t bytes) {
+    return std::to_string((double)bytes / (1024 * 1024));
+  };
+  auto json = "{\n  \"displayTimeUnit\": \"ms\",\n  \"traceEvents\": [\n"s;
+  for (auto idx = 0; idx < (int)events.size(); idx++) {
+    auto& event = events[idx];
+    auto  name  = profile_string(event.name);
+    auto  time  = std::to_string(event.start);
+    auto  tid   = std::to_string(event.thread);
+    if (event.kind == profile_kind::phase) {
+      json += "    {\"name\": " + name + ", \"ph\": \"X\", \"ts\": " + time +
+              ", \"dur\": " + std::to_string(event.duration) +
+              ", \"pid\": 1, \"tid\": " + tid + ", \"args\": {" +
+              (event.utilization >= 0 ? "\"utilization\": " +
+                                            std::to_string(event.utilization) +
+                                            ", "
+                                      : ""s) +
+              "\"rss_mb\": " + megabytes(event.rss) +
+              ", \"peak_rss_mb\": " + megabytes(event.peak_rss) + "}}";
+    } else if (event.kind == profile_kind::memory) {
+      json += "    {\"name\": " + name + ", \"ph\": \"C\", \"ts\": " + time +
+              ", \"pid\": 1, \"args\": {\"rss_mb\": " + megabytes(event.rss) +
+              ", \"peak_rss_mb\": " + megabytes(event.peak_rss) + "}}";
+    } else {
+      json += "    {\"name\": " + name + ", \"ph\": \"C\", \"ts\": " + time +
+              ", \"pid\": 1, \"args\": {\"value\": " +
+              std::to_string(event.value) + "}}";
+    }
+    json += idx + 1 < (int)events.size() ? ",\n" : "\n";
+  }
+  json += "  ]\n}\n";
+
+  auto fs = fopen(filename.c_str(), "wb");
+  if (!fs) {
+    error = filename + ": file not found";
+    return false;
+  }
+  auto ok = fwrite(json.data(), 1, json.size(), fs) == json.size();
+  if (fclose(fs) != 0) ok = false;
+  if (!ok) {
+    error = filename + ": write error";
+    return false;
+  }
+  return true;
+}
+
+}  // namespace yocto
@@ -0,0 +1,109 @@
+//
+// # Yocto/Profile: Phase tracing and memory instrumentation
+//
+//
+// Yocto/Profile records the wall time of the phases of an app, as load,
+// build, simulate, render or save, together with the thread utilization of
+// the shared task scheduler and the memory used by the process. Recording is
+// off by default, and scopes and counters only check a flag while it is off.
+//
+// 1. start recording with `start_profiling()`, usually when the app is run
+//    with `--trace`
+// 2. time a phase with a `profile_scope`, that records from its construction
+//    to `end()` or its destruction; scopes can nest and run on any thread
+// 3. record values over time with `profile_counter()`
+// 4. save the recording with `save_profile()` in Chrome trace format, that
+//    loads in chrome://tracing and in Perfetto
+//
+
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2020 Fabio Pellacini
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+
+#ifndef _YOCTO_PROFILE_H_
+#define _YOCTO_PROFILE_H_
+
+// -----------------------------------------------------------------------------
+// INCLUDES
+// -----------------------------------------------------------------------------
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// -----------------------------------------------------------------------------
+// USING DIRECTIVES
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// using directives
+using std::string;
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// PHASE TRACING
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Starts and stops recording events. Events recorded so far are kept.
+void start_profiling();
+void stop_profiling();
+bool is_profiling();
+
+// Scoped timer for a phase. When it ends, it records the phase wall time,
+// the fraction of scheduler threads busy with its tasks, and the current and
+// peak memory. Utilization counts the thread that runs the phase as always
+// busy, and is omitted for phases that run no tasks on the scheduler. The
+// tasks of nested phases count for the enclosing ones too.
+struct profile_scope {
+  profile_scope(const char* name);
+  profile_scope(const profile_scope&) = delete;
+  profile_scope& operator=(const profile_scope&) = delete;
+  ~profile_scope();
+
+  // ends the phase, if not already ended
+  void end();
+
+  // private
+  const char*           name     = nullptr;
+  int64_t               start    = -1;
+  std::atomic<int64_t>  busy     = 0;
+  std::atomic<int64_t>* previous = nullptr;
+};
+
+// Records the value of a counter, shown as a track in the trace
+void profile_counter(const char* name, double value);
+
+// Memory used by the process, in bytes, now and at its peak. Returns zero on
+// platforms that do not report it.
+size_t get_current_rss();
+size_t get_peak_rss();
+
+// Saves the recorded events in Chrome trace format
+bool save_profile(const string& filename, string& error);
+
+}  // namespace yocto
+
+#endif
@@ -0,0 +1,710 @@
+//
+// Implementation for Yocto/SceneLoad.
+//
+
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2020 Fabio Pellacini
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+
+#include "yocto_sceneload.h"
+
+#include <yocto/ext/json.hpp>
+#include <yocto/yocto_commonio.h>
+#include <yocto/yocto_image.h>
+#include <yocto/yocto_shape.h>
+#include <yocto_tasks/yocto_tasks.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// -----------------------------------------------------------------------------
+// JSON SUPPORT
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+using std::unordered_map;
+using std::vector;
+using namespace std::string_literals;
+using json = nlohmann::json;
+
+// Json values as scene values, that fail on mismatched types
+static bool get_value(const json& js, float& value) {
+  if (!js.is_number()) return false;
+  value = js.get<float>();
+  return true;
+}
+static bool get_value(const json& js, bool& value) {
+  if (!js.is_boolean()) return false;
+  value = js.get<bool>();
+  return true;
+}
+static bool get_value(const json& js, string& value) {
+  if (!js.is_string()) return false;
+  value = js.get<string>();
+  return true;
+}
+static bool get_values(const json& js, float* values, int count) {
+  if (!js.is_array() || js.size() != count) return false;
+  for (auto idx = 0; idx < count; idx++)
+    if (!get_value(js[idx], values[idx])) return false;
+  return true;
+}
+static bool get_value(const json& js, vec3f& value) {
+  return get_values(js, &value.x, 3);
+}
+static bool get_value(const json& js, frame3f& value) {
+  return get_values(js, &value.x.x, 12);
+}
+static bool get_value(const json& js, mat3f& value) {
+  return get_values(js, &value.x.x, 9);
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// MEMORY-MAPPED PLY LOADING
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Read-only mapping of a whole file
+struct sceneload_mapping {
+  const char* data = nullptr;
+  size_t      size = 0;
+
+  sceneload_mapping() = default;
+  sceneload_mapping(const sceneload_mapping&) = delete;
+  sceneload_mapping& operator=(const sceneload_mapping&) = delete;
+  ~sceneload_mapping() {
+#if !defined(_WIN32)
+    if (data) munmap((void*)data, size);
+#endif
+  }
+};
+
+// Maps a file, returning false if it cannot be mapped
+static bool map_file(const string& filename, sceneload_mapping& mapping) {
+#if !defined(_WIN32)
+  auto fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+  auto size = (size_t)info.st_size;
+  auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+  madvise(data, size, MADV_SEQUENTIAL);
+  mapping.data = (const char*)data;
+  mapping.size = size;
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Copies float vertex properties at the byte offsets in each vertex to
+// values with the given number of floats per vertex. Packed properties are
+// copied at once, and contiguous ones once per vertex.
+static void copy_vertices(const char* block, size_t count, size_t stride,
+    const vector<size_t>& offsets, float* values, size_t values_stride) {
+  auto ncomponents = offsets.size();
+  auto contiguous  = true;
+  for (auto idx = 0; idx < ncomponents; idx++)
+    contiguous = contiguous && offsets[idx] == offsets[0] + idx * 4;
+  if (contiguous && offsets[0] == 0 && stride == ncomponents * 4 &&
+      values_stride == ncomponents) {
+    memcpy(values, block, count * stride);
+  } else if (contiguous) {
+    for (auto vid = (size_t)0; vid < count; vid++)
+      memcpy(values + vid * values_stride, block + vid * stride + offsets[0],
+          ncomponents * 4);
+  } else {
+    for (auto vid = (size_t)0; vid < count; vid++)
+      for (auto idx = 0; idx < ncomponents; idx++)
+        memcpy(values + vid * values_stride + idx,
+            block + vid * stride + offsets[idx], 4);
+  }
+}
+
+// Loads a binary little-endian Ply shape from a mapped file, viewing its
+// vertex block as packed arrays when its layout matches our vectors. Returns
+// false for layouts not handled here, that are left to `load_shape()`: these
+// are Ply files with non-float vertex properties, elements other than vertices
+// and faces, or properties other than positions, normals, texcoords and
+// colors. Faces are converted as `load_shape()` does. Faces with vertex
+// indices out of range are reported as errors.
+static bool load_mapped_ply(
+    const string& filename, sceneio_shape* shape, string& error) {
+  // check endianness
+  auto one = (uint16_t)1;
+  if (*(const char*)&one != 1) return false;
+
+  // map
+  auto mapping = sceneload_mapping{};
+  if (!map_file(filename, mapping)) return false;
+  auto data     = mapping.data;
+  auto data_end = mapping.data + mapping.size;
+
+  // header
+  auto end_header = "end_header\n"s;
+  auto header_end = std::search(
+      data, data_end, end_header.begin(), end_header.end());
+  if (header_end == data_end) return false;
+  auto header     = std::istringstream{string(data, header_end)};
+  auto binary     = false;
+  auto element    = ""s;
+  auto nvertices  = (size_t)0;
+  auto nfaces     = (size_t)0;
+  auto properties = vector<string>{};
+  auto face_list  = false;
+  auto has_faces  = false;
+  auto has_vertex = false;
+  auto line       = ""s;
+  while (std::getline(header, line)) {
+    auto tokens = vector<string>{};
+    auto words  = std::istringstream{line};
+    for (auto token = ""s; words >> token;) tokens.push_back(token);
+    if (tokens.empty() || tokens[0] == "ply" || tokens[0] == "comment" ||
+        tokens[0] == "obj_info")
+      continue;
+    if (tokens[0] == "format") {
+      binary = tokens.size() == 3 && tokens[1] == "binary_little_endian" &&
+               tokens[2] == "1.0";
+    } else if (tokens[0] == "element" && tokens.size() == 3) {
+      auto count = std::strtoll(tokens[2].c_str(), nullptr, 10);
+      if (count < 0) return false;
+      element = tokens[1];
+      if (element == "vertex" && !has_vertex && !has_faces) {
+        has_vertex = true;
+        nvertices  = (size_t)count;
+      } else if (element == "face" && has_vertex && !has_faces) {
+        has_faces = true;
+        nfaces    = (size_t)count;
+      } else {
+        return false;
+      }
+    } else if (tokens[0] == "property" && element == "vertex") {
+      if (tokens.size() != 3) return false;
+      if (tokens[1] != "float" && tokens[1] != "float32") return false;
+      properties.push_back(tokens[2]);
+    } else if (tokens[0] == "property" && element == "face") {
+      if (face_list || tokens.size() != 5 || tokens[1] != "list") return false;
+      if (tokens[2] != "uchar" && tokens[2] != "uint8") return false;
+      if (tokens[3] != "int" && tokens[3] != "int32" && tokens[3] != "uint" &&
+          tokens[3] != "uint32")
+        return false;
+      if (tokens[4] != "vertex_indices" && tokens[4] != "vertex_index")
+        return false;
+      face_list = true;
+    } else {
+      return false;
+    }
+  }
+  if (!binary || nvertices == 0 || (has_faces && !face_list)) return false;
+
+  // vertex layout
+  auto offset_of = [&properties](const string& name) -> int {
+    auto it = std::find(properties.begin(), properties.end(), name);
+    return it == properties.end() ? -1 : (int)(it - properties.begin()) * 4;
+  };
+  auto get_offsets = [&offset_of](const vector<string>& names,
+                         vector<size_t>& offsets) -> bool {
+    for (auto& name : names) {
+      auto offset = offset_of(name);
+      if (offset < 0) return false;
+      offsets.push_back((size_t)offset);
+    }
+    return true;
+  };
+  auto position_offsets = vector<size_t>{}, normal_offsets = vector<size_t>{},
+       texcoord_offsets = vector<size_t>{}, color_offsets = vector<size_t>{};
+  if (!get_offsets({"x", "y", "z"}, position_offsets)) return false;
+  auto has_normals   = get_offsets({"nx", "ny", "nz"}, normal_offsets);
+  auto has_texcoords = get_offsets({"u", "v"}, texcoord_offsets);
+  auto has_colors    = get_offsets({"red", "green", "blue"}, color_offsets);
+  if (has_colors) get_offsets({"alpha"}, color_offsets);
+  auto used = position_offsets.size() + normal_offsets.size() +
+              texcoord_offsets.size() + color_offsets.size();
+  if (used != properties.size()) return false;
+  if (std::set<string>(properties.begin(), properties.end()).size() !=
+      properties.size())
+    return false;
+
+  // check sizes and indices, before copying anything, and check that faces
+  // are quads if any face is a quad
+  auto stride = properties.size() * 4;
+  auto block  = header_end + end_header.size();
+  if ((size_t)(data_end - block) / stride < nvertices) return false;
+  auto faces      = block + nvertices * stride;
+  auto has_quads  = false;
+  auto ntriangles = (size_t)0;
+  auto face       = faces;
+  for (auto fid = (size_t)0; fid < nfaces; fid++) {
+    if (face >= data_end) return false;
+    auto size = (int)(unsigned char)*face;
+    if ((size_t)(data_end - face - 1) / 4 < (size_t)size) return false;
+    for (auto idx = 0; idx < size; idx++) {
+      auto index = 0;
+      memcpy(&index, face + 1 + idx * 4, 4);
+      if (index < 0 || (size_t)index >= nvertices) {
+        error = filename + ": vertex index out of range";
+        return true;
+      }
+    }
+    face += 1 + size * 4;
+    has_quads = has_quads || size == 4;
+    ntriangles += std::max(size - 2, 0);
+  }
+
+  // vertices
+  shape->positions.resize(nvertices);
+  copy_vertices(
+      block, nvertices, stride, position_offsets, &shape->positions[0].x, 3);
+  if (has_normals) {
+    shape->normals.resize(nvertices);
+    copy_vertices(
+        block, nvertices, stride, normal_offsets, &shape->normals[0].x, 3);
+  }
+  if (has_texcoords) {
+    shape->texcoords.resize(nvertices);
+    copy_vertices(
+        block, nvertices, stride, texcoord_offsets, &shape->texcoords[0].x, 2);
+    for (auto& texcoord : shape->texcoords) texcoord.y = 1 - texcoord.y;
+  }
+  if (has_colors) {
+    shape->colors.assign(nvertices, {0, 0, 0, 1});
+    copy_vertices(
+        block, nvertices, stride, color_offsets, &shape->colors[0].x, 4);
+  }
+
+  // faces, as triangle fans
+  auto indices = vector<int>{};
+  if (has_quads) {
+    shape->quads.reserve(ntriangles);
+  } else {
+    shape->triangles.reserve(ntriangles);
+  }
+  face = faces;
+  for (auto fid = (size_t)0; fid < nfaces; fid++) {
+    auto size = (int)(unsigned char)*face;
+    indices.resize(size);
+    if (size) memcpy(indices.data(), face + 1, size * 4);
+    face += 1 + size * 4;
+    if (has_quads && size == 4) {
+      shape->quads.push_back({indices[0], indices[1], indices[2], indices[3]});
+      continue;
+    }
+    for (auto idx = 2; idx < size; idx++) {
+      if (has_quads) {
+        shape->quads.push_back(
+            {indices[0], indices[idx - 1], indices[idx], indices[idx]});
+      } else {
+        shape->triangles.push_back(
+            {indices[0], indices[idx - 1], indices[idx]});
+      }
+    }
+  }
+
+  return true;
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF PARALLEL SCENE LOADING
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Scene elements by name, resolved after all sections are read, since
+// instances may come before the materials they use
+struct sceneload_names {
+  unordered_map<string, sceneio_shape*>    shapes    = {{"", nullptr}};
+  unordered_map<string, sceneio_texture*>  textures  = {{"", nullptr}};
+  unordered_map<string, sceneio_material*> materials = {{"", nullptr}};
+  vector<std::pair<sceneio_instance*, string>> instance_materials = {};
+};
+
+// Gets a texture by name, adding it on first use
+static bool get_texture(const json& js, sceneio_scene* scene,
+    sceneload_names& names, sceneio_texture*& texture) {
+  auto name = ""s;
+  if (!get_value(js, name)) return false;
+  auto it = names.textures.find(name);
+  if (it == names.textures.end()) {
+    it = names.textures.insert({name, add_texture(scene, name)}).first;
+  }
+  texture = it->second;
+  return true;
+}
+
+// Reads the scene elements of a Json scene, in the order of the Json objects
+// as load_scene() does. Returns false for entries not handled here, that are
+// left to `load_scene()`.
+static bool read_cameras(const json& js, sceneio_scene* scene) {
+  if (!js.is_object()) return false;
+  for (auto& [name, ejs] : js.items()) {
+    auto camera = add_camera(scene, name);
+    if (!ejs.is_object()) return false;
+    auto lookat = (const json*)nullptr;
+    for (auto& [key, value] : ejs.items()) {
+      auto ok = false;
+      if (key == "frame") {
+        ok = get_value(value, camera->frame);
+      } else if (key == "orthographic") {
+        ok = get_value(value, camera->orthographic);
+      } else if (key == "lens") {
+        ok = get_value(value, camera->lens);
+      } else if (key == "aspect") {
+        ok = get_value(value, camera->aspect);
+      } else if (key == "film") {
+        ok = get_value(value, camera->film);
+      } else if (key == "focus") {
+        ok = get_value(value, camera->focus);
+      } else if (key == "aperture") {
+        ok = get_value(value, camera->aperture);
+      } else if (key == "lookat") {
+        ok     = true;
+        lookat = &value;
+      }
+      if (!ok) return false;
+    }
+    if (lookat) {
+      auto from_to_up = mat3f{};
+      if (!get_value(*lookat, from_to_up)) return false;
+      camera->frame = lookat_frame(from_to_up.x, from_to_up.y, from_to_up.z);
+      camera->focus = length(from_to_up.x - from_to_up.y);
+    }
+  }
+  return true;
+}
+
+static bool read_environments(
+    const json& js, sceneio_scene* scene, sceneload_names& names) {
+  if (!js.is_object()) return false;
+  for (auto& [name, ejs] : js.items()) {
+    auto environment = add_environment(scene, name);
+    if (!ejs.is_object()) return false;
+    auto lookat = (const json*)nullptr;
+    for (auto& [key, value] : ejs.items()) {
+      auto ok = false;
+      if (key == "frame") {
+        ok = get_value(value, environment->frame);
+      } else if (key == "emission") {
+        ok = get_value(value, environment->emission);
+      } else if (key == "emission_tex") {
+        ok = get_texture(value, scene, names, environment->emission_tex);
+      } else if (key == "lookat") {
+        ok     = true;
+        lookat = &value;
+      }
+      if (!ok) return false;
+    }
+    if (lookat) {
+      auto from_to_up = mat3f{};
+      if (!get_value(*lookat, from_to_up)) return false;
+      environment->frame = lookat_frame(
+          from_to_up.x, from_to_up.y, from_to_up.z, true);
+    }
+  }
+  return true;
+}
+
+static bool read_materials(
+    const json& js, sceneio_scene* scene, sceneload_names& names) {
+  if (!js.is_object()) return false;
+  for (auto& [name, ejs] : js.items()) {
+    auto material = add_material(scene, name);
+    if (!ejs.is_object()) return false;
+    names.materials[name] = material;
+    for (auto& [key, value] : ejs.items()) {
+      auto ok = false;
+      if (key == "emission") {
+        ok = get_value(value, material->emission);
+      } else if (key == "color") {
+        ok = get_value(value, material->color);
+      } else if (key == "specular") {
+        ok = get_value(value, material->specular);
+      } else if (key == "metallic") {
+        ok = get_value(value, material->metallic);
+      } else if (key == "coat") {
+        ok = get_value(value, material->coat);
+      } else if (key == "roughness") {
+        ok = get_value(value, material->roughness);
+      } else if (key == "ior") {
+        ok = get_value(value, material->ior);
+      } else if (key == "spectint") {
+        ok = get_value(value, material->spectint);
+      } else if (key == "transmission") {
+        ok = get_value(value, material->transmission);
+      } else if (key == "translucency") {
+        ok = get_value(value, material->translucency);
+      } else if (key == "scattering") {
+        ok = get_value(value, material->scattering);
+      } else if (key == "scanisotropy") {
+        ok = get_value(value, material->scanisotropy);
+      } else if (key == "trdepth") {
+        ok = get_value(value, material->trdepth);
+      } else if (key == "opacity") {
+        ok = get_value(value, material->opacity);
+      } else if (key == "thin") {
+        ok = get_value(value, material->thin);
+      } else if (key == "emission_tex") {
+        ok = get_texture(value, scene, names, material->emission_tex);
+      } else if (key == "color_tex") {
+        ok = get_texture(value, scene, names, material->color_tex);
+      } else if (key == "specular_tex") {
+        ok = get_texture(value, scene, names, material->specular_tex);
+      } else if (key == "metallic_tex") {
+        ok = get_texture(value, scene, names, material->metallic_tex);
+      } else if (key == "coat_tex") {
+        ok = get_texture(value, scene, names, material->coat_tex);
+      } else if (key == "roughness_tex") {
+        ok = get_texture(value, scene, names, material->roughness_tex);
+      } else if (key == "spectint_tex") {
+        ok = get_texture(value, scene, names, material->spectint_tex);
+      } else if (key == "transmission_tex") {
+        ok = get_texture(value, scene, names, material->transmission_tex);
+      } else if (key == "translucency_tex") {
+        ok = get_texture(value, scene, names, material->translucency_tex);
+      } else if (key == "scattering_tex") {
+        ok = get_texture(value, scene, names, material->scattering_tex);
+      } else if (key == "opacity_tex") {
+        ok = get_texture(value, scene, names, material->opacity_tex);
+      } else if (key == "normal_tex") {
+        ok = get_texture(value, scene, names, material->normal_tex);
+      }
+      if (!ok) return false;
+    }
+  }
+  return true;
+}
+
+static bool read_instances(
+    const json& js, sceneio_scene* scene, sceneload_names& names) {
+  if (!js.is_object()) return false;
+  for (auto& [name, ejs] : js.items()) {
+    auto instance = add_instance(scene, name);
+    if (!ejs.is_object()) return false;
+    auto lookat = (const json*)nullptr;
+    for (auto& [key, value] : ejs.items()) {
+      auto ok = false;
+      if (key == "frame") {
+        ok = get_value(value, instance->frame);
+      } else if (key == "shape") {
+        auto shape = ""s;
+        ok         = get_value(value, shape);
+        auto it    = names.shapes.find(shape);
+        if (ok && it == names.shapes.end())
+          it = names.shapes.insert({shape, add_shape(scene, shape)}).first;
+        if (ok) instance->shape = it->second;
+      } else if (key == "material") {
+        auto material = ""s;
+        ok            = get_value(value, material);
+        if (ok) names.instance_materials.push_back({instance, material});
+      } else if (key == "lookat") {
+        ok     = true;
+        lookat = &value;
+      }
+      if (!ok) return false;
+    }
+    if (lookat) {
+      auto from_to_up = mat3f{};
+      if (!get_value(*lookat, from_to_up)) return false;
+      instance->frame = lookat_frame(
+          from_to_up.x, from_to_up.y, from_to_up.z, true);
+    }
+  }
+  return true;
+}
+
+static bool read_scene(const json& js, sceneio_scene* scene) {
+  if (!js.is_object()) return false;
+  auto names = sceneload_names{};
+  for (auto& [key, value] : js.items()) {
+    auto ok = false;
+    if (key == "asset") {
+      ok = value.is_object();
+      for (auto& [name, entry] : value.items()) {
+        if (name == "copyright") {
+          ok = ok && get_value(entry, scene->copyright);
+        } else {
+          ok = ok && name == "generator";
+        }
+      }
+    } else if (key == "cameras") {
+      ok = read_cameras(value, scene);
+    } else if (key == "environments") {
+      ok = read_environments(value, scene, names);
+    } else if (key == "materials") {
+      ok = read_materials(value, scene, names);
+    } else if (key == "instances") {
+      ok = read_instances(value, scene, names);
+    }
+    if (!ok) return false;
+  }
+
+  // resolve materials, leaving missing ones to `load_scene()`
+  for (auto& [instance, name] : names.instance_materials) {
+    auto it = names.materials.find(name);
+    if (it == names.materials.end()) return false;
+    instance->material = it->second;
+  }
+
+  // incomplete scenes get defaults from `load_scene()`
+  for (auto instance : scene->instances)
+    if (!instance->shape || !instance->material) return false;
+  return !scene->cameras.empty() && !scene->instances.empty();
+}
+
+// Finds the asset path, trying each extension in turn
+static string find_asset(const string& dirname, const string& group,
+    const string& name, const vector<string>& extensions) {
+  for (auto& extension : extensions) {
+    auto path = path_join(path_join(dirname, group), name + extension);
+    if (path_exists(path)) return path;
+  }
+  return path_join(path_join(dirname, group), name + extensions.front());
+}
+static string find_shape(const string& dirname, const sceneio_shape* shape) {
+  return find_asset(dirname, "shapes", shape->name, {".ply", ".obj"});
+}
+static string find_texture(
+    const string& dirname, const sceneio_texture* texture) {
+  return find_asset(
+      dirname, "textures", texture->name, {".hdr", ".exr", ".png", ".jpg"});
+}
+
+// Loads a scene, loading its shapes and textures in parallel
+bool load_scene_parallel(const string& filename, sceneio_scene* scene,
+    string& error, progress_callback progress_cb) {
+  // scenes that are not Json are left to the general loader
+  auto extension = path_extension(filename);
+  if (extension != ".json" && extension != ".JSON")
+    return load_scene(filename, scene, error, progress_cb);
+
+  // read the scene elements in a separate scene, since unsupported entries
+  // may require starting over with the general loader
+  auto text = ""s;
+  if (!load_text(filename, text, error)) return false;
+  auto js = json::parse(text, nullptr, false);
+  if (js.is_discarded()) return load_scene(filename, scene, error, progress_cb);
+  auto parsed_guard = std::make_unique<sceneio_scene>();
+  auto parsed       = parsed_guard.get();
+  if (!read_scene(js, parsed))
+    return load_scene(filename, scene, error, progress_cb);
+
+  // move the elements, leaving the parsed scene empty
+  auto shapes        = parsed->shapes;
+  auto textures      = parsed->textures;
+  auto move_elements = [](auto& elements, auto& parsed_elements) {
+    elements.insert(
+        elements.end(), parsed_elements.begin(), parsed_elements.end());
+    parsed_elements.clear();
+  };
+  move_elements(scene->cameras, parsed->cameras);
+  move_elements(scene->environments, parsed->environments);
+  move_elements(scene->textures, parsed->textures);
+  move_elements(scene->materials, parsed->materials);
+  move_elements(scene->shapes, parsed->shapes);
+  move_elements(scene->instances, parsed->instances);
+  scene->copyright = parsed->copyright;
+
+  // handle progress
+  auto nassets  = (int)shapes.size() + (int)textures.size();
+  auto progress = vec2i{0, nassets + 2};
+  auto mutex    = std::mutex{};
+  if (progress_cb) progress_cb("load scene", progress.x++, progress.y);
+
+  // load shapes and textures, one per task, keeping the errors in order
+  auto dirname = path_dirname(filename);
+  auto errors  = vector<string>(nassets);
+  parallel_range(nassets, [&](int idx) {
+    if (idx < shapes.size()) {
+      auto shape = shapes[idx];
+      if (progress_cb) {
+        auto lock = std::lock_guard{mutex};
+        progress_cb("load shape", progress.x++, progress.y);
+      }
+      auto path = find_shape(dirname, shape);
+      if (path_extension(path) == ".ply" &&
+          load_mapped_ply(path, shape, errors[idx]))
+        return;
+      load_shape(path, shape->points, shape->lines, shape->triangles,
+          shape->quads, shape->positions, shape->normals, shape->texcoords,
+          shape->colors, shape->radius, errors[idx]);
+    } else {
+      auto texture = textures[idx - shapes.size()];
+      if (progress_cb) {
+        auto lock = std::lock_guard{mutex};
+        progress_cb("load texture", progress.x++, progress.y);
+      }
+      auto path = find_texture(dirname, texture);
+      if (is_hdr_filename(path)) {
+        load_image(path, texture->hdr, errors[idx]);
+      } else {
+        load_image(path, texture->ldr, errors[idx]);
+      }
+    }
+  });
+  for (auto& asset_error : errors) {
+    if (asset_error.empty()) continue;
+    error = asset_error;
+    return false;
+  }
+
+  // done
+  if (progress_cb) progress_cb("load done", progress.x++, progress.y);
+  return true;
+}
+
+// Filenames of the shapes and textures of a Json scene
+vector<string> get_scene_assets(
+    const string& filename, const sceneio_scene* scene) {
+  auto extension = path_extension(filename);
+  if (extension != ".json" && extension != ".JSON") return {};
+  auto dirname = path_dirname(filename);
+  auto assets  = vector<string>{};
+  for (auto shape : scene->shapes) assets.push_back(find_shape(dirname, shape));
+  for (auto texture : scene->textures)
+    assets.push_back(find_texture(dirname, texture));
+  return assets;
+}
+
+}  // namespace yocto
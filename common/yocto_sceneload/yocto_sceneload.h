@@ -0,0 +1,87 @@
+//
+// # Yocto/SceneLoad: Parallel scene loading
+//
+//
+// Yocto/SceneLoad loads scenes like `load_scene()`, but parses shapes and
+// decodes textures concurrently on the shared task scheduler. Json scenes
+// are parsed first with the Json library bundled with Yocto/SceneIO,
+// creating all scene elements in the same order as `load_scene()`, and then
+// their shapes and textures are loaded in parallel, one asset per task.
+// Other formats, and Json scenes with entries not handled here, are loaded
+// with `load_scene()`, so the resulting scene is the same in all cases.
+// `bench_raytrace --check-load` compares both loaders field by field.
+//
+// 1. load a scene with `load_scene_parallel()`, that reports progress with
+//    the same callback as `load_scene()`
+// 2. get the files its shapes and textures were loaded from with
+//    `get_scene_assets()`
+//
+
+//
+// LICENSE:
+//
+//
+// Copyright (c) 2016 -- 2020 Fabio Pellacini
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+
+
+#ifndef _YOCTO_SCENELOAD_H_
+#define _YOCTO_SCENELOAD_H_
+
+// -----------------------------------------------------------------------------
+// INCLUDES
+// -----------------------------------------------------------------------------
+
+#include <yocto/yocto_sceneio.h>
+
+#include <string>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// USING DIRECTIVES
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// using directives
+using std::string;
+using std::vector;
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// PARALLEL SCENE LOADING
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Loads a scene, loading its shapes and textures in parallel. Progress is
+// reported from the calling thread, or under a lock from the workers.
+bool load_scene_parallel(const string& filename, sceneio_scene* scene,
+    string& error, progress_callback progress_cb = {});
+
+// Filenames of the shapes and textures of a Json scene, as loaded by
+// `load_scene_parallel()`. Scenes in other formats have none.
+vector<string> get_scene_assets(
+    const string& filename, const sceneio_scene* scene);
+
+}  // namespace yocto
+
+#endif
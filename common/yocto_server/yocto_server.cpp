@@ -0,0 +1,386 @@
+//
+// Implementation for Yocto/Server.
+//
+
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2020 Fabio Pellacini
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+
+#include "yocto_server.h"
+
+#include <cerrno>
+#include <exception>
+#include <filesystem>
+
+#if !defined(_WIN32)
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF MESSAGES
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+using namespace std::string_literals;
+
+// Message header, checked to reject connections from other programs. Payloads
+// larger than the cap are rejected, and the others are received in chunks, so
+// that a bad header cannot make the receiver allocate much more than it got.
+const auto server_magic    = (uint32_t)0x5652534b;
+const auto server_max_size = (uint64_t)1 << 32;
+const auto server_chunk    = (size_t)1 << 24;
+struct server_header {
+  uint32_t magic = server_magic;
+  int32_t  type  = 0;
+  uint64_t size  = 0;
+};
+
+#if !defined(_WIN32)
+
+// Do not raise signals when writing to closed connections
+#if defined(MSG_NOSIGNAL)
+const auto server_send_flags = MSG_NOSIGNAL;
+#else
+const auto server_send_flags = 0;
+#endif
+
+// Do not raise signals on platforms without the send flag
+static void set_nosignal(int fd) {
+#if defined(SO_NOSIGPIPE)
+  auto value = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &value, sizeof(value));
+#endif
+}
+
+// Close connections
+server_socket::~server_socket() {
+  if (fd >= 0) close(fd);
+}
+
+// Sends and receives all bytes of a buffer
+static bool send_bytes(int fd, const void* data, size_t size) {
+  auto bytes = (const char*)data;
+  while (size > 0) {
+    auto sent = send(fd, bytes, size, server_send_flags);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) return false;
+    bytes += sent;
+    size -= sent;
+  }
+  return true;
+}
+static bool receive_bytes(int fd, void* data, size_t size) {
+  auto bytes = (char*)data;
+  while (size > 0) {
+    auto received = recv(fd, bytes, size, 0);
+    if (received < 0 && errno == EINTR) continue;
+    if (received <= 0) return false;
+    bytes += received;
+    size -= received;
+  }
+  return true;
+}
+
+// Sends and receives messages
+bool send_message(
+    server_socket& socket, const server_message& message, string& error) {
+  auto header = server_header{};
+  header.type = (int32_t)message.type;
+  header.size = message.data.size();
+  if (!send_bytes(socket.fd, &header, sizeof(header)) ||
+      !send_bytes(socket.fd, message.data.data(), message.data.size())) {
+    error = "connection closed";
+    return false;
+  }
+  return true;
+}
+bool receive_message(
+    server_socket& socket, server_message& message, string& error) {
+  auto header = server_header{};
+  if (!receive_bytes(socket.fd, &header, sizeof(header))) {
+    error = "connection closed";
+    return false;
+  }
+  if (header.magic != server_magic ||
+      header.type > (int32_t)server_message_type::error || header.type < 0) {
+    error = "bad message";
+    return false;
+  }
+  if (header.size > server_max_size) {
+    error = "message too large";
+    return false;
+  }
+  message.type = (server_message_type)header.type;
+  message.data.clear();
+  while (message.data.size() < header.size) {
+    auto offset = message.data.size();
+    message.data.resize(
+        offset + std::min((size_t)(header.size - offset), server_chunk));
+    if (!receive_bytes(socket.fd, message.data.data() + offset,
+            message.data.size() - offset)) {
+      error = "connection closed";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Address of a socket file
+static bool make_address(
+    sockaddr_un& address, const string& socketname, string& error) {
+  address            = {};
+  address.sun_family = AF_UNIX;
+  if (socketname.empty() || socketname.size() >= sizeof(address.sun_path)) {
+    error = socketname + ": bad socket name";
+    return false;
+  }
+  memcpy(address.sun_path, socketname.c_str(), socketname.size() + 1);
+  return true;
+}
+
+// Removes the socket file left by a server, refusing to remove other files
+static bool remove_socket(const string& socketname, string& error) {
+  struct stat info = {};
+  if (lstat(socketname.c_str(), &info) != 0) return true;
+  if (!S_ISSOCK(info.st_mode)) {
+    error = socketname + ": not a socket";
+    return false;
+  }
+  unlink(socketname.c_str());
+  return true;
+}
+
+// Stops waiting for clients that do not send their messages
+static void set_timeout(int fd) {
+  auto timeout    = timeval{};
+  timeout.tv_sec  = 10;
+  timeout.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+// Connects to a server
+static bool connect_server(
+    server_socket& socket, const string& socketname, string& error) {
+  auto address = sockaddr_un{};
+  if (!make_address(address, socketname, error)) return false;
+  socket.fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socket.fd < 0 ||
+      connect(socket.fd, (sockaddr*)&address, sizeof(address)) != 0) {
+    error = socketname + ": server not running";
+    return false;
+  }
+  set_nosignal(socket.fd);
+  return true;
+}
+
+#else
+
+// Unix domain sockets are not supported on Windows
+server_socket::~server_socket() {}
+bool send_message(
+    server_socket& socket, const server_message& message, string& error) {
+  error = "servers not supported";
+  return false;
+}
+bool receive_message(
+    server_socket& socket, server_message& message, string& error) {
+  error = "servers not supported";
+  return false;
+}
+static bool connect_server(
+    server_socket& socket, const string& socketname, string& error) {
+  error = socketname + ": servers not supported";
+  return false;
+}
+
+#endif
+
+// Sends a progress message
+bool send_progress(server_socket& socket, const string& message, int current,
+    int total, string& error) {
+  auto writer = server_writer{};
+  write_value(writer, message);
+  write_value(writer, current);
+  write_value(writer, total);
+  return send_message(
+      socket, {server_message_type::progress, std::move(writer.data)}, error);
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF SERVERS AND CLIENTS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Sends the error of a failed job, that the client may not wait for anymore
+static void send_error(server_socket& client, const string& message) {
+  auto writer = server_writer{};
+  write_value(writer, message);
+  auto error = ""s;
+  send_message(client, {server_message_type::error, writer.data}, error);
+}
+
+// Runs a server on the socket, until a client asks it to stop
+bool run_server(
+    const string& socketname, const server_handler& handler, string& error) {
+#if !defined(_WIN32)
+  // replace sockets left by servers that did not exit, but not running ones
+  auto running = server_socket{};
+  auto ignored = ""s;
+  if (connect_server(running, socketname, ignored)) {
+    error = socketname + ": server already running";
+    return false;
+  }
+  auto address = sockaddr_un{};
+  if (!make_address(address, socketname, error)) return false;
+  if (!remove_socket(socketname, error)) return false;
+  // only the user can connect, and the socket is private before listening
+  auto server = server_socket{};
+  server.fd   = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server.fd < 0 ||
+      bind(server.fd, (sockaddr*)&address, sizeof(address)) != 0 ||
+      chmod(socketname.c_str(), S_IRUSR | S_IWUSR) != 0 ||
+      listen(server.fd, 16) != 0) {
+    error = socketname + ": cannot listen";
+    return false;
+  }
+
+  // run jobs one at a time
+  auto stop = false;
+  while (!stop) {
+    auto client = server_socket{};
+    client.fd   = accept(server.fd, nullptr, nullptr);
+    if (client.fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      error = socketname + ": cannot accept";
+      remove_socket(socketname, ignored);
+      return false;
+    }
+    set_nosignal(client.fd);
+    set_timeout(client.fd);
+    // clients that close or send bad messages are dropped without replies
+    auto job       = server_message{};
+    auto job_error = ""s;
+    auto done      = false;
+    try {
+      if (!receive_message(client, job, ignored)) continue;
+      if (job.type == server_message_type::stop) {
+        stop = true;
+        done = true;
+      } else if (job.type != server_message_type::job) {
+        job_error = "bad message";
+      } else {
+        done = handler(client, job, job_error);
+      }
+    } catch (std::exception& exception) {
+      job_error = exception.what();
+    }
+    if (!done) {
+      send_error(client, job_error);
+      continue;
+    }
+    send_message(client, {server_message_type::done, {}}, ignored);
+  }
+  remove_socket(socketname, ignored);
+  return true;
+#else
+  error = socketname + ": servers not supported";
+  return false;
+#endif
+}
+
+// Asks the server on the socket to stop
+bool stop_server(const string& socketname, string& error) {
+  auto server = server_socket{};
+  if (!connect_server(server, socketname, error)) return false;
+  if (!send_message(server, {server_message_type::stop, {}}, error))
+    return false;
+  auto reply = server_message{};
+  return receive_message(server, reply, error);
+}
+
+// Submits a job to the server on the socket
+bool run_client(const string& socketname, const server_message& job,
+    const server_result& result_cb, const server_progress& progress_cb,
+    string& error) {
+  auto server = server_socket{};
+  if (!connect_server(server, socketname, error)) return false;
+  if (!send_message(server, job, error)) return false;
+  while (true) {
+    auto message = server_message{};
+    if (!receive_message(server, message, error)) return false;
+    auto reader = server_reader{message.data};
+    switch (message.type) {
+      case server_message_type::progress: {
+        auto text = ""s;
+        auto current = 0, total = 0;
+        if (!read_value(reader, text) || !read_value(reader, current) ||
+            !read_value(reader, total)) {
+          error = "bad message";
+          return false;
+        }
+        if (progress_cb) progress_cb(text, current, total);
+      } break;
+      case server_message_type::result: {
+        if (!result_cb(message, error)) return false;
+      } break;
+      case server_message_type::done: return true;
+      case server_message_type::error: {
+        if (!read_value(reader, error)) error = "bad message";
+        return false;
+      }
+      default: {
+        error = "bad message";
+        return false;
+      }
+    }
+  }
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF ASSET CACHE
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Modification time of a file
+bool get_modification_time(
+    const string& filename, int64_t& mtime, string& error) {
+  auto ec   = std::error_code{};
+  auto time = std::filesystem::last_write_time(filename, ec);
+  if (ec) {
+    error = filename + ": file not found";
+    return false;
+  }
+  mtime = (int64_t)time.time_since_epoch().count();
+  return true;
+}
+
+}  // namespace yocto
@@ -0,0 +1,323 @@
+//
+// # Yocto/Server: Local job server with a warm asset cache
+//
+//
+// Yocto/Server lets apps keep their assets loaded between runs. A server
+// listens on a Unix domain socket and runs the jobs of its clients one at a
+// time, so that each job uses all threads of the shared scheduler. Servers
+// keep loaded assets in a least-recently-used cache keyed by filename and
+// modification time, also checking the other files each asset was loaded
+// from, so repeated jobs on the same files skip all setup.
+// Clients send one job per connection, and receive progress and result
+// messages until the job is done or fails.
+//
+// 1. run a server with `run_server()`, that calls a handler for each job,
+//    and stop it with `stop_server()`
+// 2. submit a job with `run_client()`, that prints progress and passes the
+//    results to a callback
+// 3. encode payloads with `write_value()` on a `server_writer` and decode
+//    them with `read_value()` on a `server_reader`
+// 4. keep assets in a `server_cache` with `find_cache()` and `insert_cache()`
+//
+
+//
+// LICENSE:
+//
+//
+// Copyright (c) 2016 -- 2020 Fabio Pellacini
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+
+#ifndef _YOCTO_SERVER_H_
+#define _YOCTO_SERVER_H_
+
+// -----------------------------------------------------------------------------
+// INCLUDES
+// -----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// USING DIRECTIVES
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// using directives
+using std::function;
+using std::string;
+using std::vector;
+using byte = unsigned char;
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// MESSAGES
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Message types. Clients send a job, or a stop request. Servers reply with
+// progress and results, and end with done or error.
+enum struct server_message_type { job, stop, progress, result, done, error };
+
+// Message with its payload
+struct server_message {
+  server_message_type type = server_message_type::job;
+  vector<byte>        data = {};
+};
+
+// Connection to a server or a client, closed when destroyed
+struct server_socket {
+  server_socket() = default;
+  server_socket(const server_socket&) = delete;
+  server_socket& operator=(const server_socket&) = delete;
+  ~server_socket();
+
+  // private
+  int fd = -1;
+};
+
+// Sends and receives messages. Receiving fails on closed connections and on
+// payloads over 4GB.
+bool send_message(
+    server_socket& socket, const server_message& message, string& error);
+bool receive_message(
+    server_socket& socket, server_message& message, string& error);
+
+// Sends a progress message, that clients print with their progress callback
+bool send_progress(server_socket& socket, const string& message, int current,
+    int total, string& error);
+
+// Payload encoder
+struct server_writer {
+  vector<byte> data = {};
+};
+
+// Payload decoder over the data of a message
+struct server_reader {
+  const vector<byte>& data;
+  size_t              offset = 0;
+};
+
+// Encodes and decodes values, that are either strings, vectors, or trivially
+// copyable. Client and server are the same app, so values keep their layout.
+// Reading fails at the end of the payload.
+template <typename T>
+inline void write_value(server_writer& writer, const T& value);
+template <typename T>
+inline bool read_value(server_reader& reader, T& value);
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// SERVERS AND CLIENTS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Progress report callback
+using server_progress = function<void(const string&, int, int)>;
+
+// Job handler. Handlers send progress and results to the client, and return
+// false with an error if the job fails.
+using server_handler = function<bool(
+    server_socket& client, const server_message& job, string& error)>;
+
+// Result handler for clients, that returns false with an error on failure
+using server_result =
+    function<bool(const server_message& result, string& error)>;
+
+// Runs a server on the socket, until a client asks it to stop. Jobs run one at
+// a time, and failed jobs are reported to their client without stopping the
+// server. A socket left by a server that did not exit is replaced, but other
+// files are not. Only the user can connect, and clients that do not send
+// their job within ten seconds are dropped.
+bool run_server(
+    const string& socketname, const server_handler& handler, string& error);
+
+// Asks the server on the socket to stop
+bool stop_server(const string& socketname, string& error);
+
+// Submits a job to the server on the socket, printing progress and passing
+// results to result_cb, until the server is done with the job
+bool run_client(const string& socketname, const server_message& job,
+    const server_result& result_cb, const server_progress& progress_cb,
+    string& error);
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// ASSET CACHE
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Least-recently-used cache of assets, keyed by filename and modification
+// time, so that edited files are loaded again. Assets loaded from several
+// files also keep the modification times of the other files.
+template <typename T>
+struct server_cache {
+  struct entry {
+    string                             filename     = "";
+    int64_t                            mtime        = 0;
+    vector<std::pair<string, int64_t>> dependencies = {};
+    std::unique_ptr<T>                 value        = {};
+  };
+  int              capacity = 4;   // maximum number of assets
+  std::list<entry> entries  = {};  // most recently used first
+};
+
+// Modification time of a file, in clock ticks
+bool get_modification_time(
+    const string& filename, int64_t& mtime, string& error);
+
+// Finds an asset, making it the most recently used. Assets loaded from older
+// versions of the file, or of the other files they depend on, are removed.
+template <typename T>
+inline T* find_cache(
+    server_cache<T>& cache, const string& filename, int64_t mtime);
+
+// Adds an asset, removing the least recently used ones beyond capacity. The
+// modification times of the other files it was loaded from are recorded, so
+// that editing any of them loads the asset again.
+template <typename T>
+inline T* insert_cache(server_cache<T>& cache, const string& filename,
+    int64_t mtime, std::unique_ptr<T> value,
+    const vector<string>& dependencies = {});
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF PAYLOADS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Vectors are encoded by size and items
+template <typename T>
+struct is_server_vector : std::false_type {};
+template <typename T>
+struct is_server_vector<vector<T>> : std::true_type {};
+
+// Encodes a value
+template <typename T>
+inline void write_value(server_writer& writer, const T& value) {
+  if constexpr (std::is_same_v<T, string>) {
+    write_value(writer, (uint64_t)value.size());
+    writer.data.insert(writer.data.end(), value.begin(), value.end());
+  } else if constexpr (is_server_vector<T>::value) {
+    write_value(writer, (uint64_t)value.size());
+    for (auto& item : value) write_value(writer, item);
+  } else {
+    static_assert(std::is_trivially_copyable_v<T>, "not trivially copyable");
+    auto offset = writer.data.size();
+    writer.data.resize(offset + sizeof(T));
+    memcpy(writer.data.data() + offset, &value, sizeof(T));
+  }
+}
+
+// Decodes a value
+template <typename T>
+inline bool read_value(server_reader& reader, T& value) {
+  if constexpr (std::is_same_v<T, string>) {
+    auto size = (uint64_t)0;
+    if (!read_value(reader, size)) return false;
+    if (size > reader.data.size() - reader.offset) return false;
+    value.assign((const char*)reader.data.data() + reader.offset, size);
+    reader.offset += size;
+    return true;
+  } else if constexpr (is_server_vector<T>::value) {
+    auto size = (uint64_t)0;
+    if (!read_value(reader, size)) return false;
+    if (size > reader.data.size() - reader.offset) return false;
+    value.resize(size);
+    for (auto& item : value)
+      if (!read_value(reader, item)) return false;
+    return true;
+  } else {
+    static_assert(std::is_trivially_copyable_v<T>, "not trivially copyable");
+    if (sizeof(T) > reader.data.size() - reader.offset) return false;
+    memcpy(&value, reader.data.data() + reader.offset, sizeof(T));
+    reader.offset += sizeof(T);
+    return true;
+  }
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF ASSET CACHE
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Finds an asset, making it the most recently used
+template <typename T>
+inline T* find_cache(
+    server_cache<T>& cache, const string& filename, int64_t mtime) {
+  for (auto it = cache.entries.begin(); it != cache.entries.end(); ++it) {
+    if (it->filename != filename) continue;
+    auto edited = it->mtime != mtime;
+    for (auto& [dependency, dependency_mtime] : it->dependencies) {
+      auto current = (int64_t)0;
+      auto error   = string{};
+      if (!get_modification_time(dependency, current, error) ||
+          current != dependency_mtime)
+        edited = true;
+    }
+    if (edited) {
+      cache.entries.erase(it);
+      return nullptr;
+    }
+    cache.entries.splice(cache.entries.begin(), cache.entries, it);
+    return cache.entries.front().value.get();
+  }
+  return nullptr;
+}
+
+// Adds an asset, removing the least recently used ones beyond capacity.
+// Missing dependencies get an invalid time, so that they never match.
+template <typename T>
+inline T* insert_cache(server_cache<T>& cache, const string& filename,
+    int64_t mtime, std::unique_ptr<T> value,
+    const vector<string>& dependencies) {
+  auto dependency_mtimes = vector<std::pair<string, int64_t>>{};
+  for (auto& dependency : dependencies) {
+    auto dependency_mtime = (int64_t)0;
+    auto error            = string{};
+    if (!get_modification_time(dependency, dependency_mtime, error))
+      dependency_mtime = -1;
+    dependency_mtimes.push_back({dependency, dependency_mtime});
+  }
+  cache.entries.push_front(
+      {filename, mtime, std::move(dependency_mtimes), std::move(value)});
+  while ((int)cache.entries.size() > std::max(cache.capacity, 1))
+    cache.entries.pop_back();
+  return cache.entries.front().value.get();
+}
+
+}  // namespace yocto
+
+#endif
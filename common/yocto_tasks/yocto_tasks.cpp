@@ -0,0 +1,271 @@
+//
+// Implementation for Yocto/Tasks.
+//
+
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2020 Fabio Pellacini
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+
+#include "yocto_tasks.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <thread>
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF THE SCHEDULER
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Task with the group that waits for it and the timer of its phase
+struct task_item {
+  task_function         func  = {};
+  task_group*           group = nullptr;
+  std::atomic<int64_t>* timer = nullptr;
+};
+
+// Deque of tasks in a ring of fixed slots, so that queueing does not
+// allocate. Its owner works at the back, thieves steal from the front.
+// Tasks that do not fit are run by the thread that queues them.
+static const int task_slots = 256;
+struct task_deque {
+  std::mutex mutex             = {};
+  task_item  slots[task_slots] = {};
+  int64_t    front             = 0;
+  int64_t    back              = 0;
+};
+
+// Scheduler state. Deque 0 is shared by the threads that are not workers,
+// deque i + 1 is owned by worker i. Idle workers and waiting threads sleep
+// on wakeup, and parked counts the waiting ones.
+struct task_scheduler {
+  int                                  threads = 1;
+  vector<std::thread>                  workers = {};
+  vector<std::unique_ptr<task_deque>>  deques  = {};
+  std::atomic<int>                     queued  = 0;
+  std::atomic<int>                     parked  = 0;
+  std::atomic<bool>                    stop    = false;
+  std::mutex                           mutex   = {};
+  std::condition_variable              wakeup  = {};
+
+  // stops the workers after they finish their current tasks
+  ~task_scheduler();
+};
+
+// Deque of the calling thread
+static thread_local int task_deque_index = 0;
+
+// Timer of the calling thread, and depth of the tasks it runs, since only
+// the outermost task run by each worker is timed
+static thread_local std::atomic<int64_t>* task_timer = nullptr;
+static thread_local int                   task_depth = 0;
+
+// Global scheduler, started on first use. Its pointer is cached, so that
+// getting it once started does not lock.
+static std::mutex                      scheduler_mutex   = {};
+static std::unique_ptr<task_scheduler> scheduler         = {};
+static std::atomic<task_scheduler*>    current_scheduler = nullptr;
+static std::atomic<int>                thread_count      = 0;
+
+// Takes a task, first from the back of the deque of the calling thread, then
+// from the front of the others, starting from the next one to spread thieves
+static bool pop_task(task_scheduler* scheduler, task_item& task) {
+  if (scheduler->queued.load() <= 0) return false;
+  auto  ndeques = (int)scheduler->deques.size();
+  auto& own     = *scheduler->deques[task_deque_index];
+  {
+    auto lock = std::lock_guard{own.mutex};
+    if (own.back > own.front) {
+      own.back -= 1;
+      task = own.slots[own.back % task_slots];
+      scheduler->queued -= 1;
+      return true;
+    }
+  }
+  for (auto offset = 1; offset < ndeques; offset++) {
+    auto& other = *scheduler->deques[(task_deque_index + offset) % ndeques];
+    auto  lock  = std::lock_guard{other.mutex};
+    if (other.back == other.front) continue;
+    task = other.slots[other.front % task_slots];
+    other.front += 1;
+    scheduler->queued -= 1;
+    return true;
+  }
+  return false;
+}
+
+// Runs a task, unless its group was cancelled, recording its exception. The
+// last task of a group wakes the threads parked in wait. Neither the group
+// nor the timer are accessed after the count drops, since its waiter may
+// then return.
+static void run_task(task_scheduler* scheduler, task_item& task) {
+  auto group    = task.group;
+  auto timer    = task.timer;
+  auto timed    = timer && task_deque_index > 0 && task_depth == 0;
+  auto start    = timed ? std::chrono::steady_clock::now()
+                        : std::chrono::steady_clock::time_point{};
+  auto previous = task_timer;
+  task_timer    = timer;
+  task_depth += 1;
+  if (!group->cancelled()) {
+    try {
+      task.func.invoke(task.func.storage);
+    } catch (...) {
+      auto lock = std::lock_guard{group->mutex};
+      if (!group->error) group->error = std::current_exception();
+      group->canceled = true;
+    }
+  }
+  if (task.func.destroy) task.func.destroy(task.func.storage);
+  task_depth -= 1;
+  task_timer = previous;
+  if (timed) {
+    *timer += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start)
+                  .count();
+  }
+  if (group->pending.fetch_sub(1) == 1 && scheduler->parked.load() > 0) {
+    { auto lock = std::lock_guard{scheduler->mutex}; }
+    scheduler->wakeup.notify_all();
+  }
+}
+
+// Worker loop, that sleeps while there is nothing to run or steal
+static void run_worker(task_scheduler* scheduler, int index) {
+  task_deque_index = index;
+  auto task        = task_item{};
+  while (!scheduler->stop) {
+    if (pop_task(scheduler, task)) {
+      run_task(scheduler, task);
+      continue;
+    }
+    auto lock = std::unique_lock{scheduler->mutex};
+    scheduler->wakeup.wait(lock, [scheduler]() {
+      return scheduler->stop || scheduler->queued.load() > 0;
+    });
+  }
+}
+
+// Stops the workers after they finish their current tasks
+task_scheduler::~task_scheduler() {
+  {
+    auto lock = std::lock_guard{mutex};
+    stop      = true;
+  }
+  wakeup.notify_all();
+  for (auto& worker : workers) worker.join();
+}
+
+// Gets the scheduler, starting it if needed
+static task_scheduler* get_scheduler() {
+  if (auto current = current_scheduler.load(std::memory_order_acquire))
+    return current;
+  auto lock = std::lock_guard{scheduler_mutex};
+  if (scheduler) return scheduler.get();
+  auto threads = thread_count.load();
+  if (threads <= 0) threads = (int)std::thread::hardware_concurrency();
+  scheduler          = std::make_unique<task_scheduler>();
+  scheduler->threads = std::max(threads, 1);
+  for (auto idx = 0; idx < scheduler->threads; idx++)
+    scheduler->deques.push_back(std::make_unique<task_deque>());
+  for (auto idx = 1; idx < scheduler->threads; idx++)
+    scheduler->workers.emplace_back(run_worker, scheduler.get(), idx);
+  current_scheduler.store(scheduler.get(), std::memory_order_release);
+  return scheduler.get();
+}
+
+// Number of threads
+void set_thread_count(int threads) {
+  auto lock = std::lock_guard{scheduler_mutex};
+  thread_count = threads;
+  current_scheduler.store(nullptr, std::memory_order_release);
+  scheduler.reset();
+}
+int get_thread_count() { return get_scheduler()->threads; }
+
+// Timer of the tasks queued by the calling thread
+std::atomic<int64_t>* set_task_timer(std::atomic<int64_t>* timer) {
+  auto previous = task_timer;
+  task_timer    = timer;
+  return previous;
+}
+
+// Task groups
+task_group::~task_group() {
+  try {
+    wait();
+  } catch (...) {
+  }
+}
+void task_group::push(const task_function& func) {
+  auto scheduler = get_scheduler();
+  pending += 1;
+  auto task   = task_item{func, this, task_timer};
+  auto queued = false;
+  if (scheduler->threads > 1) {
+    auto& own  = *scheduler->deques[task_deque_index];
+    auto  lock = std::lock_guard{own.mutex};
+    if (own.back - own.front < task_slots) {
+      own.slots[own.back % task_slots] = task;
+      own.back += 1;
+      scheduler->queued += 1;
+      queued = true;
+    }
+  }
+  if (!queued) {
+    run_task(scheduler, task);
+    return;
+  }
+  // sync with sleeping threads so that the wakeup is not lost
+  { auto lock = std::lock_guard{scheduler->mutex}; }
+  scheduler->wakeup.notify_one();
+}
+void task_group::wait() {
+  auto scheduler = get_scheduler();
+  auto task      = task_item{};
+  while (pending.load() > 0) {
+    if (pop_task(scheduler, task)) {
+      run_task(scheduler, task);
+      continue;
+    }
+    // park until the tasks run by others are done, or new ones are queued
+    auto lock = std::unique_lock{scheduler->mutex};
+    scheduler->parked += 1;
+    scheduler->wakeup.wait(lock, [this, scheduler]() {
+      return pending.load() <= 0 || scheduler->queued.load() > 0;
+    });
+    scheduler->parked -= 1;
+  }
+  auto lock = std::lock_guard{mutex};
+  if (error) {
+    auto exception = error;
+    error          = {};
+    std::rethrow_exception(exception);
+  }
+}
+void task_group::cancel() { canceled = true; }
+bool task_group::cancelled() const { return canceled.load(); }
+
+}  // namespace yocto
@@ -0,0 +1,235 @@
+//
+// # Yocto/Tasks: Shared work-stealing task scheduler
+//
+//
+// Yocto/Tasks runs the parallel work of all libraries on a single pool of
+// threads. Each worker owns a deque of tasks: it pushes and pops its own tasks
+// at the back, while idle workers steal from the front of the others. Threads
+// that wait for tasks run queued tasks meanwhile, so parallel loops can be
+// nested, as shapes x vertices or tiles x samples, without oversubscribing
+// the cores.
+//
+// 1. set the number of threads with `set_thread_count()`, before any parallel
+//    work, or leave the default of one thread per core
+// 2. run loops with `parallel_range()` over items or `parallel_blocks()` over
+//    ranges of items, and reductions with `parallel_reduce()`, whose result
+//    does not depend on scheduling
+// 3. run heterogeneous tasks with a `task_group`, that waits for them, can
+//    cancel the ones not yet started and rethrows the first exception
+//
+
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2020 Fabio Pellacini
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+
+#ifndef _YOCTO_TASKS_H_
+#define _YOCTO_TASKS_H_
+
+// -----------------------------------------------------------------------------
+// INCLUDES
+// -----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// USING DIRECTIVES
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// using directives
+using std::function;
+using std::vector;
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// TASK SCHEDULER
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Number of threads used by all parallel work, including the calling thread.
+// Zero sets one thread per core, and one runs everything serially. Set it
+// before any parallel work, since changing it restarts the workers.
+void set_thread_count(int threads);
+int  get_thread_count();
+
+// Timer of the tasks queued by the calling thread, that adds the time spent
+// by workers running them, in nanoseconds, and is inherited by the tasks they
+// queue in turn. It measures the thread utilization of a phase without
+// counting the tasks of other threads. Tasks are only timed while set, since
+// timing reads the clock twice per task. Returns the previous timer.
+std::atomic<int64_t>* set_task_timer(std::atomic<int64_t>* timer);
+
+// Callable run by a task. Small callables that can be copied bytewise, as
+// lambdas capturing references and pointers, are stored inline, so that
+// running them does not allocate. Other callables are moved to the heap.
+struct task_function {
+  alignas(std::max_align_t) unsigned char storage[48] = {};
+  void (*invoke)(void* storage)                        = nullptr;
+  void (*destroy)(void* storage)                       = nullptr;
+};
+
+// Makes a task callable from any function object
+template <typename Func>
+inline task_function make_task_function(Func&& func);
+
+// Group of tasks that run on the scheduler. Waiting runs queued tasks until
+// all tasks of the group are done, then sleeps until the tasks run by other
+// threads are, and rethrows the first exception thrown by them. Cancelling
+// skips the tasks not yet started, and running tasks can check `cancelled()`
+// to stop early.
+struct task_group {
+  task_group() = default;
+  task_group(const task_group&) = delete;
+  task_group& operator=(const task_group&) = delete;
+  ~task_group();
+
+  template <typename Func>
+  void run(Func&& task) {
+    push(make_task_function(std::forward<Func>(task)));
+  }
+  void wait();
+  void cancel();
+  bool cancelled() const;
+
+  // private
+  void               push(const task_function& task);
+  std::atomic<int>   pending  = 0;
+  std::atomic<bool>  canceled = false;
+  std::mutex         mutex    = {};
+  std::exception_ptr error    = {};
+};
+
+// Runs func(start, end) on blocks of [0, size), of size block. Blocks are
+// taken in order by as many tasks as threads, so nested calls share the
+// workers with their callers. Small loops and loops with one thread run
+// serially on the calling thread.
+template <typename Func>
+inline void parallel_blocks(int size, Func&& func, int block = 4096);
+
+// Runs func(idx) for idx in [0, size), in blocks of grain items
+template <typename Func>
+inline void parallel_range(int size, Func&& func, int grain = 1);
+
+// Reduces [0, size) by computing func(start, end) on blocks of size block,
+// and combining their results with reduce from init in block order, so the
+// result is the same for any thread count.
+template <typename T, typename Func, typename Reduce>
+inline T parallel_reduce(
+    int size, const T& init, Func&& func, Reduce&& reduce, int block = 4096);
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF PARALLEL LOOPS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Makes a task callable, inline when it fits
+template <typename Func>
+inline task_function make_task_function(Func&& func) {
+  using Callable = std::decay_t<Func>;
+  auto task      = task_function{};
+  if constexpr (sizeof(Callable) <= sizeof(task.storage) &&
+                alignof(Callable) <= alignof(std::max_align_t) &&
+                std::is_trivially_copyable_v<Callable>) {
+    new (task.storage) Callable(std::forward<Func>(func));
+    task.invoke = [](void* storage) {
+      (*std::launder((Callable*)storage))();
+    };
+  } else {
+    *(Callable**)task.storage = new Callable(std::forward<Func>(func));
+    task.invoke  = [](void* storage) { (**(Callable**)storage)(); };
+    task.destroy = [](void* storage) { delete *(Callable**)storage; };
+  }
+  return task;
+}
+
+// Runs func(start, end) on blocks of [0, size)
+template <typename Func>
+inline void parallel_blocks(int size, Func&& func, int block) {
+  auto nblocks = (size + block - 1) / block;
+  auto ntasks  = std::min(nblocks, get_thread_count());
+  if (ntasks <= 1) {
+    for (auto idx = 0; idx < nblocks; idx++)
+      func(idx * block, std::min(size, (idx + 1) * block));
+    return;
+  }
+  auto next  = std::atomic<int>{0};
+  auto group = task_group{};
+  auto body  = [&func, &next, &group, size, block, nblocks]() {
+    while (!group.cancelled()) {
+      auto idx = next.fetch_add(1);
+      if (idx >= nblocks) break;
+      func(idx * block, std::min(size, (idx + 1) * block));
+    }
+  };
+  for (auto task = 1; task < ntasks; task++) group.run(body);
+  try {
+    body();
+  } catch (...) {
+    group.cancel();
+    group.wait();
+    throw;
+  }
+  group.wait();
+}
+
+// Runs func(idx) for idx in [0, size)
+template <typename Func>
+inline void parallel_range(int size, Func&& func, int grain) {
+  parallel_blocks(
+      size,
+      [&func](int start, int end) {
+        for (auto idx = start; idx < end; idx++) func(idx);
+      },
+      grain);
+}
+
+// Reduces [0, size) in block order
+template <typename T, typename Func, typename Reduce>
+inline T parallel_reduce(
+    int size, const T& init, Func&& func, Reduce&& reduce, int block) {
+  auto nblocks  = (size + block - 1) / block;
+  auto partials = vector<T>(nblocks, init);
+  parallel_range(nblocks, [&partials, &func, size, block](int idx) {
+    partials[idx] = func(idx * block, std::min(size, (idx + 1) * block));
+  });
+  auto result = init;
+  for (auto& partial : partials) result = reduce(result, partial);
+  return result;
+}
+
+}  // namespace yocto
+
+#endif
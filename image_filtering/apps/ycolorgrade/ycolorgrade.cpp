@@ -30,13 +30,88 @@
 #include <yocto/yocto_image.h>
 #include <yocto/yocto_math.h>
 #include <yocto_colorgrade/yocto_colorgrade.h>
+#include <yocto_profile/yocto_profile.h>
+#include <yocto_server/yocto_server.h>
+#include <yocto_tasks/yocto_tasks.h>
 using namespace yocto;
 
+#include <filesystem>
+
+// Grading job, sent by clients to the grading server
+struct grade_job {
+  string       filename = "";
+  grade_params params   = {};
+};
+
+// Encodes and decodes grading jobs
+static void write_job(server_writer& writer, const grade_job& job) {
+  write_value(writer, job.filename);
+  write_value(writer, job.params);
+}
+static bool read_job(server_reader& reader, grade_job& job) {
+  return read_value(reader, job.filename) && read_value(reader, job.params);
+}
+
+// Encodes and decodes graded images
+static void write_graded(server_writer& writer, const image<vec4b>& img) {
+  write_value(writer, img.imsize());
+  for (auto j = 0; j < img.imsize().y; j++)
+    for (auto i = 0; i < img.imsize().x; i++) write_value(writer, img[{i, j}]);
+}
+static bool read_graded(server_reader& reader, image<vec4b>& img) {
+  auto size = zero2i;
+  if (!read_value(reader, size) || size.x < 0 || size.y < 0) return false;
+  img.assign(size, vec4b{0, 0, 0, 0});
+  for (auto j = 0; j < size.y; j++)
+    for (auto i = 0; i < size.x; i++)
+      if (!read_value(reader, img[{i, j}])) return false;
+  return true;
+}
+
+// Runs a grading job on the server, loading its image only if not cached
+static bool run_job(server_cache<image<vec4f>>& cache, server_socket& client,
+    const server_message& message, string& error) {
+  auto reader = server_reader{message.data};
+  auto job    = grade_job{};
+  if (!read_job(reader, job)) {
+    error = "bad job";
+    return false;
+  }
+
+  // load, unless cached
+  auto mtime = (int64_t)0;
+  if (!get_modification_time(job.filename, mtime, error)) return false;
+  auto cached = find_cache(cache, job.filename, mtime);
+  if (!cached) {
+    if (!send_progress(client, "load image", 0, 1, error)) return false;
+    auto loaded = std::make_unique<image<vec4f>>();
+    if (!load_image(job.filename, *loaded, error)) return false;
+    cached = insert_cache(cache, job.filename, mtime, std::move(loaded));
+  }
+
+  // corrections
+  if (!send_progress(client, "grade image", 0, 1, error)) return false;
+  auto graded = float_to_byte(grade_image(*cached, job.params));
+  if (!send_progress(client, "grade image", 1, 1, error)) return false;
+
+  // send
+  auto writer = server_writer{};
+  write_graded(writer, graded);
+  return send_message(
+      client, {server_message_type::result, std::move(writer.data)}, error);
+}
+
 int main(int argc, const char* argv[]) {
   // command line parameters
-  auto params   = grade_params{};
-  auto output   = "out.png"s;
-  auto filename = "img.hdr"s;
+  auto params     = grade_params{};
+  auto output     = ""s;
+  auto filename   = ""s;
+  auto threads    = 0;
+  auto tracename  = ""s;
+  auto servename  = ""s;
+  auto servername = ""s;
+  auto stop       = false;
+  auto cache_size = 4;
 
   // parse command line
   auto cli = make_cli("yimgproc", "Transform images");
@@ -52,27 +127,94 @@ int main(int argc, const char* argv[]) {
   add_option(cli, "--grain,-g", params.grain, "Grain strength");
   add_option(cli, "--mosaic,-m", params.mosaic, "Mosaic size (pixels)");
   add_option(cli, "--grid,-G", params.grid, "Grid size (pixels)");
-  add_option(cli, "--outimage,-o", output, "Output image filename", true);
-  add_option(cli, "image", filename, "Input image filename", true);
+  add_option(cli, "--outimage,-o", output, "Output image filename", false);
+  add_option(cli, "image", filename, "Input image filename", false);
   add_option(cli, "--seppia/--no-seppia,-seppia", params.seppia, "Sepia effect");
   add_option(cli, "--effect/--no-effect,-eff", params.effect, "Effect");
   add_option(cli, "--sunset/--no-sunset,-sun", params.sunset, "Sunset effect");
   add_option(cli, "--vintage/--no-vintage,-vin", params.vintage, "Vintage movie effect");
   add_option(cli, "--red/--no-red,-red", params.red, "Grayscale with red effect");
+  add_option(cli, "--threads", threads, "Number of threads (0 for all cores)");
+  add_option(cli, "--trace", tracename, "Trace filename, in Chrome format");
+  add_option(cli, "--serve", servename, "Run a grading server on a socket");
+  add_option(cli, "--server", servername, "Grade on the server at a socket");
+  add_option(cli, "--stop-server", stop, "Stop the server at a socket");
+  add_option(cli, "--cache", cache_size, "Number of images kept by servers");
   parse_cli(cli, argc, argv);
+  set_thread_count(threads);
+
+  // traces are only saved at the end of a local run, never reached by servers
+  if (!tracename.empty() && (!servename.empty() || !servername.empty()))
+    print_fatal("--trace is not supported with servers");
+  if (!tracename.empty()) start_profiling();
+
+  // grading server, keeping images loaded across jobs
+  if (!servename.empty()) {
+    auto cache     = server_cache<image<vec4f>>{};
+    cache.capacity = cache_size;
+    auto handler   = [&cache](server_socket& client,
+                       const server_message& job, string& error) {
+      return run_job(cache, client, job, error);
+    };
+    auto ioerror = ""s;
+    if (!run_server(servename, handler, ioerror)) print_fatal(ioerror);
+    return 0;
+  }
+
+  // stop the grading server
+  if (!servername.empty() && stop) {
+    auto ioerror = ""s;
+    if (!stop_server(servername, ioerror)) print_fatal(ioerror);
+    return 0;
+  }
+
+  // images are required unless serving, since they are optional in the cli
+  if (filename.empty()) print_fatal("missing image filename");
+  if (output.empty()) print_fatal("missing output image filename");
+
+  // grade on the server, saving the image locally
+  if (!servername.empty()) {
+    auto writer = server_writer{};
+    write_job(writer,
+        grade_job{std::filesystem::absolute(filename).string(), params});
+    auto save_result = [&output](const server_message& result, string& error) {
+      auto reader = server_reader{result.data};
+      auto img    = image<vec4b>{};
+      if (!read_graded(reader, img)) {
+        error = "bad result";
+        return false;
+      }
+      return save_image(output, img, error);
+    };
+    auto ioerror = ""s;
+    if (!run_client(servername, {server_message_type::job, writer.data},
+            save_result, print_progress, ioerror))
+      print_fatal(ioerror);
+    return 0;
+  }
 
   // error buffer
   auto ioerror = ""s;
 
   // load
-  auto img = image<vec4f>{};
+  auto loading = profile_scope{"load image"};
+  auto img     = image<vec4f>{};
   if (!load_image(filename, img, ioerror)) print_fatal(ioerror);
+  loading.end();
 
   // corrections
-  img = grade_image(img, params);
+  auto grading = profile_scope{"grade image"};
+  img          = grade_image(img, params);
+  grading.end();
 
   // save
+  auto saving = profile_scope{"save image"};
   if (!save_image(output, float_to_byte(img), ioerror)) print_fatal(ioerror);
+  saving.end();
+
+  // save trace
+  if (!tracename.empty() && !save_profile(tracename, ioerror))
+    print_fatal(ioerror);
 
   // done
   return 0;
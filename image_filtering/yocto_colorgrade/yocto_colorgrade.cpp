@@ -34,6 +34,7 @@
 
 #include <yocto/yocto_color.h>
 #include <yocto/yocto_sampling.h>
+#include <yocto_tasks/yocto_tasks.h>
 
 #include <iostream>
 using namespace std;
@@ -49,11 +50,19 @@ image<vec4f> grade_image(const image<vec4f>& img, const grade_params& params) {
   auto size   = graded.imsize();
   auto w      = size[0];
   auto h      = size[1];
-  auto rng    = make_rng(172784);
 
-  //ci metto di pi a fare prima w e poi h -> cache misses
+  // film grain drawn serially, in the column order of the original loop, so
+  // that the rows below can be graded in parallel with the same output
+  auto grain = image<float>{size, 0.0f};
+  auto rng   = make_rng(172784);
   for (int i = 0; i < w; i++) {
     for (int j = 0; j < h; j++) {
+      grain[{i, j}] = (rand1f(rng) - 0.5) * params.grain;
+    }
+  }
+
+  parallel_range(h, [&](int j) {
+    for (int i = 0; i < w; i++) {
       auto c = xyz(graded[{i, j}]); //trovo il mio colore e ignoro l'opacit
       
       // Tone mapping
@@ -96,21 +105,25 @@ image<vec4f> grade_image(const image<vec4f>& img, const grade_params& params) {
       graded[{i, j}] = vec4f{c.x, c.y, c.z, 1};
 
       // Film grain
-      c              = c + (rand1f(rng) - 0.5) * params.grain;
+      c              = c + grain[{i, j}];
       graded[{i, j}] = vec4f{c.x, c.y, c.z, 1};
-
-      // Mosaic effect
-      if (params.mosaic != 0) {
-        int i1         = i - i % params.mosaic; //aggiorno i valori degli indici
-        int j1         = j - j % params.mosaic;
-        c              = xyz(graded[{i1, j1}]);
-        graded[{i, j}] = vec4f{c.x, c.y, c.z, 1};
-      }
     }
+  });
+
+  // Mosaic effect, in its own pass since it reads the anchor pixels of the
+  // other rows, that are never written here
+  if (params.mosaic != 0) {
+    parallel_range(h, [&](int j) {
+      for (int i = 0; i < w; i++) {
+        int i1 = i - i % params.mosaic; //aggiorno i valori degli indici
+        int j1 = j - j % params.mosaic;
+        if (i1 != i || j1 != j) graded[{i, j}] = graded[{i1, j1}];
+      }
+    });
   }
    //Grid effect
-    for (int i = 0; i < w; i++) {
-      for (int j = 0; j < h; j++) {
+    parallel_range(h, [&](int j) {
+      for (int i = 0; i < w; i++) {
           /*messo in un altro for perch interferisce con Mosaic,
           in quanto i due filtri agiscono non solo sul pixel attuale ma anche sui circostanti*/
           auto c = xyz(graded[{i, j}]);
@@ -123,12 +136,12 @@ image<vec4f> grade_image(const image<vec4f>& img, const grade_params& params) {
 
       
       }
-    }
+    });
 
     //FILTRI AGGIUNTIVI
 
-     for (int i = 0; i < w; i++) {
-      for (int j = 0; j < h; j++) {
+     parallel_range(h, [&](int j) {
+      for (int i = 0; i < w; i++) {
         
         // Filtro seppia
         auto c = xyz(graded[{i, j}]);
@@ -187,14 +200,14 @@ image<vec4f> grade_image(const image<vec4f>& img, const grade_params& params) {
         }
 
       }
-    }
+    });
 
      /*I quattro cicli for che seguono, fanno parte dello stesso filtro: ho modificato l'immagine in quattro parti diverse, 
      per creare un filtro Pop Art*/
   
      //giallo
-     for (int i = 0; i < w/2; i++) {
-       for (int j = 0; j < h/2; j++) {
+     parallel_range(h/2, [&](int j) {
+       for (int i = 0; i < w/2; i++) {
          auto c = xyz(graded[{i, j}]);
          if (params.effect) {
            c = gain(c, 1 + params.contrast);
@@ -216,11 +229,12 @@ image<vec4f> grade_image(const image<vec4f>& img, const grade_params& params) {
           }
 
         }
-      }
+      });
      
      //azzurro
-     for (int i = w/2; i < w; i++) {
-       for (int j = h/2; j < h; j++) {
+     parallel_range(h - h/2, [&](int j0) {
+       auto j = h/2 + j0;
+       for (int i = w/2; i < w; i++) {
          auto c = xyz(graded[{i, j}]);
          if (params.effect) {
            c      = gain(c, 1 + params.contrast);
@@ -240,11 +254,11 @@ image<vec4f> grade_image(const image<vec4f>& img, const grade_params& params) {
            graded[{i, j}] = vec4f{c.x, c.y, c.z, 1};
          }
        }
-     }
+     });
 
      //verde
-     for (int i = w / 2; i < w; i++) {
-       for (int j = 0; j < h/2; j++) {
+     parallel_range(h/2, [&](int j) {
+       for (int i = w / 2; i < w; i++) {
          auto c = xyz(graded[{i, j}]);
          if (params.effect) {
            c      = gain(c, 1 + params.contrast);
@@ -264,11 +278,12 @@ image<vec4f> grade_image(const image<vec4f>& img, const grade_params& params) {
            graded[{i, j}] = vec4f{c.x, c.y, c.z, 1};
          }
        }
-     }
+     });
     
      //rosso
-     for (int i = 0; i < w/2; i++) {
-       for (int j = h/2; j < h; j++) {
+     parallel_range(h - h/2, [&](int j0) {
+       auto j = h/2 + j0;
+       for (int i = 0; i < w/2; i++) {
          auto c = xyz(graded[{i, j}]);
          if (params.effect) {
            c      = gain(c, 1 + params.contrast);
@@ -288,7 +303,7 @@ image<vec4f> grade_image(const image<vec4f>& img, const grade_params& params) {
            graded[{i, j}] = vec4f{c.x, c.y, c.z, 1};
          }
        }
-     }
+     });
 
 
 
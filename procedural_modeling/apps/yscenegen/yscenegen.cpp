@@ -34,6 +34,9 @@
 #include <yocto/yocto_sampling.h>
 #include <yocto/yocto_sceneio.h>
 #include <yocto/yocto_shape.h>
+#include <yocto_profile/yocto_profile.h>
+#include <yocto_sceneload/yocto_sceneload.h>
+#include <yocto_tasks/yocto_tasks.h>
 using namespace yocto;
 
 #include <filesystem>
@@ -216,19 +219,23 @@ void make_terrain(sceneio_scene* scene, sceneio_instance* instance,
   
   /*scorro il vettore delle posizioni per creare
   la forma della montagna*/
-  for (int i = 0; i < pos.size(); i++) {
+  // vertices in parallel, with colors written in place
+  auto& colors = instance->shape->colors;
+  auto  offset = colors.size();
+  colors.resize(offset + pos.size());
+  parallel_range((int)pos.size(), [&](int i) {
     auto            h = (1 - length(pos[i] - params.center) / params.size) *params.height* ridge(pos[i] * params.scale, params.octaves); /*scalo il noise*/
     pos[i] += normal[i] * h;
     /*coloro le parti della montagna a seconda dell'altezza del vertice*/
     if (pos[i].y <= 0.030) {
-      instance->shape->colors.push_back(params.bottom);
+      colors[offset + i] = params.bottom;
     } else if (pos[i].y > 0.030 && pos[i].y <= 0.060) {
-      instance->shape->colors.push_back(params.middle);
+      colors[offset + i] = params.middle;
     } else {
-      instance->shape->colors.push_back(params.top);
+      colors[offset + i] = params.top;
     }
     instance->shape->positions[i] = pos[i];
-  }
+  }, 1024);
   instance->shape->normals = compute_normals(
       instance->shape->quads, instance->shape->positions);
 }
@@ -249,13 +256,16 @@ void make_terrain(sceneio_scene* scene, sceneio_instance* instance,
          const displacement_params& params) {
        auto pos     = instance->shape->positions;
        auto normals = instance->shape->normals;
-       for (int i = 0; i < pos.size(); i++) {
+       auto& colors = instance->shape->colors;
+       auto  offset = colors.size();
+       colors.resize(offset + pos.size());
+       parallel_range((int)pos.size(), [&](int i) {
          auto h                        = turbulence(pos[i] * params.scale, params.octaves) * params.height;
          pos[i]                        += normals[i] * h;
          /*coloro interpolando i vertici, perch il colore dipende dall'altezza tra bottom e top*/
-         instance->shape->colors.push_back(lerp(params.bottom, params.top, h/params.height));
+         colors[offset + i] = lerp(params.bottom, params.top, h/params.height);
          instance->shape->positions[i] = pos[i];
-       }
+       }, 1024);
        instance->shape->normals = compute_normals(
            instance->shape->quads, instance->shape->positions);
      }
@@ -296,10 +306,15 @@ void make_hair(sceneio_scene* scene, sceneio_instance* instance,
       instance->shape->positions, instance -> shape -> normals, instance -> shape -> texcoords, instance -> shape, params.num);
   
   /*ciclo sui numeri relativi a quanti capelli io debba inserire, partendo dalla size che mi ero salvata*/
-  for (int i = init; i < instance -> shape -> positions.size(); i++) {
+  // strands in parallel, then added in order so the shape is the same
+  auto strands  = (int)(instance->shape->positions.size() - init);
+  auto v_poss   = vector<vector<vec3f>>(strands);
+  auto v_colors = vector<vector<vec4f>>(strands);
+  parallel_range(strands, [&](int strand) {
+    auto i   = (int)init + strand;
     auto pos = instance->shape->positions[i];
-    auto v_pos   = vector<vec3f>{};
-    auto v_color = vector<vec4f>{};
+    auto& v_pos   = v_poss[strand];
+    auto& v_color = v_colors[strand];
     v_pos.push_back(pos);
     v_color.push_back(params.bottom);
     
@@ -314,8 +329,9 @@ void make_hair(sceneio_scene* scene, sceneio_instance* instance,
       v_color.push_back(lerp(params.bottom, params.top, (float) (j + 1) / (float) params.steps));
       pos = final;  
     }
-    add_polyline(hair->shape, v_pos, v_color);  
-  }
+  }, 256);
+  for (auto strand = 0; strand < strands; strand++)
+    add_polyline(hair->shape, v_poss[strand], v_colors[strand]);
   instance->shape->normals = compute_tangents(instance -> shape -> lines, instance->shape->positions);  
 
 }
@@ -369,13 +385,15 @@ struct voronoi_params {
 void make_voronoi(sceneio_scene* scene, sceneio_instance* instance, const voronoi_params& params) {
   auto pos     = instance->shape->positions;
   auto normals = instance->shape->normals;
-  for (int i = 0; i < pos.size(); i++) {
+  auto& colors = instance->shape->colors;
+  auto  offset = colors.size();
+  colors.resize(offset + pos.size());
+  parallel_range((int)pos.size(), [&](int i) {
     auto h = vturbulence(pos[i] * params.scale, params.octaves) * params.height;
     pos[i] += normals[i] * h;
-    instance->shape->colors.push_back(
-        lerp(params.bottom, params.top, h / params.height));
+    colors[offset + i] = lerp(params.bottom, params.top, h / params.height);
     instance->shape->positions[i] = pos[i];
-  }
+  }, 1024);
   instance->shape->normals = compute_normals(
       instance->shape->quads, instance->shape->positions);
 }
@@ -395,13 +413,15 @@ void make_spikenoise(sceneio_scene* scene, sceneio_instance* instance,
   auto pos     = instance->shape->positions;
   auto normals = instance->shape->normals;
   
-  for (int i = 0; i < pos.size(); i++) {
+  auto& colors = instance->shape->colors;
+  auto  offset = colors.size();
+  colors.resize(offset + pos.size());
+  parallel_range((int)pos.size(), [&](int i) {
     auto h = getBorder(pos[i] * params.scale) * params.height;
     pos[i] += normals[i] * h;
-    instance->shape->colors.push_back(
-        lerp(params.bottom, params.top, h / params.height));
+    colors[offset + i] = lerp(params.bottom, params.top, h / params.height);
     instance->shape->positions[i] = pos[i];
-  }
+  }, 1024);
   instance->shape->normals = compute_normals(
       instance->shape->quads, instance->shape->positions);
 }
@@ -426,6 +446,8 @@ int main(int argc, const char* argv[]) {
   auto vparams      = voronoi_params{};
   auto spikenoise    = ""s;
   auto sparams      = spikenoise_params{};
+  auto threads      = 0;
+  auto tracename    = ""s;
  
 
 
@@ -446,27 +468,37 @@ int main(int argc, const char* argv[]) {
   add_option(cli, "scene", filename, "input scene", true);
   add_option(cli, "--voronoi", voronoi, "voronoi object");
   add_option(cli, "--spikenoise", spikenoise, "spikenoise object");
+  add_option(cli, "--threads", threads, "Number of threads (0 for all cores)");
+  add_option(cli, "--trace", tracename, "trace filename, in Chrome format");
   parse_cli(cli, argc, argv);
+  set_thread_count(threads);
+  if (!tracename.empty()) start_profiling();
 
   // load scene
+  auto loading     = profile_scope{"load scene"};
   auto scene_guard = std::make_unique<sceneio_scene>();
   auto scene       = scene_guard.get();
   auto ioerror     = ""s;
-  if (!load_scene(filename, scene, ioerror, print_progress))
+  if (!load_scene_parallel(filename, scene, ioerror, print_progress))
     print_fatal(ioerror);
+  loading.end();
 
   // create procedural geometry
   if (terrain != "") {
+    auto scope = profile_scope{"make terrain"};
     make_terrain(scene, get_instance(scene, terrain), tparams);
   }
   if (displacement != "") {
+    auto scope = profile_scope{"make displacement"};
     make_displacement(scene, get_instance(scene, displacement), dparams);
   }
   if (hair != "") {
+    auto scope = profile_scope{"make hair"};
     make_hair(scene, get_instance(scene, hairbase), get_instance(scene, hair),
         hparams);
   }
   if (grass != "") {
+    auto scope   = profile_scope{"make grass"};
     auto grasses = vector<sceneio_instance*>{};
     for (auto instance : scene->instances)
       if (instance->name.find(grass) != scene->name.npos)
@@ -474,10 +506,12 @@ int main(int argc, const char* argv[]) {
     make_grass(scene, get_instance(scene, grassbase), grasses, gparams);
   }
   if (voronoi != "") {
+    auto scope = profile_scope{"make voronoi"};
     make_voronoi(scene, get_instance(scene, voronoi), vparams);
   }
   
   if (spikenoise != "") {
+    auto scope = profile_scope{"make spikenoise"};
     make_spikenoise(scene, get_instance(scene, spikenoise), sparams);
   }
 
@@ -493,7 +527,13 @@ int main(int argc, const char* argv[]) {
   }
 
   // save scene
+  auto saving = profile_scope{"save scene"};
   if (!save_scene(output, scene, ioerror, print_progress)) print_fatal(ioerror);
+  saving.end();
+
+  // save trace
+  if (!tracename.empty() && !save_profile(tracename, ioerror))
+    print_fatal(ioerror);
 
   // done
   return 0;
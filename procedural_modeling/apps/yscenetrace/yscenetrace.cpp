@@ -31,6 +31,8 @@
 #include <yocto/yocto_math.h>
 #include <yocto/yocto_sceneio.h>
 #include <yocto/yocto_trace.h>
+#include <yocto_profile/yocto_profile.h>
+#include <yocto_sceneload/yocto_sceneload.h>
 using namespace yocto;
 
 #include <map>
@@ -171,6 +173,7 @@ int main(int argc, const char* argv[]) {
   auto imfilename     = "out.hdr"s;
   auto filename       = "scene.json"s;
   auto feature_images = false;
+  auto tracename      = ""s;
 
   // parse command line
   auto cli = make_cli("yscenetrace", "Offline path tracing");
@@ -193,14 +196,18 @@ int main(int argc, const char* argv[]) {
   add_option(cli, "scene", filename, "Scene filename", true);
   add_option(cli, "--denoise-features,-d", feature_images,
       "Generate denoise feature images");
+  add_option(cli, "--trace", tracename, "Trace filename, in Chrome format.");
   parse_cli(cli, argc, argv);
+  if (!tracename.empty()) start_profiling();
 
   // scene loading
+  auto loading       = profile_scope{"load scene"};
   auto ioscene_guard = std::make_unique<sceneio_scene>();
   auto ioscene       = ioscene_guard.get();
   auto ioerror       = ""s;
-  if (!load_scene(filename, ioscene, ioerror, print_progress))
+  if (!load_scene_parallel(filename, ioscene, ioerror, print_progress))
     print_fatal(ioerror);
+  loading.end();
 
   // add sky
   if (add_skyenv) add_sky(ioscene);
@@ -209,6 +216,7 @@ int main(int argc, const char* argv[]) {
   auto iocamera = get_camera(ioscene, camera_name);
 
   // scene conversion
+  auto converting  = profile_scope{"convert scene"};
   auto scene_guard = std::make_unique<trace_scene>();
   auto scene       = scene_guard.get();
   auto camera      = (trace_camera*)nullptr;
@@ -219,11 +227,14 @@ int main(int argc, const char* argv[]) {
 
   // tesselation
   tesselate_shapes(scene, print_progress);
+  converting.end();
 
   // build bvh
+  auto building  = profile_scope{"build bvh"};
   auto bvh_guard = std::make_unique<trace_bvh>();
   auto bvh       = bvh_guard.get();
   init_bvh(bvh, scene, params, print_progress);
+  building.end();
 
   // init renderer
   auto lights_guard = std::make_unique<trace_lights>();
@@ -237,6 +248,8 @@ int main(int argc, const char* argv[]) {
   }
 
   // render
+  auto rendering = profile_scope{"render image"};
+
   auto render = trace_image(scene, camera, bvh, lights, params, print_progress,
       [save_batch, imfilename](
           const image<vec4f>& render, int sample, int samples) {
@@ -248,13 +261,17 @@ int main(int argc, const char* argv[]) {
         print_progress("save image", sample, samples);
         if (!save_image(outfilename, render, ioerror)) print_fatal(ioerror);
       });
+  rendering.end();
 
   // save image
+  auto saving = profile_scope{"save image"};
   print_progress("save image", 0, 1);
   if (!save_image(imfilename, render, ioerror)) print_fatal(ioerror);
   print_progress("save image", 1, 1);
+  saving.end();
 
   if (feature_images) {
+    auto        features        = profile_scope{"render features"};
     const int   feature_bounces = 5;
     const int   feature_samples = 8;
     std::string feature_ext     = "exr"s;
@@ -289,6 +306,10 @@ int main(int argc, const char* argv[]) {
     print_progress("save normal feature", 1, 1);
   }
 
+  // save trace
+  if (!tracename.empty() && !save_profile(tracename, ioerror))
+    print_fatal(ioerror);
+
   // done
   return 0;
 }
@@ -0,0 +1,543 @@
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2020 Fabio Pellacini
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include <yocto/yocto_commonio.h>
+#include <yocto/yocto_math.h>
+#include <yocto/yocto_sampling.h>
+#include <yocto/yocto_sceneio.h>
+#include <yocto_raytrace/yocto_raytrace.h>
+#include <yocto_sceneload/yocto_sceneload.h>
+#include <yocto_tasks/yocto_tasks.h>
+using namespace yocto;
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+
+// Soup of count random small triangles in the unit cube, as in foliage
+void make_triangle_soup(raytrace_scene* scene, int count) {
+  auto rng       = make_rng(172784);
+  auto triangles = vector<vec3i>{};
+  auto positions = vector<vec3f>{};
+  auto size      = 2 / std::cbrt((float)count);
+  for (auto idx = 0; idx < count; idx++) {
+    auto center = rand3f(rng) * 2 - 1;
+    for (auto vert = 0; vert < 3; vert++)
+      positions.push_back(center + (rand3f(rng) - 0.5f) * size);
+    triangles.push_back({idx * 3 + 0, idx * 3 + 1, idx * 3 + 2});
+  }
+  auto shape = add_shape(scene);
+  set_triangles(shape, triangles);
+  set_positions(shape, positions);
+  set_shape(add_instance(scene), shape);
+}
+
+// Terrain of size x size quads, split in triangles, over the unit square
+raytrace_shape* make_terrain(raytrace_scene* scene, int size) {
+  auto triangles = vector<vec3i>{};
+  auto positions = vector<vec3f>{};
+  for (auto j = 0; j <= size; j++) {
+    for (auto i = 0; i <= size; i++) {
+      auto uv = vec2f{i / (float)size, j / (float)size};
+      positions.push_back({2 * uv.x - 1,
+          0.2f * std::sin(12 * uv.x) * std::cos(9 * uv.y), 2 * uv.y - 1});
+    }
+  }
+  for (auto j = 0; j < size; j++) {
+    for (auto i = 0; i < size; i++) {
+      auto vid = j * (size + 1) + i;
+      triangles.push_back({vid, vid + 1, vid + size + 2});
+      triangles.push_back({vid, vid + size + 2, vid + size + 1});
+    }
+  }
+  auto shape = add_shape(scene);
+  set_triangles(shape, triangles);
+  set_positions(shape, positions);
+  return shape;
+}
+
+// Grid of count x count rotated instances of a terrain
+void make_terrain_instances(raytrace_scene* scene, int count, int size) {
+  auto shape = make_terrain(scene, size);
+  for (auto j = 0; j < count; j++) {
+    for (auto i = 0; i < count; i++) {
+      auto frame = rotation_frame({0, 1, 0}, (float)(j * count + i));
+      frame.o    = {2 * (i + 0.5f) / count - 1, 0, 2 * (j + 0.5f) / count - 1};
+      auto instance = add_instance(scene);
+      set_shape(instance, shape);
+      set_frame(instance, frame * scaling_frame(vec3f{1, 1, 1} / count));
+    }
+  }
+}
+
+// Benchmark scene, whose elements fit in the unit cube
+struct bench_scene {
+  string                          name      = "";
+  int                             triangles = 0;
+  std::unique_ptr<raytrace_scene> scene     = {};
+};
+
+vector<bench_scene> make_bench_scenes(int max_triangles) {
+  auto scenes = vector<bench_scene>{};
+  for (auto count = 1 << 14; count <= max_triangles; count *= 4) {
+    auto& soup     = scenes.emplace_back();
+    soup.name      = "soup_" + std::to_string(count);
+    soup.triangles = count;
+    soup.scene     = std::make_unique<raytrace_scene>();
+    make_triangle_soup(soup.scene.get(), count);
+  }
+  for (auto size = 64; 2 * size * size <= max_triangles; size *= 2) {
+    auto& terrain     = scenes.emplace_back();
+    terrain.name      = "terrain_" + std::to_string(2 * size * size);
+    terrain.triangles = 2 * size * size;
+    terrain.scene     = std::make_unique<raytrace_scene>();
+    make_terrain(terrain.scene.get(), size);
+    set_shape(add_instance(terrain.scene.get()), terrain.scene->shapes[0]);
+  }
+  for (auto size = 64; 2 * size * size * 256 <= max_triangles; size *= 2) {
+    auto& instances     = scenes.emplace_back();
+    instances.name      = "instances_" + std::to_string(2 * size * size * 256);
+    instances.triangles = 2 * size * size * 256;
+    instances.scene     = std::make_unique<raytrace_scene>();
+    make_terrain_instances(instances.scene.get(), 16, size);
+  }
+  return scenes;
+}
+
+// Bytes used by a bvh
+size_t get_bvh_bytes(const raytrace_bvh_tree* bvh) {
+  return bvh->nodes.size() * sizeof(raytrace_bvh_node) +
+         bvh->qnodes.size() * sizeof(raytrace_bvh_qnode) +
+         bvh->primitives.size() * sizeof(int);
+}
+
+// Benchmark result for one scene and bvh type
+struct bench_result {
+  string scene          = "";
+  string bvh            = "";
+  int    triangles      = 0;
+  size_t nodes          = 0;
+  size_t bytes          = 0;
+  double build_seconds  = 0;
+  double camera_seconds = 0;
+  double random_seconds = 0;
+  int    camera_hits    = 0;
+  int    random_hits    = 0;
+  int    rays           = 0;
+};
+
+// Traces rays in parallel over rows, counting hits. Camera rays leave a
+// pinhole looking at the scene, random rays have random origins in the scene
+// bounds and random directions, as for indirect bounces.
+int trace_rays(const raytrace_scene* scene, int resolution, bool random) {
+  auto hits   = std::atomic<int>{0};
+  auto camera = lookat_frame({0, 1, 3}, {0, 0, 0}, {0, 1, 0});
+  parallel_range(resolution, [&](int j) {
+    auto rng      = make_rng(961748941ull, j * 2 + 1);
+    auto row_hits = 0;
+    for (auto i = 0; i < resolution; i++) {
+      auto ray = ray3f{};
+      if (random) {
+        ray = {rand3f(rng) * 2 - 1, sample_sphere(rand2f(rng))};
+      } else {
+        auto uv = vec2f{(i + 0.5f) / resolution, (j + 0.5f) / resolution};
+        ray     = {camera.o,
+            transform_direction(camera, {uv.x - 0.5f, 0.5f - uv.y, -1})};
+      }
+      if (intersect_scene_bvh(scene, ray).hit) row_hits++;
+    }
+    hits += row_hits;
+  });
+  return hits;
+}
+
+// Seconds elapsed since start
+double elapsed_seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+bench_result run_bench(
+    const bench_scene& scene, const raytrace_params& params, int resolution) {
+  auto result      = bench_result{};
+  result.scene     = scene.name;
+  result.bvh       = raytrace_bvh_names[(int)params.bvh];
+  result.triangles = scene.triangles;
+  result.rays      = resolution * resolution;
+  auto start       = std::chrono::steady_clock::now();
+  init_bvh(scene.scene.get(), params);
+  result.build_seconds = elapsed_seconds(start);
+  auto bvhs = vector<const raytrace_bvh_tree*>{scene.scene->bvh};
+  for (auto shape : scene.scene->shapes) bvhs.push_back(shape->bvh);
+  for (auto bvh : bvhs) {
+    result.nodes += bvh->nodes.size() + bvh->qnodes.size();
+    result.bytes += get_bvh_bytes(bvh);
+  }
+  start                 = std::chrono::steady_clock::now();
+  result.camera_hits    = trace_rays(scene.scene.get(), resolution, false);
+  result.camera_seconds = elapsed_seconds(start);
+  start                 = std::chrono::steady_clock::now();
+  result.random_hits    = trace_rays(scene.scene.get(), resolution, true);
+  result.random_seconds = elapsed_seconds(start);
+  return result;
+}
+
+// Index of a scene element, or -1 for none, to compare references
+struct raster_result {
+  string scene              = "";
+  int    triangles          = 0;
+  int    samples            = 0;
+  double traced_seconds     = 0;
+  double rasterized_seconds = 0;
+  int    different_pixels   = 0;
+};
+
+// Renders the scene with the eyelight shader, tracing and then rasterizing
+// first hits. The first rasterized pass includes binning the triangles.
+raster_result run_raster_bench(
+    const bench_scene& scene, int resolution, int samples) {
+  auto result      = raster_result{};
+  result.scene     = scene.name;
+  result.triangles = scene.triangles;
+  result.samples   = samples;
+  auto material    = add_material(scene.scene.get());
+  set_color(material, {0.8f, 0.8f, 0.8f});
+  for (auto instance : scene.scene->instances) set_material(instance, material);
+  auto camera = add_camera(scene.scene.get());
+  set_frame(camera, lookat_frame({0, 1, 3}, {0, 0, 0}, {0, 1, 0}));
+  set_lens(camera, 0.036f, 1, 0.036f);
+  auto params       = raytrace_params{};
+  params.resolution = resolution;
+  params.shader     = raytrace_shader_type::eyelight;
+  params.bvh        = raytrace_bvh_type::quantized;
+  init_bvh(scene.scene.get(), params);
+  auto render = [&](bool rasterize, double& seconds) {
+    auto state       = raytrace_state{};
+    params.rasterize = rasterize;
+    init_state(&state, scene.scene.get(), camera, params);
+    auto start = std::chrono::steady_clock::now();
+    for (auto sample = 0; sample < samples; sample++)
+      render_samples(&state, scene.scene.get(), camera, params);
+    seconds = elapsed_seconds(start);
+    return state.render;
+  };
+  auto traced     = render(false, result.traced_seconds);
+  auto rasterized = render(true, result.rasterized_seconds);
+  for (auto j = 0; j < traced.imsize().y; j++) {
+    for (auto i = 0; i < traced.imsize().x; i++) {
+      if (memcmp(&traced[{i, j}], &rasterized[{i, j}], sizeof(vec4f)) != 0)
+        result.different_pixels += 1;
+    }
+  }
+  return result;
+}
+
+template <typename T>
+int element_index(const vector<T*>& elements, const T* element) {
+  auto it = std::find(elements.begin(), elements.end(), element);
+  return it == elements.end() ? -1 : (int)(it - elements.begin());
+}
+
+// Exact comparisons of scene values, with pixels compared bytewise
+bool same_frame(const frame3f& a, const frame3f& b) {
+  return a.x == b.x && a.y == b.y && a.z == b.z && a.o == b.o;
+}
+template <typename T>
+bool same_image(const image<T>& a, const image<T>& b) {
+  return a.size() == b.size() &&
+         std::equal(a.begin(), a.end(), b.begin(), [](const T& x, const T& y) {
+           return memcmp(&x, &y, sizeof(T)) == 0;
+         });
+}
+
+// First difference between two scenes, compared field by field, or an empty
+// string if they are the same
+string compare_scenes(const sceneio_scene* scene, const sceneio_scene* other) {
+  auto difference = ""s;
+  auto check      = [&difference](bool same, const string& element,
+                   const string& field) {
+    if (!same && difference.empty()) difference = element + ": " + field;
+  };
+  auto check_texture = [&](const sceneio_texture* texture,
+                           const sceneio_texture* other_texture,
+                           const string& element, const string& field) {
+    check(element_index(scene->textures, texture) ==
+              element_index(other->textures, other_texture),
+        element, field);
+  };
+  check(scene->copyright == other->copyright, "scene", "copyright");
+  check(scene->cameras.size() == other->cameras.size(), "scene", "cameras");
+  check(scene->environments.size() == other->environments.size(), "scene",
+      "environments");
+  check(scene->textures.size() == other->textures.size(), "scene",
+      "textures");
+  check(scene->materials.size() == other->materials.size(), "scene",
+      "materials");
+  check(scene->shapes.size() == other->shapes.size(), "scene", "shapes");
+  check(scene->instances.size() == other->instances.size(), "scene",
+      "instances");
+  if (!difference.empty()) return difference;
+
+  for (auto idx = 0; idx < scene->cameras.size(); idx++) {
+    auto a = scene->cameras[idx], b = other->cameras[idx];
+    auto name = "camera " + a->name;
+    check(a->name == b->name, name, "name");
+    check(same_frame(a->frame, b->frame), name, "frame");
+    check(a->orthographic == b->orthographic, name, "orthographic");
+    check(a->lens == b->lens, name, "lens");
+    check(a->film == b->film, name, "film");
+    check(a->aspect == b->aspect, name, "aspect");
+    check(a->focus == b->focus, name, "focus");
+    check(a->aperture == b->aperture, name, "aperture");
+  }
+  for (auto idx = 0; idx < scene->environments.size(); idx++) {
+    auto a = scene->environments[idx], b = other->environments[idx];
+    auto name = "environment " + a->name;
+    check(a->name == b->name, name, "name");
+    check(same_frame(a->frame, b->frame), name, "frame");
+    check(a->emission == b->emission, name, "emission");
+    check_texture(a->emission_tex, b->emission_tex, name, "emission_tex");
+  }
+  for (auto idx = 0; idx < scene->textures.size(); idx++) {
+    auto a = scene->textures[idx], b = other->textures[idx];
+    auto name = "texture " + a->name;
+    check(a->name == b->name, name, "name");
+    check(same_image(a->hdr, b->hdr), name, "hdr");
+    check(same_image(a->ldr, b->ldr), name, "ldr");
+  }
+  for (auto idx = 0; idx < scene->materials.size(); idx++) {
+    auto a = scene->materials[idx], b = other->materials[idx];
+    auto name = "material " + a->name;
+    check(a->name == b->name, name, "name");
+    check(a->emission == b->emission, name, "emission");
+    check(a->color == b->color, name, "color");
+    check(a->specular == b->specular, name, "specular");
+    check(a->metallic == b->metallic, name, "metallic");
+    check(a->coat == b->coat, name, "coat");
+    check(a->roughness == b->roughness, name, "roughness");
+    check(a->ior == b->ior, name, "ior");
+    check(a->spectint == b->spectint, name, "spectint");
+    check(a->transmission == b->transmission, name, "transmission");
+    check(a->translucency == b->translucency, name, "translucency");
+    check(a->scattering == b->scattering, name, "scattering");
+    check(a->scanisotropy == b->scanisotropy, name, "scanisotropy");
+    check(a->trdepth == b->trdepth, name, "trdepth");
+    check(a->opacity == b->opacity, name, "opacity");
+    check(a->thin == b->thin, name, "thin");
+    check_texture(a->emission_tex, b->emission_tex, name, "emission_tex");
+    check_texture(a->color_tex, b->color_tex, name, "color_tex");
+    check_texture(a->specular_tex, b->specular_tex, name, "specular_tex");
+    check_texture(a->metallic_tex, b->metallic_tex, name, "metallic_tex");
+    check_texture(a->coat_tex, b->coat_tex, name, "coat_tex");
+    check_texture(a->roughness_tex, b->roughness_tex, name, "roughness_tex");
+    check_texture(a->spectint_tex, b->spectint_tex, name, "spectint_tex");
+    check_texture(
+        a->transmission_tex, b->transmission_tex, name, "transmission_tex");
+    check_texture(
+        a->translucency_tex, b->translucency_tex, name, "translucency_tex");
+    check_texture(
+        a->scattering_tex, b->scattering_tex, name, "scattering_tex");
+    check_texture(a->opacity_tex, b->opacity_tex, name, "opacity_tex");
+    check_texture(a->normal_tex, b->normal_tex, name, "normal_tex");
+  }
+  for (auto idx = 0; idx < scene->shapes.size(); idx++) {
+    auto a = scene->shapes[idx], b = other->shapes[idx];
+    auto name = "shape " + a->name;
+    check(a->name == b->name, name, "name");
+    check(a->points == b->points, name, "points");
+    check(a->lines == b->lines, name, "lines");
+    check(a->triangles == b->triangles, name, "triangles");
+    check(a->quads == b->quads, name, "quads");
+    check(a->positions == b->positions, name, "positions");
+    check(a->normals == b->normals, name, "normals");
+    check(a->texcoords == b->texcoords, name, "texcoords");
+    check(a->colors == b->colors, name, "colors");
+    check(a->radius == b->radius, name, "radius");
+  }
+  for (auto idx = 0; idx < scene->instances.size(); idx++) {
+    auto a = scene->instances[idx], b = other->instances[idx];
+    auto name = "instance " + a->name;
+    check(a->name == b->name, name, "name");
+    check(same_frame(a->frame, b->frame), name, "frame");
+    check(element_index(scene->shapes, a->shape) ==
+              element_index(other->shapes, b->shape),
+        name, "shape");
+    check(element_index(scene->materials, a->material) ==
+              element_index(other->materials, b->material),
+        name, "material");
+  }
+  return difference;
+}
+
+// Loads a scene with load_scene() and load_scene_parallel(), checking that
+// the scenes are the same and timing both loaders
+void check_scene_load(const string& filename) {
+  auto ioerror  = ""s;
+  auto scene    = std::make_unique<sceneio_scene>();
+  auto parallel = std::make_unique<sceneio_scene>();
+  auto start    = std::chrono::steady_clock::now();
+  if (!load_scene(filename, scene.get(), ioerror)) print_fatal(ioerror);
+  auto seconds = elapsed_seconds(start);
+  start        = std::chrono::steady_clock::now();
+  if (!load_scene_parallel(filename, parallel.get(), ioerror))
+    print_fatal(ioerror);
+  auto parallel_seconds = elapsed_seconds(start);
+  auto difference       = compare_scenes(scene.get(), parallel.get());
+  if (!difference.empty())
+    print_fatal(filename + ": parallel load differs in " + difference);
+  print_info(filename + ": same scene, load " + std::to_string(seconds) +
+             "s, parallel load " + std::to_string(parallel_seconds) + "s");
+}
+
+// Format results as json, with memory in bytes per triangle and throughput
+// in millions of rays per second
+string format_results(const vector<bench_result>& results) {
+  auto json = "{\n  \"results\": [\n"s;
+  for (auto idx = 0; idx < results.size(); idx++) {
+    auto& result = results[idx];
+    auto  mrays  = [&](double seconds) {
+      return std::to_string(result.rays / (seconds * 1e6));
+    };
+    json += "    {\"scene\": \"" + result.scene + "\", \"bvh\": \"" +
+            result.bvh +
+            "\", \"triangles\": " + std::to_string(result.triangles) +
+            ", \"nodes\": " + std::to_string(result.nodes) +
+            ", \"bytes\": " + std::to_string(result.bytes) + ",\n";
+    json += "     \"bytes_per_triangle\": " +
+            std::to_string((double)result.bytes / result.triangles) +
+            ", \"build_seconds\": " + std::to_string(result.build_seconds) +
+            ", \"camera_mrays_per_second\": " + mrays(result.camera_seconds) +
+            ", \"random_mrays_per_second\": " + mrays(result.random_seconds) +
+            ",\n";
+    json += "     \"camera_hits\": " + std::to_string(result.camera_hits) +
+            ", \"random_hits\": " + std::to_string(result.random_hits) + "}" +
+            (idx + 1 < results.size() ? "," : "") + "\n";
+  }
+  json += "  ]\n}\n";
+  return json;
+}
+
+string format_raster_results(
+    const vector<raster_result>& results, int resolution) {
+  auto json = "{\n  \"raster_results\": [\n"s;
+  for (auto idx = 0; idx < results.size(); idx++) {
+    auto& result  = results[idx];
+    auto  samples = [&](double seconds) {
+      return std::to_string((double)resolution * resolution * result.samples /
+                            (seconds * 1e6));
+    };
+    json += "    {\"scene\": \"" + result.scene +
+            "\", \"triangles\": " + std::to_string(result.triangles) +
+            ", \"samples\": " + std::to_string(result.samples) + ",\n";
+    json += "     \"traced_msamples_per_second\": " +
+            samples(result.traced_seconds) +
+            ", \"rasterized_msamples_per_second\": " +
+            samples(result.rasterized_seconds) + ",\n";
+    json += "     \"speedup\": " +
+            std::to_string(result.traced_seconds / result.rasterized_seconds) +
+            ", \"different_pixels\": " +
+            std::to_string(result.different_pixels) + "}" +
+            (idx + 1 < results.size() ? "," : "") + "\n";
+  }
+  json += "  ]\n}\n";
+  return json;
+}
+
+int main(int argc, const char* argv[]) {
+  // options
+  auto max_triangles = 1 << 22;
+  auto resolution    = 512;
+  auto outfilename   = "bench_raytrace.json"s;
+  auto threads       = 0;
+  auto check_load    = ""s;
+  auto rasterize     = false;
+  auto samples       = 16;
+
+  // parse command line
+  auto cli = make_cli("bench_raytrace", "Bvh layouts benchmark");
+  add_option(cli, "--max-triangles", max_triangles, "Largest scene size.");
+  add_option(cli, "--resolution,-r", resolution, "Rays per side per run.");
+  add_option(cli, "--output,-o", outfilename, "Output json filename.");
+  add_option(cli, "--threads", threads, "Number of threads (0 for all cores).");
+  add_option(cli, "--check-load", check_load, "Scene to load both ways.");
+  add_option(cli, "--rasterize", rasterize, "Time rasterized first hits.");
+  add_option(cli, "--samples,-s", samples, "Samples per pixel to rasterize.");
+  parse_cli(cli, argc, argv);
+  set_thread_count(threads);
+
+  // check the parallel scene loader instead of tracing
+  if (!check_load.empty()) {
+    check_scene_load(check_load);
+    return 0;
+  }
+
+  // build scenes in memory
+  auto scenes = make_bench_scenes(max_triangles);
+
+  // compare traced and rasterized first hits instead of bvh layouts
+  if (rasterize) {
+    auto results  = vector<raster_result>{};
+    auto progress = vec2i{0, (int)scenes.size()};
+    for (auto& scene : scenes) {
+      print_progress("render " + scene.name, progress.x++, progress.y);
+      results.push_back(run_raster_bench(scene, resolution, samples));
+    }
+    print_progress("render", progress.x++, progress.y);
+    auto ioerror = ""s;
+    if (!save_text(
+            outfilename, format_raster_results(results, resolution), ioerror))
+      print_fatal(ioerror);
+    return 0;
+  }
+
+  // run all bvh types on all scenes
+  auto results  = vector<bench_result>{};
+  auto types    = vector<raytrace_bvh_type>{
+      raytrace_bvh_type::binary, raytrace_bvh_type::quantized};
+  auto progress = vec2i{0, (int)(scenes.size() * types.size())};
+  for (auto& scene : scenes) {
+    for (auto type : types) {
+      print_progress("trace " + scene.name, progress.x++, progress.y);
+      auto params = raytrace_params{};
+      params.bvh  = type;
+      results.push_back(run_bench(scene, params, resolution));
+    }
+  }
+  print_progress("trace", progress.x++, progress.y);
+
+  // save results
+  auto ioerror = ""s;
+  if (!save_text(outfilename, format_results(results), ioerror))
+    print_fatal(ioerror);
+
+  // done
+  return 0;
+}
@@ -33,6 +33,7 @@
 #include <yocto_gui/yocto_imgui.h>
 #include <yocto_gui/yocto_opengl.h>
 #include <yocto_raytrace/yocto_raytrace.h>
+#include <yocto_sceneload/yocto_sceneload.h>
 using namespace yocto;
 
 #include <memory>
@@ -250,6 +251,8 @@ int main(int argc, const char* argv[]) {
   add_option(
       cli, "--bounces,-b", app->params.bounces, "Maximum number of bounces.");
   add_option(cli, "--clamp", app->params.clamp, "Final pixel clamping.");
+  add_option(
+      cli, "--bvh", app->params.bvh, "Bvh node type.", raytrace_bvh_names);
   add_option(cli, "--skyenv/--no-skyenv", add_skyenv, "Add sky envmap");
   add_option(cli, "--output,-o", app->imagename, "Image output");
   add_option(cli, "scene", app->filename, "Scene filename", true);
@@ -259,7 +262,7 @@ int main(int argc, const char* argv[]) {
   auto ioscene_guard = std::make_unique<sceneio_scene>();
   auto ioscene       = ioscene_guard.get();
   auto ioerror       = ""s;
-  if (!load_scene(app->filename, ioscene, ioerror, print_progress))
+  if (!load_scene_parallel(app->filename, ioscene, ioerror, print_progress))
     print_fatal(ioerror);
 
   // get camera
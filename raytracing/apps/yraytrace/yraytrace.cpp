@@ -31,9 +31,14 @@
 #include <yocto/yocto_math.h>
 #include <yocto/yocto_sceneio.h>
 #include <yocto/yocto_shape.h>
+#include <yocto_profile/yocto_profile.h>
 #include <yocto_raytrace/yocto_raytrace.h>
+#include <yocto_sceneload/yocto_sceneload.h>
+#include <yocto_server/yocto_server.h>
+#include <yocto_tasks/yocto_tasks.h>
 using namespace yocto;
 
+#include <filesystem>
 #include <map>
 #include <memory>
 
@@ -138,13 +143,151 @@ void init_scene(raytrace_scene* scene, sceneio_scene* ioscene,
   camera = camera_map.at(iocamera);
 }
 
+// Scene kept loaded by the render server, with its bvh and the layout it was
+// built with, and its cameras by name, where the empty name is the default
+// camera
+struct server_scene {
+  std::unique_ptr<raytrace_scene>          scene   = {};
+  unordered_map<string, raytrace_camera*> cameras = {};
+  raytrace_bvh_type                        bvh     = raytrace_bvh_type::binary;
+};
+
+// Render job, sent by clients to the render server
+struct render_job {
+  string          filename    = "";
+  string          camera_name = "";
+  raytrace_params params      = {};
+  bool            save_batch  = false;
+};
+
+// Encodes and decodes render jobs
+static void write_job(server_writer& writer, const render_job& job) {
+  write_value(writer, job.filename);
+  write_value(writer, job.camera_name);
+  write_value(writer, job.params);
+  write_value(writer, job.save_batch);
+}
+static bool read_job(server_reader& reader, render_job& job) {
+  return read_value(reader, job.filename) &&
+         read_value(reader, job.camera_name) &&
+         read_value(reader, job.params) && read_value(reader, job.save_batch);
+}
+
+// Encodes and decodes renders, with the number of samples
+static void write_render(
+    server_writer& writer, int sample, const image<vec4f>& render) {
+  write_value(writer, sample);
+  write_value(writer, render.imsize());
+  for (auto j = 0; j < render.imsize().y; j++)
+    for (auto i = 0; i < render.imsize().x; i++)
+      write_value(writer, render[{i, j}]);
+}
+static bool read_render(
+    server_reader& reader, int& sample, image<vec4f>& render) {
+  auto size = zero2i;
+  if (!read_value(reader, sample) || !read_value(reader, size)) return false;
+  if (size.x < 0 || size.y < 0) return false;
+  render.assign(size, zero4f);
+  for (auto j = 0; j < size.y; j++)
+    for (auto i = 0; i < size.x; i++)
+      if (!read_value(reader, render[{i, j}])) return false;
+  return true;
+}
+
+// Sends a render to the client
+static bool send_render(server_socket& client, int sample,
+    const image<vec4f>& render, string& error) {
+  auto writer = server_writer{};
+  write_render(writer, sample, render);
+  return send_message(
+      client, {server_message_type::result, std::move(writer.data)}, error);
+}
+
+// Runs a render job on the server, loading its scene only if not cached
+static bool run_job(server_cache<server_scene>& cache, server_socket& client,
+    const server_message& message, string& error) {
+  auto reader = server_reader{message.data};
+  auto job    = render_job{};
+  if (!read_job(reader, job)) {
+    error = "bad job";
+    return false;
+  }
+
+  // progress goes to the client, and a closed client cancels the job
+  auto closed   = false;
+  auto progress = [&client, &closed](
+                      const string& message, int current, int total) {
+    auto error = ""s;
+    if (!closed && !send_progress(client, message, current, total, error))
+      closed = true;
+  };
+
+  // load, convert and build the scene, unless cached or any of its files was
+  // edited since
+  auto mtime = (int64_t)0;
+  if (!get_modification_time(job.filename, mtime, error)) return false;
+  auto cached = find_cache(cache, job.filename, mtime);
+  if (!cached) {
+    auto ioscene_guard = std::make_unique<sceneio_scene>();
+    auto ioscene       = ioscene_guard.get();
+    if (!load_scene_parallel(job.filename, ioscene, error, progress))
+      return false;
+    auto loaded   = std::make_unique<server_scene>();
+    loaded->scene = std::make_unique<raytrace_scene>();
+    auto scene    = loaded->scene.get();
+    auto camera   = (raytrace_camera*)nullptr;
+    init_scene(scene, ioscene, camera, get_camera(ioscene), progress);
+    loaded->cameras[""] = camera;
+    for (auto idx = 0; idx < ioscene->cameras.size(); idx++)
+      loaded->cameras[ioscene->cameras[idx]->name] = scene->cameras[idx];
+    init_bvh(scene, job.params, progress);
+    loaded->bvh = job.params.bvh;
+    cached      = insert_cache(cache, job.filename, mtime, std::move(loaded),
+        get_scene_assets(job.filename, ioscene));
+  } else if (cached->bvh != job.params.bvh) {
+    // rebuild the bvh of the cached scene for the layout of this job
+    init_bvh(cached->scene.get(), job.params, progress);
+    cached->bvh = job.params.bvh;
+  }
+  auto camera = cached->cameras.find(job.camera_name);
+  if (camera == cached->cameras.end()) {
+    error = job.camera_name + ": camera not found";
+    return false;
+  }
+
+  // render
+  auto state_guard = std::make_unique<raytrace_state>();
+  auto state       = state_guard.get();
+  auto scene       = cached->scene.get();
+  auto samples     = job.params.samples;
+  init_state(state, scene, camera->second, job.params);
+  for (auto sample = 0; sample < samples; sample++) {
+    progress("render image", sample, samples);
+    render_samples(state, scene, camera->second, job.params);
+    if (closed) {
+      error = "connection closed";
+      return false;
+    }
+    if (job.save_batch && !send_render(client, sample, state->render, error))
+      return false;
+  }
+  progress("render image", samples, samples);
+  return send_render(client, samples, state->render, error);
+}
+
 int main(int argc, const char* argv[]) {
   // options
   auto params      = raytrace_params{};
   auto save_batch  = false;
   auto camera_name = ""s;
   auto imfilename  = "out.hdr"s;
-  auto filename    = "scene.json"s;
+  auto filename    = ""s;
+  auto threads     = 0;
+  auto tracename   = ""s;
+  auto servename   = ""s;
+  auto servername  = ""s;
+  auto stop        = false;
+  auto cache_size  = 4;
 
   // parse command line
   auto cli = make_cli("yscntrace", "Offline path tracing");
@@ -155,22 +298,92 @@ int main(int argc, const char* argv[]) {
       cli, "--shader,-t", params.shader, "Shader type.", raytrace_shader_names);
   add_option(cli, "--bounces,-b", params.bounces, "Maximum number of bounces.");
   add_option(cli, "--clamp", params.clamp, "Final pixel clamping.");
+  add_option(cli, "--rasterize", params.rasterize, "Rasterize first hits.");
+  add_option(cli, "--bvh", params.bvh, "Bvh node type.", raytrace_bvh_names);
   add_option(cli, "--save-batch", save_batch, "Save images progressively");
   add_option(cli, "--output-image,-o", imfilename, "Image filename");
-  add_option(cli, "scene", filename, "Scene filename", true);
+  add_option(cli, "--threads", threads, "Number of threads (0 for all cores).");
+  add_option(cli, "--trace", tracename, "Trace filename, in Chrome format.");
+  add_option(cli, "--serve", servename, "Run a render server on a socket.");
+  add_option(cli, "--server", servername, "Render on the server at a socket.");
+  add_option(cli, "--stop-server", stop, "Stop the server at a socket.");
+  add_option(cli, "--cache", cache_size, "Number of scenes kept by servers.");
+  add_option(cli, "scene", filename, "Scene filename", false);
   parse_cli(cli, argc, argv);
+  set_thread_count(threads);
+
+  // traces are only saved at the end of a local run, never reached by servers
+  if (!tracename.empty() && (!servename.empty() || !servername.empty()))
+    print_fatal("--trace is not supported with servers");
+  if (!tracename.empty()) start_profiling();
+
+  // render server, keeping scenes loaded across jobs
+  if (!servename.empty()) {
+    auto cache     = server_cache<server_scene>{};
+    cache.capacity = cache_size;
+    auto handler   = [&cache](server_socket& client,
+                       const server_message& job, string& error) {
+      return run_job(cache, client, job, error);
+    };
+    auto ioerror = ""s;
+    if (!run_server(servename, handler, ioerror)) print_fatal(ioerror);
+    return 0;
+  }
+
+  // stop the render server
+  if (!servername.empty() && stop) {
+    auto ioerror = ""s;
+    if (!stop_server(servername, ioerror)) print_fatal(ioerror);
+    return 0;
+  }
+
+  // the scene is required unless serving, since it is optional in the cli
+  if (filename.empty()) print_fatal("missing scene filename");
+
+  // render on the server, saving images locally
+  if (!servername.empty()) {
+    auto job = render_job{std::filesystem::absolute(filename).string(),
+        camera_name, params, save_batch};
+    auto writer = server_writer{};
+    write_job(writer, job);
+    auto save_result = [&](const server_message& result, string& error) {
+      auto reader = server_reader{result.data};
+      auto sample = 0;
+      auto render = image<vec4f>{};
+      if (!read_render(reader, sample, render)) {
+        error = "bad result";
+        return false;
+      }
+      auto outfilename = sample < params.samples
+                             ? replace_extension(imfilename,
+                                   "-s" + std::to_string(sample) +
+                                       path_extension(imfilename))
+                             : imfilename;
+      print_progress("save image", sample, params.samples);
+      return save_image(outfilename, render, error);
+    };
+    auto ioerror = ""s;
+    if (!run_client(servername, {server_message_type::job, writer.data},
+            save_result, print_progress, ioerror))
+      print_fatal(ioerror);
+    print_progress("save image", params.samples, params.samples);
+    return 0;
+  }
 
   // scene loading
+  auto loading       = profile_scope{"load scene"};
   auto ioscene_guard = std::make_unique<sceneio_scene>();
   auto ioscene       = ioscene_guard.get();
   auto ioerror       = ""s;
-  if (!load_scene(filename, ioscene, ioerror, print_progress))
+  if (!load_scene_parallel(filename, ioscene, ioerror, print_progress))
     print_fatal(ioerror);
+  loading.end();
 
   // get camera
   auto iocamera = get_camera(ioscene, camera_name);
 
   // convert scene
+  auto converting  = profile_scope{"convert scene"};
   auto scene_guard = std::make_unique<raytrace_scene>();
   auto scene       = scene_guard.get();
   auto camera      = (raytrace_camera*)nullptr;
@@ -178,9 +391,12 @@ int main(int argc, const char* argv[]) {
 
   // cleanup
   if (ioscene_guard) ioscene_guard.reset();
+  converting.end();
 
   // build bvh
+  auto building = profile_scope{"build bvh"};
   init_bvh(scene, params, print_progress);
+  building.end();
 
   // init state
   auto state_guard = std::make_unique<raytrace_state>();
@@ -188,10 +404,12 @@ int main(int argc, const char* argv[]) {
   init_state(state, scene, camera, params);
 
   // render
+  auto rendering = profile_scope{"render image"};
   print_progress("render image", 0, params.samples);
   for (auto sample = 0; sample < params.samples; sample++) {
     print_progress("render image", sample, params.samples);
     render_samples(state, scene, camera, params);
+    profile_counter("samples", sample + 1);
     if (save_batch) {
       auto outfilename = replace_extension(imfilename,
           "-s" + std::to_string(sample) + path_extension(imfilename));
@@ -202,11 +420,18 @@ int main(int argc, const char* argv[]) {
     }
   }
   print_progress("render image", params.samples, params.samples);
+  rendering.end();
 
   // save image
+  auto saving = profile_scope{"save image"};
   print_progress("save image", 0, 1);
   if (!save_image(imfilename, state->render, ioerror)) print_fatal(ioerror);
   print_progress("save image", 1, 1);
+  saving.end();
+
+  // save trace
+  if (!tracename.empty() && !save_profile(tracename, ioerror))
+    print_fatal(ioerror);
 
   // done
   return 0;
@@ -30,8 +30,11 @@
 
 #include <yocto/yocto_color.h>
 #include <yocto/yocto_geometry.h>
-#include <yocto/yocto_parallel.h>
 #include <yocto/yocto_shading.h>
+#include <yocto_tasks/yocto_tasks.h>
+
+#include <algorithm>
+#include <cstring>
 
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION FOR SCENE EVALUATION
@@ -300,6 +303,163 @@ static void build_bvh(vector<raytrace_bvh_node>& nodes,
   nodes.shrink_to_fit();
 }
 
+// Number of children of quantized BVH nodes, and marker of internal children.
+const int  bvh_qwidth    = 4;
+const byte bvh_qinternal = 255;
+
+// Cell size of the quantization grid, from a biased float exponent
+static float qnode_scale(byte exponent) {
+  auto bits  = (uint32_t)exponent << 23;
+  auto scale = 0.0f;
+  memcpy(&scale, &bits, sizeof(scale));
+  return scale;
+}
+
+// Dequantized bounds of a child of a quantized node
+static bbox3f qnode_bounds(
+    const raytrace_bvh_qnode& qnode, const vec3f& scale, int child) {
+  return {{qnode.origin.x + qnode.qmin[0][child] * scale.x,
+              qnode.origin.y + qnode.qmin[1][child] * scale.y,
+              qnode.origin.z + qnode.qmin[2][child] * scale.z},
+      {qnode.origin.x + qnode.qmax[0][child] * scale.x,
+          qnode.origin.y + qnode.qmax[1][child] * scale.y,
+          qnode.origin.z + qnode.qmax[2][child] * scale.z}};
+}
+
+// Surface area of bounds, used to pick the children to open
+static float bbox_area(const bbox3f& bbox) {
+  auto size = bbox.max - bbox.min;
+  return size.x * size.y + size.y * size.z + size.z * size.x;
+}
+
+// Quantizes the bounds of the non-empty children of a node. Each axis uses
+// the smallest cell size that fits the node bounds in 8 bits, and is grown
+// if outward rounding of the origin does not fit.
+static void quantize_bounds(raytrace_bvh_qnode& qnode, const bbox3f* bboxes) {
+  auto bbox = invalidb3f;
+  for (auto child = 0; child < bvh_qwidth; child++)
+    if (qnode.num[child]) bbox = merge(bbox, bboxes[child]);
+  qnode.origin = bbox.min;
+  for (auto axis = 0; axis < 3; axis++) {
+    auto origin   = bbox.min[axis];
+    auto extent   = bbox.max[axis] - bbox.min[axis];
+    auto exponent = extent > 0
+                        ? clamp((int)std::ceil(std::log2(extent / 255)) + 127,
+                              1, 254)
+                        : 1;
+    for (; exponent <= 254; exponent++) {
+      auto scale = qnode_scale((byte)exponent);
+      auto fits  = true;
+      for (auto child = 0; child < bvh_qwidth; child++) {
+        if (!qnode.num[child]) {
+          qnode.qmin[axis][child] = 255;
+          qnode.qmax[axis][child] = 0;
+          continue;
+        }
+        auto min_ = bboxes[child].min[axis], max_ = bboxes[child].max[axis];
+        auto qmin = (int)clamp(
+            std::floor((min_ - origin) / scale), 0.0f, 255.0f);
+        auto qmax = (int)clamp(
+            std::ceil((max_ - origin) / scale), 0.0f, 255.0f);
+        while (qmin > 0 && origin + qmin * scale > min_) qmin--;
+        while (qmax < 255 && origin + qmax * scale < max_) qmax++;
+        if (origin + qmax * scale < max_) fits = false;
+        qnode.qmin[axis][child] = (byte)qmin;
+        qnode.qmax[axis][child] = (byte)qmax;
+      }
+      if (fits) break;
+    }
+    qnode.exponents[axis] = (byte)min(exponent, 254);
+  }
+}
+
+// Collapses a binary BVH into quantized nodes, opening the internal child
+// with the largest area until nodes are full. Primitives are reordered so
+// that the leaves of each node are consecutive, and binary nodes are freed.
+static void collapse_bvh(raytrace_bvh_tree* bvh) {
+  auto& nodes      = bvh->nodes;
+  auto  primitives = vector<int>{};
+  primitives.reserve(bvh->primitives.size());
+  bvh->qnodes.clear();
+  if (nodes.empty()) return;
+
+  // queue up the root, as the only child of the first node
+  auto queue = std::deque<vec2i>{{0, 0}};
+  bvh->qnodes.emplace_back();
+
+  // create nodes until the queue is empty
+  while (!queue.empty()) {
+    auto next = queue.front();
+    queue.pop_front();
+    auto qnodeid = next.x, nodeid = next.y;
+
+    // open children, keeping them in split order
+    int  children[bvh_qwidth] = {nodeid};
+    auto num                  = 1;
+    while (num < bvh_qwidth) {
+      auto largest = -1;
+      for (auto child = 0; child < num; child++) {
+        if (!nodes[children[child]].internal) continue;
+        if (largest < 0 || bbox_area(nodes[children[child]].bbox) >
+                               bbox_area(nodes[children[largest]].bbox))
+          largest = child;
+      }
+      if (largest < 0) break;
+      auto start = nodes[children[largest]].start;
+      for (auto child = num; child > largest + 1; child--)
+        children[child] = children[child - 1];
+      children[largest]     = start + 0;
+      children[largest + 1] = start + 1;
+      num++;
+    }
+
+    // make the node, skipping children with empty bounds that cannot be hit
+    bbox3f bboxes[bvh_qwidth];
+    auto   qnode     = raytrace_bvh_qnode{};
+    qnode.children   = (int)bvh->qnodes.size();
+    qnode.primitives = (int)primitives.size();
+    auto internals   = 0;
+    for (auto child = 0; child < bvh_qwidth; child++) {
+      qnode.num[child] = 0;
+      if (child >= num) continue;
+      auto& node = nodes[children[child]];
+      if (node.bbox.min.x > node.bbox.max.x) continue;
+      bboxes[child] = node.bbox;
+      if (node.internal) {
+        qnode.num[child] = bvh_qinternal;
+        queue.push_back({qnode.children + internals++, children[child]});
+      } else {
+        qnode.num[child] = (byte)node.num;
+        for (auto idx = node.start; idx < node.start + node.num; idx++)
+          primitives.push_back(bvh->primitives[idx]);
+      }
+    }
+    quantize_bounds(qnode, bboxes);
+    bvh->qnodes[qnodeid] = qnode;
+    bvh->qnodes.resize(bvh->qnodes.size() + internals);
+  }
+
+  // cleanup
+  bvh->qnodes.shrink_to_fit();
+  bvh->primitives = std::move(primitives);
+  bvh->nodes      = {};
+}
+
+// Bounds of a bvh, from its root
+static bbox3f bvh_bounds(const raytrace_bvh_tree* bvh) {
+  if (!bvh->qnodes.empty()) {
+    auto& qnode = bvh->qnodes[0];
+    auto  scale = vec3f{qnode_scale(qnode.exponents[0]),
+        qnode_scale(qnode.exponents[1]), qnode_scale(qnode.exponents[2])};
+    auto  bbox  = invalidb3f;
+    for (auto child = 0; child < bvh_qwidth; child++)
+      if (qnode.num[child])
+        bbox = merge(bbox, qnode_bounds(qnode, scale, child));
+    return bbox;
+  }
+  return bvh->nodes.empty() ? invalidb3f : bvh->nodes[0].bbox;
+}
+
 static void init_bvh(raytrace_shape* shape, const raytrace_params& params) {
   // build primitives
   auto primitives = vector<raytrace_bvh_primitive>{};
@@ -341,6 +501,9 @@ static void init_bvh(raytrace_shape* shape, const raytrace_params& params) {
   for (auto& primitive : primitives) {
     shape->bvh->primitives.push_back(primitive.primitive);
   }
+
+  // compress nodes
+  if (params.bvh == raytrace_bvh_type::quantized) collapse_bvh(shape->bvh);
 }
 
 void init_bvh(raytrace_scene* scene, const raytrace_params& params,
@@ -362,10 +525,10 @@ void init_bvh(raytrace_scene* scene, const raytrace_params& params,
   auto object_id  = 0;
   for (auto instance : scene->instances) {
     auto& primitive = primitives.emplace_back();
-    primitive.bbox  = instance->shape->bvh->nodes.empty()
+    auto  bbox      = bvh_bounds(instance->shape->bvh);
+    primitive.bbox  = bbox.min.x > bbox.max.x
                          ? invalidb3f
-                         : transform_bbox(instance->frame,
-                               instance->shape->bvh->nodes[0].bbox);
+                         : transform_bbox(instance->frame, bbox);
     primitive.center    = center(primitive.bbox);
     primitive.primitive = object_id++;
   }
@@ -381,16 +544,135 @@ void init_bvh(raytrace_scene* scene, const raytrace_params& params,
     scene->bvh->primitives.push_back(primitive.primitive);
   }
 
+  // compress nodes
+  if (params.bvh == raytrace_bvh_type::quantized) collapse_bvh(scene->bvh);
+
   // handle progress
   if (progress_cb) progress_cb("build bvh", progress.x++, progress.y);
 }
 
+// Intersect ray with a child bounds, returning the entry distance
+static bool intersect_qbbox(const ray3f& ray, const vec3f& ray_dinv,
+    const bbox3f& bbox, float& distance) {
+  auto it_min = (bbox.min - ray.o) * ray_dinv;
+  auto it_max = (bbox.max - ray.o) * ray_dinv;
+  auto tmin   = min(it_min, it_max);
+  auto tmax   = max(it_min, it_max);
+  auto t0     = max(max(tmin), ray.tmin);
+  auto t1     = min(min(tmax), ray.tmax);
+  t1 *= 1.00000024f;
+  distance = t0;
+  return t0 <= t1;
+}
+
+// Intersect ray with a quantized bvh, calling intersect_primitive(primitive,
+// ray) for the primitives of the leaves that are hit. The callback shortens
+// the ray on hits. Children are visited from the nearest to the farthest.
+template <typename Intersect>
+static bool intersect_quantized_bvh(const raytrace_bvh_tree* bvh,
+    const ray3f& ray_, bool find_any, Intersect&& intersect_primitive) {
+  // node stack, with room for three siblings per level
+  int  node_stack[384];
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+
+  // shared variables
+  auto hit = false;
+
+  // copy ray to modify it
+  auto ray = ray_;
+
+  // prepare ray for fast queries
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+
+  // walking stack
+  while (node_cur) {
+    // grab node and decode its grid
+    auto& qnode = bvh->qnodes[node_stack[--node_cur]];
+    auto  scale = vec3f{qnode_scale(qnode.exponents[0]),
+        qnode_scale(qnode.exponents[1]), qnode_scale(qnode.exponents[2])};
+
+    // intersect children bounds, sorting hits by distance
+    int   order[bvh_qwidth], starts[bvh_qwidth];
+    float distances[bvh_qwidth];
+    auto  num = 0, child_next = qnode.children, prim_next = qnode.primitives;
+    for (auto child = 0; child < bvh_qwidth; child++) {
+      auto count = qnode.num[child];
+      if (!count) continue;
+      auto start = count == bvh_qinternal ? child_next++ : prim_next;
+      if (count != bvh_qinternal) prim_next += count;
+      auto child_distance = 0.0f;
+      if (!intersect_qbbox(ray, ray_dinv, qnode_bounds(qnode, scale, child),
+              child_distance))
+        continue;
+      auto pos = num++;
+      for (; pos > 0 && distances[pos - 1] > child_distance; pos--) {
+        order[pos]     = order[pos - 1];
+        starts[pos]    = starts[pos - 1];
+        distances[pos] = distances[pos - 1];
+      }
+      order[pos]     = child;
+      starts[pos]    = start;
+      distances[pos] = child_distance;
+    }
+
+    // intersect leaves from the nearest
+    for (auto idx = 0; idx < num; idx++) {
+      auto count = qnode.num[order[idx]];
+      if (count == bvh_qinternal) continue;
+      for (auto prim = starts[idx]; prim < starts[idx] + count; prim++) {
+        if (intersect_primitive(bvh->primitives[prim], ray)) hit = true;
+      }
+      if (find_any && hit) return hit;
+    }
+
+    // push internal children so that the nearest is popped first
+    for (auto idx = num - 1; idx >= 0; idx--) {
+      if (qnode.num[order[idx]] == bvh_qinternal)
+        node_stack[node_cur++] = starts[idx];
+    }
+  }
+
+  return hit;
+}
+
+// Intersect ray with an element of a shape
+static bool intersect_element(const raytrace_shape* shape, int element,
+    const ray3f& ray, vec2f& uv, float& distance) {
+  if (!shape->points.empty()) {
+    auto& p = shape->points[element];
+    return intersect_point(
+        ray, shape->positions[p], shape->radius[p], uv, distance);
+  } else if (!shape->lines.empty()) {
+    auto& l = shape->lines[element];
+    return intersect_line(ray, shape->positions[l.x], shape->positions[l.y],
+        shape->radius[l.x], shape->radius[l.y], uv, distance);
+  } else if (!shape->triangles.empty()) {
+    auto& t = shape->triangles[element];
+    return intersect_triangle(ray, shape->positions[t.x],
+        shape->positions[t.y], shape->positions[t.z], uv, distance);
+  }
+  return false;
+}
+
 // Intersect ray with a bvh->
 static bool intersect_shape_bvh(raytrace_shape* shape, const ray3f& ray_,
     int& element, vec2f& uv, float& distance, bool find_any) {
   // get bvh and shape pointers for fast access
   auto bvh = shape->bvh;
 
+  // quantized nodes
+  if (!bvh->qnodes.empty()) {
+    return intersect_quantized_bvh(
+        bvh, ray_, find_any, [&](int primitive, ray3f& ray) {
+          if (!intersect_element(shape, primitive, ray, uv, distance))
+            return false;
+          element  = primitive;
+          ray.tmax = distance;
+          return true;
+        });
+  }
+
   // check empty
   if (bvh->nodes.empty()) return false;
 
@@ -477,6 +759,22 @@ static bool intersect_scene_bvh(const raytrace_scene* scene, const ray3f& ray_,
   // get bvh and scene pointers for fast access
   auto bvh = scene->bvh;
 
+  // quantized nodes
+  if (!bvh->qnodes.empty()) {
+    return intersect_quantized_bvh(
+        bvh, ray_, find_any, [&](int primitive, ray3f& ray) {
+          auto instance_ = scene->instances[primitive];
+          auto inv_ray   = transform_ray(
+              inverse(instance_->frame, non_rigid_frames), ray);
+          if (!intersect_shape_bvh(instance_->shape, inv_ray, element, uv,
+                  distance, find_any))
+            return false;
+          instance = primitive;
+          ray.tmax = distance;
+          return true;
+        });
+  }
+
   // check empty
   if (bvh->nodes.empty()) return false;
 
@@ -565,6 +863,471 @@ raytrace_intersection intersect_instance_bvh(const raytrace_instance* instance,
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR VISIBILITY RASTERIZATION
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Screen tile size in pixels, distance of the near clipping plane, that is
+// well below the ray epsilon, margins of the edges in pixels and of the
+// depth, relative, that are well above the rounding of the projection,
+// triangles projected by each binning task, and triangles rasterized between
+// checks of the tile depth
+const auto raytrace_raster_tile   = 32;
+const auto raytrace_raster_near   = 1e-6f;
+const auto raytrace_raster_margin = 1e-3f;
+const auto raytrace_raster_slack  = 1e-3f;
+const auto raytrace_raster_chunk  = 4096;
+const auto raytrace_raster_cull   = 64;
+
+// Runs func(idx) for idx in [0, size), in parallel unless disabled
+template <typename Func>
+static void raster_range(int size, const raytrace_params& params, Func&& func) {
+  if (params.noparallel) {
+    for (auto idx = 0; idx < size; idx++) func(idx);
+  } else {
+    parallel_range(size, func);
+  }
+}
+
+// Whether an instance is rasterized, or traced since points and lines are
+// rendered as spheres and cylinders
+static bool is_rasterized(const raytrace_instance* instance) {
+  auto shape = instance->shape;
+  return shape->points.empty() && shape->lines.empty() &&
+         !shape->triangles.empty();
+}
+static bool is_traced(const raytrace_instance* instance) {
+  return !instance->shape->points.empty() || !instance->shape->lines.empty();
+}
+
+// First hits are rasterized only if the camera projects to the image and
+// some instances are triangles. Points and lines instances are traced for
+// each sample instead, however many they are.
+static bool can_rasterize(
+    const raytrace_scene* scene, const raytrace_camera* camera) {
+  if (camera->lens <= 0 || camera->film.x <= 0 || camera->film.y <= 0)
+    return false;
+  for (auto instance : scene->instances)
+    if (is_rasterized(instance)) return true;
+  return false;
+}
+
+// Whether the bins were built for this camera
+static bool same_raster_camera(
+    const raytrace_camera& camera, const raytrace_camera& other) {
+  return camera.frame.x == other.frame.x && camera.frame.y == other.frame.y &&
+         camera.frame.z == other.frame.z && camera.frame.o == other.frame.o &&
+         camera.lens == other.lens && camera.film == other.film;
+}
+
+// Vertices of a projected triangle in pixels, and their inverse depths
+struct raytrace_raster_vertices {
+  vec3f x = {0, 0, 0};
+  vec3f y = {0, 0, 0};
+  vec3f w = {0, 0, 0};
+};
+
+// Projects a triangle from camera space to pixels, with its pixel bounds and
+// its depth, that is a lower bound of the distance of its points, with a
+// margin for rounding. Triangles crossing the near plane are clipped, and
+// their bounds get a pixel of margin, as in tracing. Returns false if the
+// triangle is behind the camera, outside the image or seen edge-on.
+static bool project_triangle(const raytrace_camera* camera, const vec2i& size,
+    const vec3f& p0, const vec3f& p1, const vec3f& p2,
+    raytrace_raster_triangle& triangle, raytrace_raster_vertices& vertices) {
+  auto bounds  = vec4f{flt_max, flt_max, -flt_max, -flt_max};
+  auto depth   = flt_max;
+  auto project = [camera, size, &bounds, &depth](const vec3f& p) {
+    auto x = (0.5f + camera->lens * p.x / (-p.z * camera->film.x)) * size.x;
+    auto y = (0.5f - camera->lens * p.y / (-p.z * camera->film.y)) * size.y;
+    bounds = {yocto::min(bounds.x, x), yocto::min(bounds.y, y),
+        yocto::max(bounds.z, x), yocto::max(bounds.w, y)};
+    depth  = yocto::min(depth, -p.z * 0.999f);
+    return vec2f{x, y};
+  };
+  vec3f ps[3]      = {p0, p1, p2};
+  triangle.clipped = false;
+  for (auto idx = 0; idx < 3; idx++) {
+    auto& a = ps[idx];
+    auto& b = ps[(idx + 1) % 3];
+    if (a.z < -raytrace_raster_near) {
+      auto xy         = project(a);
+      vertices.x[idx] = xy.x;
+      vertices.y[idx] = xy.y;
+      vertices.w[idx] = 1 / -a.z;
+    } else {
+      triangle.clipped = true;
+    }
+    if ((a.z < -raytrace_raster_near) != (b.z < -raytrace_raster_near)) {
+      auto t = (-raytrace_raster_near - a.z) / (b.z - a.z);
+      project(a + (b - a) * t);
+    }
+  }
+  if (bounds.x > bounds.z) return false;
+  if (!triangle.clipped) {
+    auto& x = vertices.x;
+    auto& y = vertices.y;
+    if ((x.y - x.x) * (y.z - y.x) == (x.z - x.x) * (y.y - y.x)) return false;
+  }
+  auto margin    = triangle.clipped ? 1 : raytrace_raster_margin;
+  bounds         = {clamp(bounds.x - margin, -2.0f, size.x + 2.0f),
+      clamp(bounds.y - margin, -2.0f, size.y + 2.0f),
+      clamp(bounds.z + margin, -2.0f, size.x + 2.0f),
+      clamp(bounds.w + margin, -2.0f, size.y + 2.0f)};
+  triangle.min   = {max((int)floor(bounds.x), 0), max((int)floor(bounds.y), 0)};
+  triangle.max   = {min((int)floor(bounds.z), size.x - 1),
+      min((int)floor(bounds.w), size.y - 1)};
+  triangle.depth = depth;
+  return triangle.min.x <= triangle.max.x && triangle.min.y <= triangle.max.y;
+}
+
+// Sets the edge functions of a triangle that is not clipped, and the plane
+// of its inverse depth, for the tile at the given corner. Coordinates are
+// taken from the corner to keep their precision far from the image corner.
+// Returns false if the triangle is seen edge-on.
+static bool set_raster_edges(raytrace_raster_triangle& triangle,
+    const raytrace_raster_vertices& vertices, const vec2i& corner) {
+  auto x    = vertices.x - (float)corner.x;
+  auto y    = vertices.y - (float)corner.y;
+  auto area = (x.y - x.x) * (y.z - y.x) - (x.z - x.x) * (y.y - y.x);
+  if (area == 0) return false;
+  auto scale = 1 / area;
+  for (auto k = 0; k < 3; k++) {
+    auto k1             = (k + 1) % 3;
+    auto k2             = (k + 2) % 3;
+    triangle.edges_x[k] = (y[k1] - y[k2]) * scale;
+    triangle.edges_y[k] = (x[k2] - x[k1]) * scale;
+    triangle.edges_o[k] = (x[k1] * y[k2] - x[k2] * y[k1]) * scale;
+  }
+  triangle.inverse = {dot(triangle.edges_x, vertices.w),
+      dot(triangle.edges_y, vertices.w), dot(triangle.edges_o, vertices.w)};
+  return true;
+}
+
+// Lowest values of the edge functions inside a triangle, that are negative
+// by the edge margin widened by their slopes, so that it is at least as
+// large in pixels
+static vec3f raster_edges_min(const raytrace_raster_triangle& triangle) {
+  return -raytrace_raster_margin *
+         (abs(triangle.edges_x) + abs(triangle.edges_y));
+}
+
+// Calls func(tile, binned) for the tiles overlapped by the bounds of a
+// projected triangle, with a copy set up for the tile, skipping the tiles
+// entirely outside one of its edges and margins
+template <typename Func>
+static void bin_triangle(const raytrace_raster_triangle& triangle,
+    const raytrace_raster_vertices& vertices, int ntiles, Func&& func) {
+  const auto size = raytrace_raster_tile;
+  auto       tmin = vec2i{triangle.min.x / size, triangle.min.y / size};
+  auto       tmax = vec2i{triangle.max.x / size, triangle.max.y / size};
+  for (auto tj = tmin.y; tj <= tmax.y; tj++) {
+    for (auto ti = tmin.x; ti <= tmax.x; ti++) {
+      auto binned = triangle;
+      if (!triangle.clipped) {
+        if (!set_raster_edges(binned, vertices, {ti * size, tj * size}))
+          continue;
+        auto edges_min = raster_edges_min(binned);
+        auto outside   = false;
+        for (auto k = 0; k < 3; k++) {
+          outside |= binned.edges_o[k] + max(binned.edges_x[k], 0.0f) * size +
+                         max(binned.edges_y[k], 0.0f) * size <
+                     edges_min[k];
+        }
+        if (outside) continue;
+      }
+      func(tj * ntiles + ti, binned);
+    }
+  }
+}
+
+// Projects the triangles, bins them to screen tiles, and lists the instances
+// traced instead. Triangles are numbered by instance and element, and are
+// projected in parallel over ranges of them. Each range counts its triangles
+// in each tile, so that a second pass projects them again and copies them in
+// place without locks, each set up for its tile. Each tile is then read in
+// order when rasterized. Bins do not depend on the jitter, so they are
+// rebuilt only when the camera or the image size change.
+static void bin_triangles(raytrace_state* state, const raytrace_scene* scene,
+    const raytrace_camera* camera, const raytrace_params& params) {
+  auto size   = state->render.imsize();
+  auto ntiles = vec2i{
+      (size.x + raytrace_raster_tile - 1) / raytrace_raster_tile,
+      (size.y + raytrace_raster_tile - 1) / raytrace_raster_tile};
+  auto ntotal = ntiles.x * ntiles.y;
+  state->raster_traced.clear();
+  for (auto idx = 0; idx < scene->instances.size(); idx++)
+    if (is_traced(scene->instances[idx])) state->raster_traced.push_back(idx);
+  state->raster_camera = *camera;
+  state->raster_size   = size;
+
+  // number the triangles of the rasterized instances
+  auto starts = vector<int>{0};
+  for (auto instance : scene->instances) {
+    starts.push_back(starts.back() + (is_rasterized(instance)
+                                             ? (int)instance->shape->triangles.size()
+                                             : 0));
+  }
+  auto nchunks = (starts.back() + raytrace_raster_chunk - 1) /
+                 raytrace_raster_chunk;
+
+  // projects a range of triangles, and bins those in view with func
+  auto camera_inverse = inverse(camera->frame);
+  auto project_range  = [&](int chunk, auto&& func) {
+    auto first       = chunk * raytrace_raster_chunk;
+    auto last        = min(first + raytrace_raster_chunk, starts.back());
+    auto instance_id = -1;
+    auto shape       = (raytrace_shape*)nullptr;
+    auto frame       = identity3x4f;
+    for (auto idx = first; idx < last; idx++) {
+      if (instance_id < 0 || idx >= starts[instance_id + 1]) {
+        instance_id = (int)(std::upper_bound(starts.begin(), starts.end(), idx) -
+                            starts.begin()) -
+                      1;
+        shape = scene->instances[instance_id]->shape;
+        frame = camera_inverse * scene->instances[instance_id]->frame;
+      }
+      auto  element  = idx - starts[instance_id];
+      auto& t        = shape->triangles[element];
+      auto  triangle = raytrace_raster_triangle{instance_id, element};
+      auto  vertices = raytrace_raster_vertices{};
+      if (!project_triangle(camera, size,
+              transform_point(frame, shape->positions[t.x]),
+              transform_point(frame, shape->positions[t.y]),
+              transform_point(frame, shape->positions[t.z]), triangle,
+              vertices))
+        continue;
+      bin_triangle(triangle, vertices, ntiles.x, func);
+    }
+  };
+
+  // count the triangles of each range in each tile
+  auto counts = vector<int>(nchunks * ntotal, 0);
+  raster_range(nchunks, params, [&](int chunk) {
+    project_range(chunk, [&](int tile, const raytrace_raster_triangle&) {
+      counts[chunk * ntotal + tile] += 1;
+    });
+  });
+
+  // offsets of the tiles, and of the ranges in each tile
+  auto& offsets = state->raster_offsets;
+  offsets.assign(ntotal + 1, 0);
+  for (auto tile = 0; tile < ntotal; tile++) {
+    auto offset = offsets[tile];
+    for (auto chunk = 0; chunk < nchunks; chunk++) {
+      auto count                    = counts[chunk * ntotal + tile];
+      counts[chunk * ntotal + tile] = offset;
+      offset += count;
+    }
+    offsets[tile + 1] = offset;
+  }
+
+  // copy the triangles of each range at its offsets
+  auto& bins = state->raster_bins;
+  bins.resize(offsets.back());
+  raster_range(nchunks, params, [&](int chunk) {
+    project_range(
+        chunk, [&](int tile, const raytrace_raster_triangle& binned) {
+          bins[counts[chunk * ntotal + tile]++] = binned;
+        });
+  });
+
+  // sort tiles from the nearest triangle, so that farther ones are culled,
+  // sorting indices to move each triangle only once
+  raster_range(ntotal, params, [&](int tile) {
+    auto tile_bins = bins.data() + offsets[tile];
+    auto order     = vector<int>(offsets[tile + 1] - offsets[tile]);
+    for (auto idx = 0; idx < order.size(); idx++) order[idx] = idx;
+    std::sort(order.begin(), order.end(), [tile_bins](int a, int b) {
+      auto& ta = tile_bins[a];
+      auto& tb = tile_bins[b];
+      if (ta.depth != tb.depth) return ta.depth < tb.depth;
+      return std::pair{ta.instance, ta.element} <
+             std::pair{tb.instance, tb.element};
+    });
+    auto sorted = vector<raytrace_raster_triangle>(order.size());
+    for (auto idx = 0; idx < order.size(); idx++)
+      sorted[idx] = tile_bins[order[idx]];
+    std::copy(sorted.begin(), sorted.end(), tile_bins);
+  });
+}
+
+// Rasterizes the first hits of the current pass into the visibility buffer.
+// Sample positions are jittered in each pixel with the pixel rngs, as in ray
+// tracing. Tiles are rasterized in parallel from the cached bins, keeping the
+// nearest hit of each sample. The edge functions and the inverse depth of
+// each triangle are stepped across its pixels, and offset by the jitter of
+// each sample, to find the samples it covers, with a margin, and that it
+// may be nearer than their hits. Only these are tested against the triangle
+// as the bvh does, so that hits match ray tracing. Clipped triangles test
+// all the samples in their bounds. The traced instances are then intersected
+// with the ray shortened to the rasterized hit. Ties are broken by instance
+// and element to keep the buffer independent of the order of triangles.
+static void rasterize_visibility(raytrace_state* state,
+    const raytrace_scene* scene, const raytrace_camera* camera,
+    const raytrace_params& params) {
+  // jitter samples
+  auto size = state->render.imsize();
+  if (state->jitters.imsize() != size) state->jitters.assign(size, zero2f);
+  if (state->visibility.imsize() != size) state->visibility.assign(size, {});
+  raster_range(size.y, params, [state, size](int j) {
+    for (auto i = 0; i < size.x; i++)
+      state->jitters[{i, j}] = rand2f(state->rngs[{i, j}]);
+  });
+
+  // bin triangles to tiles, unless already binned for this view
+  if (state->raster_size != size ||
+      !same_raster_camera(state->raster_camera, *camera))
+    bin_triangles(state, scene, camera, params);
+
+  // instance frames, from world to instance
+  auto inverses = vector<frame3f>(scene->instances.size());
+  for (auto idx = 0; idx < scene->instances.size(); idx++)
+    inverses[idx] = inverse(scene->instances[idx]->frame, true);
+
+  // keeps the nearest hit, breaking ties by instance and element
+  auto update_visible = [](raytrace_intersection& visible, int instance,
+                            int element, const vec2f& uv, float distance) {
+    if (visible.hit && distance == visible.distance &&
+        std::pair{instance, element} >
+            std::pair{visible.instance, visible.element})
+      return;
+    visible = {instance, element, uv, distance, true};
+  };
+
+  // rasterize tiles, from the nearest triangles, and stop once behind all
+  // the hits
+  auto& bins    = state->raster_bins;
+  auto& offsets = state->raster_offsets;
+  auto  ntiles  = (size.x + raytrace_raster_tile - 1) / raytrace_raster_tile;
+  raster_range((int)offsets.size() - 1, params, [&](int tile) {
+    const auto tsize    = raytrace_raster_tile;
+    auto       tile_min = vec2i{(tile % ntiles) * tsize, (tile / ntiles) * tsize};
+    auto       tile_max = vec2i{min(tile_min.x + tsize, size.x) - 1,
+        min(tile_min.y + tsize, size.y) - 1};
+
+    // camera rays, jitters and ray lengths per unit of depth of the samples,
+    // their hits, and their rays in the frame of the last instance tested
+    ray3f                 rays[tsize * tsize];
+    vec2f                 jitters[tsize * tsize];
+    float                 lengths[tsize * tsize];
+    raytrace_intersection hits[tsize * tsize];
+    ray3f                 local_rays[tsize * tsize];
+    int                   local_instances[tsize * tsize];
+    auto                  sample = [&tile_min](int i, int j) {
+      return (j - tile_min.y) * tsize + (i - tile_min.x);
+    };
+    for (auto j = tile_min.y; j <= tile_max.y; j++) {
+      for (auto i = tile_min.x; i <= tile_max.x; i++) {
+        auto s             = sample(i, j);
+        auto puv           = state->jitters[{i, j}];
+        auto uv            = vec2f{(i + puv.x) / size.x, (j + puv.y) / size.y};
+        auto q             = vec3f{camera->film.x * (0.5f - uv.x),
+            camera->film.y * (uv.y - 0.5f), camera->lens};
+        rays[s]            = eval_camera(camera, uv);
+        jitters[s]         = puv;
+        lengths[s]         = length(q) / camera->lens;
+        hits[s]            = {};
+        local_instances[s] = -1;
+      }
+    }
+    auto empty    = (tile_max.x - tile_min.x + 1) * (tile_max.y - tile_min.y + 1);
+    auto tile_far = [&]() {
+      auto far = 0.0f;
+      for (auto j = tile_min.y; j <= tile_max.y; j++)
+        for (auto i = tile_min.x; i <= tile_max.x; i++)
+          far = max(far, hits[sample(i, j)].distance);
+      return far;
+    };
+
+    auto far = flt_max;
+    for (auto idx = offsets[tile]; idx < offsets[tile + 1]; idx++) {
+      auto& triangle = bins[idx];
+      if (empty == 0 && (idx - offsets[tile]) % raytrace_raster_cull == 0)
+        far = tile_far();
+      if (triangle.depth > far) break;
+      auto test = [&](int s) {
+        if (local_instances[s] != triangle.instance) {
+          local_rays[s] = transform_ray(inverses[triangle.instance], rays[s]);
+          local_instances[s] = triangle.instance;
+        }
+        auto  shape = scene->instances[triangle.instance]->shape;
+        auto& t     = shape->triangles[triangle.element];
+        auto  ray   = local_rays[s];
+        if (hits[s].hit) ray.tmax = hits[s].distance;
+        auto uv       = zero2f;
+        auto distance = 0.0f;
+        if (!intersect_triangle(ray, shape->positions[t.x],
+                shape->positions[t.y], shape->positions[t.z], uv, distance))
+          return;
+        if (!hits[s].hit) empty -= 1;
+        update_visible(
+            hits[s], triangle.instance, triangle.element, uv, distance);
+      };
+      auto rmin = vec2i{
+          max(triangle.min.x, tile_min.x), max(triangle.min.y, tile_min.y)};
+      auto rmax = vec2i{
+          min(triangle.max.x, tile_max.x), min(triangle.max.y, tile_max.y)};
+
+      // clipped triangles, tested in all their bounds
+      if (triangle.clipped) {
+        for (auto j = rmin.y; j <= rmax.y; j++) {
+          for (auto i = rmin.x; i <= rmax.x; i++) {
+            auto s = sample(i, j);
+            if (hits[s].hit && hits[s].distance < triangle.depth) continue;
+            test(s);
+          }
+        }
+        continue;
+      }
+
+      // other triangles, stepping the edge functions and the inverse depth
+      // from the corner of each pixel, and offsetting them to its sample
+      auto& ex = triangle.edges_x;
+      auto& ey = triangle.edges_y;
+      auto  em = raster_edges_min(triangle);
+      auto& iw = triangle.inverse;
+      for (auto j = rmin.y; j <= rmax.y; j++) {
+        auto x = (float)(rmin.x - tile_min.x);
+        auto y = (float)(j - tile_min.y);
+        auto e = ex * x + ey * y + triangle.edges_o;
+        auto w = iw.x * x + iw.y * y + iw.z;
+        for (auto i = rmin.x; i <= rmax.x; i++, e += ex, w += iw.x) {
+          auto  s   = sample(i, j);
+          auto& puv = jitters[s];
+          auto  es  = e + ex * puv.x + ey * puv.y;
+          if (es.x < em.x || es.y < em.y || es.z < em.z) continue;
+          if (hits[s].hit && lengths[s] > hits[s].distance *
+                                              (1 + raytrace_raster_slack) *
+                                              (w + iw.x * puv.x + iw.y * puv.y))
+            continue;
+          test(s);
+        }
+      }
+    }
+
+    // trace the points and lines up to the rasterized hits
+    for (auto j = tile_min.y; j <= tile_max.y; j++) {
+      for (auto i = tile_min.x; i <= tile_max.x; i++) {
+        auto& visible = state->visibility[{i, j}];
+        visible       = hits[sample(i, j)];
+        for (auto instance_id : state->raster_traced) {
+          auto instance = scene->instances[instance_id];
+          auto traced   = rays[sample(i, j)];
+          if (visible.hit) traced.tmax = visible.distance;
+          auto isec = intersect_instance_bvh(instance, traced);
+          if (!isec.hit) continue;
+          update_visible(
+              visible, instance_id, isec.element, isec.uv, isec.distance);
+        }
+      }
+    }
+  });
+}
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION FOR PATH TRACING
 // -----------------------------------------------------------------------------
@@ -572,8 +1335,10 @@ namespace yocto {
 
 // SHADE RAYTRACE: raytrace renderer.
 static vec4f shade_raytrace(const raytrace_scene* scene, const ray3f& ray,
-    int bounce, rng_state& rng, const raytrace_params& params) {
-  auto isec = intersect_scene_bvh(scene, ray);  // interseco la scena
+    int bounce, rng_state& rng, const raytrace_params& params,
+    const raytrace_intersection* visible = nullptr) {
+  // interseco la scena
+  auto isec = visible ? *visible : intersect_scene_bvh(scene, ray);
   if (!isec.hit) {
     auto res = eval_environment(
         scene, ray);  /*ritorno il colore dell'environment map che sar il
@@ -724,8 +1489,9 @@ static vec4f shade_raytrace(const raytrace_scene* scene, const ray3f& ray,
 /*SHADE EYELIGHT: implementare uno shader che calcola il diffuse shading
 assumendo di avere una fonte di illuminazione nelle fotocamera*/
 static vec4f shade_eyelight(const raytrace_scene* scene, const ray3f& ray,
-    int bounce, rng_state& rng, const raytrace_params& params) {
-  auto isec = intersect_scene_bvh(scene, ray);
+    int bounce, rng_state& rng, const raytrace_params& params,
+    const raytrace_intersection* visible = nullptr) {
+  auto isec = visible ? *visible : intersect_scene_bvh(scene, ray);
   if (!isec.hit) {
     return {0, 0, 0};
   }
@@ -740,8 +1506,9 @@ static vec4f shade_eyelight(const raytrace_scene* scene, const ray3f& ray,
 /*NORMAL SHADER: implementare uno shader che ritorna la normale del punto di
 intersezione, tradotta in colore aggiungendo 0.5 e moltiplicando per 0.5*/
 static vec4f shade_normal(const raytrace_scene* scene, const ray3f& ray,
-    int bounce, rng_state& rng, const raytrace_params& params) {
-  auto isec = intersect_scene_bvh(scene, ray);
+    int bounce, rng_state& rng, const raytrace_params& params,
+    const raytrace_intersection* visible = nullptr) {
+  auto isec = visible ? *visible : intersect_scene_bvh(scene, ray);
   if (!isec.hit) {
     return {0, 0, 0};
   }
@@ -757,8 +1524,9 @@ static vec4f shade_normal(const raytrace_scene* scene, const ray3f& ray,
 punto di intersezione, tradotte in colori per i canali RG; usare la funzione
 `fmod()` per forzarle nel range[0, 1]*/
 static vec4f shade_texcoord(const raytrace_scene* scene, const ray3f& ray,
-    int bounce, rng_state& rng, const raytrace_params& params) {
-  auto isec = intersect_scene_bvh(scene, ray);
+    int bounce, rng_state& rng, const raytrace_params& params,
+    const raytrace_intersection* visible = nullptr) {
+  auto isec = visible ? *visible : intersect_scene_bvh(scene, ray);
   if (!isec.hit) {
     return {0, 0, 0};
   }
@@ -774,8 +1542,9 @@ static vec4f shade_texcoord(const raytrace_scene* scene, const ray3f& ray,
 // SHADE COLOR: implementare uno shader che ritorna il colore del materiale del
 // punto di intersezione
 static vec4f shade_color(const raytrace_scene* scene, const ray3f& ray,
-    int bounce, rng_state& rng, const raytrace_params& params) {
-  auto isec = intersect_scene_bvh(scene, ray);
+    int bounce, rng_state& rng, const raytrace_params& params,
+    const raytrace_intersection* visible = nullptr) {
+  auto isec = visible ? *visible : intersect_scene_bvh(scene, ray);
   if (!isec.hit) {
     return {0, 0, 0};
   }
@@ -788,8 +1557,9 @@ static vec4f shade_color(const raytrace_scene* scene, const ray3f& ray,
 // SHADER PERSONALE: ho tentato di creare uno shader che potesse simulare palle
 // di neve e oggetti "macchiati" di essa
 static vec4f shade_personal(const raytrace_scene* scene, const ray3f& ray,
-    int bounce, rng_state& rng, const raytrace_params& params) {
-  auto isec = intersect_scene_bvh(scene, ray);
+    int bounce, rng_state& rng, const raytrace_params& params,
+    const raytrace_intersection* visible = nullptr) {
+  auto isec = visible ? *visible : intersect_scene_bvh(scene, ray);
 
   if (!isec.hit) {
     vec3f res = eval_environment(scene, ray);
@@ -852,8 +1622,9 @@ static vec4f shade_personal(const raytrace_scene* scene, const ray3f& ray,
 
 //SHADE TOON: ho implementato uno shader che simula l'effetto cartoon sugli oggetti
 static vec4f shade_toon(const raytrace_scene* scene, const ray3f& ray,
-    int bounce, rng_state& rng, const raytrace_params& params) {
-  auto isec = intersect_scene_bvh(scene, ray);
+    int bounce, rng_state& rng, const raytrace_params& params,
+    const raytrace_intersection* visible = nullptr) {
+  auto isec = visible ? *visible : intersect_scene_bvh(scene, ray);
   if (!isec.hit) {
     return {0, 0, 0};
   }
@@ -886,7 +1657,7 @@ static vec4f shade_toon(const raytrace_scene* scene, const ray3f& ray,
 // Trace a single ray from the camera using the given algorithm.
 using raytrace_shader_func = vec4f (*)(const raytrace_scene* scene,
     const ray3f& ray, int bounce, rng_state& rng,
-    const raytrace_params& params);
+    const raytrace_params& params, const raytrace_intersection* visible);
 static raytrace_shader_func get_shader(const raytrace_params& params) {
   switch (params.shader) {
     case raytrace_shader_type::raytrace: return shade_raytrace;
@@ -904,16 +1675,18 @@ static raytrace_shader_func get_shader(const raytrace_params& params) {
   }
 }
 
-// Trace a block of samples
+// Trace a block of samples. If rasterized, the sample position and the first
+// hit are taken from the visibility buffer.
 void render_sample(raytrace_state* state, const raytrace_scene* scene,
     const raytrace_camera* camera, const vec2i& ij,
-    const raytrace_params& params) {
+    const raytrace_params& params, bool rasterized) {
   auto shader = get_shader(params);
-  auto puv    = rand2f(state->rngs[ij]);
+  auto puv    = rasterized ? state->jitters[ij] : rand2f(state->rngs[ij]);
   auto ray    = eval_camera(
       camera, {(ij.x + puv.x) / state->render.imsize().x,
                   (ij.y + puv.y) / state->render.imsize().y});
-  auto shaded = shader(scene, ray, 0, state->rngs[ij], params);
+  auto shaded = shader(scene, ray, 0, state->rngs[ij], params,
+      rasterized ? &state->visibility[ij] : nullptr);
   if (!isfinite(xyz(shaded))) shaded = {shaded.x, shaded.y, shaded.z, 1};
   if (max(xyz(shaded)) > params.clamp) {
     auto scale = params.clamp / max(xyz(shaded));
@@ -938,6 +1711,7 @@ void init_state(raytrace_state* state, const raytrace_scene* scene,
   state->accumulation.assign(image_size, zero4f);
   state->samples.assign(image_size, 0);
   state->rngs.assign(image_size, {});
+  state->raster_size = {0, 0};  // rebin, since the scene may have changed
   auto init_rng = make_rng(1301081);
   for (auto& rng : state->rngs) {
     rng = make_rng(params.seed, rand1i(init_rng, 1 << 31) / 2 + 1);
@@ -947,16 +1721,21 @@ void init_state(raytrace_state* state, const raytrace_scene* scene,
 // Progressively compute an image by calling trace_samples multiple times.
 void render_samples(raytrace_state* state, const raytrace_scene* scene,
     const raytrace_camera* camera, const raytrace_params& params) {
+  auto rasterized = params.rasterize && can_rasterize(scene, camera);
+  if (rasterized) rasterize_visibility(state, scene, camera, params);
   if (params.noparallel) {
     for (auto j = 0; j < state->render.imsize().y; j++) {
       for (auto i = 0; i < state->render.imsize().x; i++) {
-        render_sample(state, scene, camera, {i, j}, params);
+        render_sample(state, scene, camera, {i, j}, params, rasterized);
       }
     }
   } else {
-    parallel_for(state->render.imsize().x, state->render.imsize().y,
-        [state, scene, camera, &params](int i, int j) {
-          render_sample(state, scene, camera, {i, j}, params);
+    // one task per row, so that threads steal whole rows
+    parallel_range(state->render.imsize().y,
+        [state, scene, camera, &params, rasterized](int j) {
+          for (auto i = 0; i < state->render.imsize().x; i++) {
+            render_sample(state, scene, camera, {i, j}, params, rasterized);
+          }
         });
   }
 }
@@ -74,13 +74,32 @@ struct raytrace_bvh_node {
   byte   axis;
 };
 
+// Compressed BVH node with up to four children, whose bounds are quantized to
+// 8 bits on a grid that starts at the node origin and has power of two cells,
+// stored as float exponents. Quantized bounds are rounded outward so that
+// they contain the full precision ones. Internal children are stored
+// consecutively from `children`, and the primitives of leaf children
+// consecutively from `primitives`, in child order. The number of primitives
+// is 0 for empty children and 255 for internal ones.
+struct raytrace_bvh_qnode {
+  vec3f origin;
+  byte  exponents[3];
+  byte  num[4];
+  byte  qmin[3][4];
+  byte  qmax[3][4];
+  int   children;
+  int   primitives;
+};
+
 // BVH tree stored as a node array with the tree structure is encoded using
 // array indices. BVH nodes indices refer to either the node array,
 // for internal nodes, or the primitive arrays, for leaf nodes.
-// Application data is not stored explicitly.
+// Quantized trees store only compressed nodes, with primitives in their
+// leaf order. Application data is not stored explicitly.
 struct raytrace_bvh_tree {
-  vector<raytrace_bvh_node> nodes      = {};
-  vector<int>               primitives = {};
+  vector<raytrace_bvh_node>  nodes      = {};
+  vector<raytrace_bvh_qnode> qnodes     = {};
+  vector<int>                primitives = {};
 };
 
 // Camera based on a simple lens model. The camera is placed using a frame.
@@ -202,12 +221,55 @@ struct raytrace_scene {
   ~raytrace_scene();
 };
 
+// Results of intersect functions that include hit flag, the instance id,
+// the shape element id, the shape element uv and intersection distance.
+// Results values are set only if hit is true.
+struct raytrace_intersection {
+  int   instance   = -1;
+  int   element  = -1;
+  vec2f uv       = {0, 0};
+  float distance = 0;
+  bool  hit      = false;
+};
+
+// Triangle binned to a screen tile, with its pixel bounds and a lower bound
+// of its distance from the camera. Its edge functions are scaled to its
+// barycentric coordinates and are affine in the pixel offset from the tile
+// corner, as is its inverse depth. Triangles crossing the near plane are
+// clipped only in their bounds, and are tested against the camera rays.
+struct raytrace_raster_triangle {
+  int   instance = 0;
+  int   element  = 0;
+  vec2i min      = {0, 0};
+  vec2i max      = {0, 0};
+  float depth    = 0;
+  bool  clipped  = false;
+  vec3f edges_x  = {0, 0, 0};
+  vec3f edges_y  = {0, 0, 0};
+  vec3f edges_o  = {0, 0, 0};
+  vec3f inverse  = {0, 0, 0};  // inverse depth along x, y and at the corner
+};
+
 // Rendering state
 struct raytrace_state {
   image<vec4f>     render       = {};
   image<vec4f>     accumulation = {};
   image<int>       samples      = {};
   image<rng_state> rngs         = {};
+
+  // visibility buffer, with the first hits of the current pass at the
+  // jittered sample positions of each pixel, used when rasterizing
+  image<vec2f>                 jitters    = {};
+  image<raytrace_intersection> visibility = {};
+
+  // projected triangles binned to screen tiles, each tile from the nearest
+  // and starting at its offset, and instances traced per sample, kept across
+  // passes for the camera and image size they were built for
+  vector<raytrace_raster_triangle> raster_bins    = {};
+  vector<int>                      raster_offsets = {};
+  vector<int>                      raster_traced  = {};
+  raytrace_camera                  raster_camera  = {};
+  vec2i                            raster_size    = {0, 0};
 };
 
 }  // namespace yocto
@@ -287,6 +349,12 @@ enum struct raytrace_shader_type {
   
 };
 
+// Type of bvh nodes
+enum struct raytrace_bvh_type {
+  binary,     // binary nodes with full precision bounds
+  quantized,  // 4-wide nodes with 8-bit quantized bounds
+};
+
 // Default trace seed
 const auto default_seed = 961748941ull;
 
@@ -300,10 +368,13 @@ struct raytrace_params {
   uint64_t        seed       = default_seed;
   bool            noparallel = false;
   int             pratio     = 8;
+  bool            rasterize  = false;  // rasterize first hits
+  raytrace_bvh_type bvh      = raytrace_bvh_type::binary;
 };
 
 const auto raytrace_shader_names = vector<string>{
     "raytrace", "eyelight", "normal", "texcoord", "color", "personal", "toon"};
+const auto raytrace_bvh_names = vector<string>{"binary", "quantized"};
 
 // Progress report callback
 using progress_callback =
@@ -318,7 +389,10 @@ struct state;
 void init_state(raytrace_state* state, const raytrace_scene* scene,
     const raytrace_camera* camera, const raytrace_params& params);
 
-// Progressively computes an image.
+// Progressively computes an image. If `rasterize` is set and the scene has
+// triangles, their first hits are rasterized into the visibility buffer, and
+// points and lines instances are traced against it. Triangles are binned to
+// tiles on the first pass and again when the camera or image size changes.
 void render_samples(raytrace_state* state, 
     const raytrace_scene* scene, const raytrace_camera* camera,
     const raytrace_params& params);
@@ -330,17 +404,6 @@ void render_samples(raytrace_state* state,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Results of intersect functions that include hit flag, the instance id,
-// the shape element id, the shape element uv and intersection distance.
-// Results values are set only if hit is true.
-struct raytrace_intersection {
-  int   instance   = -1;
-  int   element  = -1;
-  vec2f uv       = {0, 0};
-  float distance = 0;
-  bool  hit      = false;
-};
-
 // Intersect ray with a bvh returning either the first or any intersection
 // depending on `find_any`. Returns the ray distance , the instance id,
 // the shape element index and the element barycentric coordinates.
@@ -0,0 +1,561 @@
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2020 Fabio Pellacini
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include <yocto/yocto_commonio.h>
+#include <yocto/yocto_math.h>
+#include <yocto_particle/yocto_particle.h>
+#include <yocto_tasks/yocto_tasks.h>
+using namespace yocto;
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+
+// Count heap allocations, to check that simulating a frame does not allocate
+static auto allocation_count = std::atomic<size_t>{0};
+
+void* operator new(size_t size) {
+  allocation_count++;
+  if (auto ptr = std::malloc(size ? size : 1)) return ptr;
+  throw std::bad_alloc{};
+}
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+
+// Cloth grid of size x size vertices, pinned at two corners. Without radius,
+// the cloth is as loaded from meshes that have none.
+void make_cloth_grid(
+    particle_scene* ptscene, int size, float height, bool with_radius = true) {
+  auto quads     = vector<vec4i>{};
+  auto positions = vector<vec3f>{};
+  auto normals   = vector<vec3f>{};
+  for (auto j = 0; j < size; j++) {
+    for (auto i = 0; i < size; i++) {
+      auto uv = vec2f{i / (float)(size - 1), j / (float)(size - 1)};
+      positions.push_back({2 * uv.x - 1, height, 2 * uv.y - 1});
+      normals.push_back({0, 1, 0});
+    }
+  }
+  for (auto j = 0; j < size - 1; j++) {
+    for (auto i = 0; i < size - 1; i++) {
+      quads.push_back({j * size + i, j * size + i + 1,
+          (j + 1) * size + i + 1, (j + 1) * size + i});
+    }
+  }
+  auto radius = with_radius ? vector<float>(positions.size(), 0.001f)
+                            : vector<float>{};
+  add_cloth(ptscene, quads, positions, normals, radius, 0.5, 1 / 8000.0,
+      {0, size - 1});
+}
+
+// Cloud of count random particles above the origin
+void make_particle_cloud(particle_scene* ptscene, int count, float height) {
+  auto rng       = make_rng(172784);
+  auto points    = vector<int>{};
+  auto positions = vector<vec3f>{};
+  for (auto idx = 0; idx < count; idx++) {
+    points.push_back(idx);
+    positions.push_back(
+        (rand3f(rng) * 2 - 1) * 0.5f + vec3f{0, height + 0.5f, 0});
+  }
+  auto radius = vector<float>(positions.size(), 0.01f);
+  add_particles(ptscene, points, positions, radius, 1, 1);
+}
+
+// Block of count particles on a lattice of spacing one diameter, as in a
+// dam break
+void make_particle_block(particle_scene* ptscene, int count, float radius) {
+  auto size      = (int)std::ceil(std::cbrt((float)count));
+  auto points    = vector<int>{};
+  auto positions = vector<vec3f>{};
+  for (auto idx = 0; idx < count; idx++) {
+    auto i = idx % size, j = (idx / size) % size, k = idx / (size * size);
+    points.push_back(idx);
+    positions.push_back(vec3f{(float)i, (float)j, (float)k} * 2 * radius +
+                        vec3f{-1, radius, -1});
+  }
+  auto radiuses = vector<float>(positions.size(), radius);
+  add_particles(ptscene, points, positions, radiuses, 1, 1);
+}
+
+// Tilted lattice body of count particles, matched by clusters of cluster_size
+void make_body_block(
+    particle_scene* ptscene, int count, float radius, float cluster_size) {
+  auto size      = (int)std::ceil(std::cbrt((float)count));
+  auto positions = vector<vec3f>{};
+  auto rotation  = rotation_frame(normalize(vec3f{1, 0, 1}), 0.5f);
+  for (auto idx = 0; idx < count; idx++) {
+    auto i = idx % size, j = (idx / size) % size, k = idx / (size * size);
+    auto position = (vec3f{(float)i, (float)j, (float)k} - size / 2.0f) * 2 *
+                    radius;
+    positions.push_back(transform_vector(rotation, position) +
+                        vec3f{0, size * 2 * radius, 0});
+  }
+  auto radiuses = vector<float>(positions.size(), radius);
+  add_body(ptscene, {}, {}, positions, {}, radiuses, 1, 0.5f, cluster_size);
+}
+
+// Grid of count horizontal strands of 16 segments, rooted above the origin
+void make_hair_grid(particle_scene* ptscene, int count, float length) {
+  auto side      = (int)std::ceil(std::sqrt((float)count));
+  auto lines     = vector<vec2i>{};
+  auto positions = vector<vec3f>{};
+  auto tangents  = vector<vec3f>{};
+  for (auto strand = 0; strand < count; strand++) {
+    auto root = vec3f{(float)(strand % side) / side - 0.5f, 0.5f,
+        (float)(strand / side) / side - 0.5f};
+    auto base = (int)positions.size();
+    for (auto k = 0; k <= 16; k++) {
+      positions.push_back(root + vec3f{length * k / 16, 0, 0});
+      tangents.push_back({1, 0, 0});
+      if (k > 0) lines.push_back({base + k - 1, base + k});
+    }
+  }
+  auto radius = vector<float>(positions.size(), 0.002f);
+  add_hair(ptscene, lines, positions, tangents, radius, 1, 0.2f);
+}
+
+// Fountain emitting from a few sites, with a pool of capacity particles
+void make_fountain(particle_scene* ptscene, int capacity, float height) {
+  auto points    = vector<int>{};
+  auto positions = vector<vec3f>{};
+  for (auto idx = 0; idx < 16; idx++) {
+    auto angle = 2 * pif * idx / 16;
+    points.push_back(idx);
+    positions.push_back({0.1f * cos(angle), height, 0.1f * sin(angle)});
+  }
+  auto radius = vector<float>(positions.size(), 0.01f);
+  auto shape  = add_particles(ptscene, points, positions, radius, 1, 0);
+  set_emitter(shape, capacity / 2.0f, 2, capacity, {0, 4, 0}, 1);
+}
+
+// Sphere collider made of quads
+particle_collider* make_sphere_collider(particle_scene* ptscene, int steps,
+    float scale, const vec3f& center = {0, 0, 0}) {
+  auto quads     = vector<vec4i>{};
+  auto positions = vector<vec3f>{};
+  auto normals   = vector<vec3f>{};
+  for (auto j = 0; j <= steps; j++) {
+    for (auto i = 0; i <= steps * 2; i++) {
+      auto phi   = 2 * pif * i / (steps * 2);
+      auto theta = pif * j / steps;
+      auto n     = vec3f{
+          cos(phi) * sin(theta), cos(theta), sin(phi) * sin(theta)};
+      positions.push_back(center + n * scale);
+      normals.push_back(n);
+    }
+  }
+  auto stride = steps * 2 + 1;
+  for (auto j = 0; j < steps; j++) {
+    for (auto i = 0; i < steps * 2; i++) {
+      quads.push_back({j * stride + i, (j + 1) * stride + i,
+          (j + 1) * stride + i + 1, j * stride + i + 1});
+    }
+  }
+  auto radius = vector<float>(positions.size(), 0.001f);
+  return add_collider(ptscene, {}, quads, positions, normals, radius);
+}
+
+// Sphere rising under the cloth with keyframes while pulsing with a scripted
+// deformation, so that it is both a rigid mover and a deforming collider
+void make_moving_sphere(particle_scene* ptscene, int steps, float scale) {
+  auto sphere = make_sphere_collider(ptscene, steps, scale);
+  auto top    = identity3x4f;
+  top.o       = {0, 0.3f, 0};
+  set_collider_frames(sphere, {0, 1}, {identity3x4f, top});
+  set_collider_animation(sphere, [](particle_collider* collider, float time) {
+    auto pulse = 1 + 0.1f * std::sin(2 * pif * time);
+    for (auto vert = 0; vert < (int)collider->positions.size(); vert++)
+      collider->positions[vert] = collider->initial_positions[vert] * pulse;
+  });
+}
+
+// Grid of count x count small spheres under the particle cloud, to measure
+// the collision cost with many colliders
+void make_pebbles(particle_scene* ptscene, int count, float size) {
+  for (auto j = 0; j < count; j++) {
+    for (auto i = 0; i < count; i++) {
+      auto center = vec3f{((i + 0.5f) / count - 0.5f) * size, 0,
+          ((j + 0.5f) / count - 0.5f) * size};
+      make_sphere_collider(ptscene, 8, size / (2 * count), center);
+    }
+  }
+}
+
+// Floor collider made of a single quad
+void make_floor_collider(particle_scene* ptscene, float size) {
+  auto positions = vector<vec3f>{
+      {-size, 0, -size}, {-size, 0, size}, {size, 0, size}, {size, 0, -size}};
+  auto normals = vector<vec3f>(4, {0, 1, 0});
+  auto radius  = vector<float>(4, 0.001f);
+  add_collider(ptscene, {}, {{0, 1, 2, 3}}, positions, normals, radius);
+}
+
+// Benchmark scene
+struct bench_scene {
+  string                          name    = "";
+  std::unique_ptr<particle_scene> ptscene = {};
+};
+
+vector<bench_scene> make_bench_scenes(int max_size) {
+  auto scenes = vector<bench_scene>{};
+  for (auto size = 32; size <= max_size; size *= 2) {
+    auto& cloth   = scenes.emplace_back();
+    cloth.name    = "cloth_" + std::to_string(size);
+    cloth.ptscene = std::make_unique<particle_scene>();
+    make_cloth_grid(cloth.ptscene.get(), size, 1);
+  }
+  for (auto size = 32; size <= max_size; size *= 2) {
+    auto& drape   = scenes.emplace_back();
+    drape.name    = "drape_" + std::to_string(size);
+    drape.ptscene = std::make_unique<particle_scene>();
+    make_cloth_grid(drape.ptscene.get(), size, 1);
+    make_sphere_collider(drape.ptscene.get(), 32, 0.5);
+  }
+  for (auto size = 32; size <= max_size; size *= 2) {
+    auto& bare   = scenes.emplace_back();
+    bare.name    = "bare_" + std::to_string(size);
+    bare.ptscene = std::make_unique<particle_scene>();
+    make_cloth_grid(bare.ptscene.get(), size, 1, false);
+    make_sphere_collider(bare.ptscene.get(), 32, 0.5);
+  }
+  for (auto size = 32; size <= max_size; size *= 2) {
+    auto& mover   = scenes.emplace_back();
+    mover.name    = "mover_" + std::to_string(size);
+    mover.ptscene = std::make_unique<particle_scene>();
+    make_cloth_grid(mover.ptscene.get(), size, 1);
+    make_moving_sphere(mover.ptscene.get(), 32, 0.5);
+  }
+  for (auto size = 32; size <= max_size; size *= 2) {
+    auto& cloud   = scenes.emplace_back();
+    cloud.name    = "cloud_" + std::to_string(size * size);
+    cloud.ptscene = std::make_unique<particle_scene>();
+    make_particle_cloud(cloud.ptscene.get(), size * size, 1);
+    make_floor_collider(cloud.ptscene.get(), 2);
+  }
+  for (auto size = 32; size <= max_size; size *= 2) {
+    auto& pebbles   = scenes.emplace_back();
+    pebbles.name    = "pebbles_" + std::to_string(size * size);
+    pebbles.ptscene = std::make_unique<particle_scene>();
+    make_particle_cloud(pebbles.ptscene.get(), size * size, 1);
+    make_pebbles(pebbles.ptscene.get(), 8, 1);
+    make_floor_collider(pebbles.ptscene.get(), 2);
+  }
+  for (auto size = 32; size <= max_size; size *= 2) {
+    auto& dam   = scenes.emplace_back();
+    dam.name    = "dam_" + std::to_string(size * size);
+    dam.ptscene = std::make_unique<particle_scene>();
+    make_particle_block(dam.ptscene.get(), size * size, 0.01f);
+    make_floor_collider(dam.ptscene.get(), 2);
+  }
+  for (auto size = 32; size <= max_size; size *= 2) {
+    auto& body   = scenes.emplace_back();
+    body.name    = "body_" + std::to_string(size * size);
+    body.ptscene = std::make_unique<particle_scene>();
+    make_body_block(body.ptscene.get(), size * size, 0.01f, 0.08f);
+    make_floor_collider(body.ptscene.get(), 2);
+  }
+  for (auto size = 32; size <= max_size; size *= 2) {
+    auto& hair   = scenes.emplace_back();
+    hair.name    = "hair_" + std::to_string(size * size);
+    hair.ptscene = std::make_unique<particle_scene>();
+    make_hair_grid(hair.ptscene.get(), size * size, 0.3f);
+    make_floor_collider(hair.ptscene.get(), 2);
+  }
+  for (auto size = 32; size <= max_size; size *= 2) {
+    auto& fountain   = scenes.emplace_back();
+    fountain.name    = "fountain_" + std::to_string(size * size);
+    fountain.ptscene = std::make_unique<particle_scene>();
+    make_fountain(fountain.ptscene.get(), size * size, 0.1f);
+    make_floor_collider(fountain.ptscene.get(), 4);
+  }
+  return scenes;
+}
+
+// Benchmark result for one scene and solver. Steady allocations are the
+// ones after the first frame, that must be zero. The kernel difference is
+// the largest distance between the positions simulated with the simd and
+// scalar spring kernels, and the resume difference the one between a run
+// and a run resumed from a checkpoint, that must be zero. Both are negative
+// if not measured.
+struct bench_result {
+  string           scene              = "";
+  string           solver             = "";
+  bool             simd               = true;
+  int              particles          = 0;
+  double           seconds            = 0;
+  size_t           allocations        = 0;
+  size_t           steady_allocations = 0;
+  float            max_strain         = 0;
+  float            kernel_difference  = -1;
+  float            resume_difference  = -1;
+  particle_timings timings            = {};
+};
+
+bench_result run_bench(
+    const bench_scene& scene, const particle_params& params) {
+  auto result   = bench_result{};
+  result.scene  = scene.name;
+  result.solver = particle_solver_names[(int)params.solver];
+  result.simd   = params.simd;
+  for (auto shape : scene.ptscene->shapes)
+    result.particles += (int)shape->initial_positions.size();
+  init_simulation(scene.ptscene.get(), params);
+  auto allocations = allocation_count.load();
+  auto start       = std::chrono::steady_clock::now();
+  for (auto frame = 0; frame < params.frames; frame++) {
+    auto frame_allocations = allocation_count.load();
+    simulate_frame(scene.ptscene.get(), params);
+    if (frame > 0)
+      result.steady_allocations += allocation_count.load() -
+                                   frame_allocations;
+  }
+  result.seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start)
+                       .count();
+  result.allocations = allocation_count.load() - allocations;
+  result.timings     = scene.ptscene->timings;
+  result.max_strain  = get_max_strain(scene.ptscene.get());
+  return result;
+}
+
+// Largest distance between the positions simulated for params.frames frames
+// with the simd and the scalar spring kernels
+float get_kernel_difference(const bench_scene& scene, particle_params params) {
+  auto simulate = [&scene, &params](bool simd) {
+    params.simd = simd;
+    init_simulation(scene.ptscene.get(), params);
+    for (auto frame = 0; frame < params.frames; frame++)
+      simulate_frame(scene.ptscene.get(), params);
+    auto positions = vector<vector<vec3f>>{};
+    for (auto shape : scene.ptscene->shapes)
+      positions.push_back(shape->positions);
+    return positions;
+  };
+  auto simd       = simulate(true);
+  auto scalar     = simulate(false);
+  auto difference = 0.0f;
+  for (auto shape = 0; shape < simd.size(); shape++) {
+    for (auto vert = 0; vert < simd[shape].size(); vert++)
+      difference = max(
+          difference, distance(simd[shape][vert], scalar[shape][vert]));
+  }
+  return difference;
+}
+
+// Largest distance between the positions simulated for twice params.frames
+// frames, and the ones simulated by resuming from a checkpoint saved after
+// params.frames frames
+float get_resume_difference(const bench_scene& scene,
+    const particle_params& params, const string& filename) {
+  auto ptscene  = scene.ptscene.get();
+  auto ioerror  = ""s;
+  auto simulate = [ptscene, &params]() {
+    for (auto frame = 0; frame < params.frames; frame++)
+      simulate_frame(ptscene, params);
+  };
+  init_simulation(ptscene, params);
+  simulate();
+  if (!save_simulation_state(filename, ptscene, params, ioerror))
+    print_fatal(ioerror);
+  simulate();
+  auto positions = vector<vector<vec3f>>{};
+  for (auto shape : ptscene->shapes) positions.push_back(shape->positions);
+  init_simulation(ptscene, params);
+  if (!load_simulation_state(filename, ptscene, params, ioerror))
+    print_fatal(ioerror);
+  simulate();
+  std::remove(filename.c_str());
+  auto difference = 0.0f;
+  for (auto shape = 0; shape < positions.size(); shape++) {
+    auto& resumed = ptscene->shapes[shape]->positions;
+    for (auto vert = 0; vert < positions[shape].size(); vert++)
+      difference = max(
+          difference, distance(positions[shape][vert], resumed[vert]));
+  }
+  return difference;
+}
+
+// Format a float without losing small values
+string format_float(float value) {
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%g", value);
+  return buffer;
+}
+
+// Format results as json, with throughput in steps per second and costs in
+// nanoseconds per particle per step
+string format_results(const vector<bench_result>& results) {
+  auto json = "{\n  \"results\": [\n"s;
+  for (auto idx = 0; idx < results.size(); idx++) {
+    auto& result   = results[idx];
+    auto& timings  = result.timings;
+    auto  steps    = (double)max(timings.frames, 1);
+    auto  per_step = [&](double seconds) {
+      return std::to_string(
+          seconds * 1e9 / (steps * max(result.particles, 1)));
+    };
+    json += "    {\"scene\": \"" + result.scene + "\", \"solver\": \"" +
+            result.solver + "\", \"kernels\": \"" +
+            (result.simd ? "simd" : "scalar") +
+            "\", \"particles\": " + std::to_string(result.particles) +
+            ", \"steps\": " + std::to_string(timings.frames) + ",\n";
+    json += "     \"steps_per_second\": " +
+            std::to_string(steps / result.seconds) +
+            ", \"ns_per_particle\": " + per_step(result.seconds) +
+            ", \"allocations\": " + std::to_string(result.allocations) +
+            ", \"steady_allocations\": " +
+            std::to_string(result.steady_allocations) +
+            ", \"iterations_per_step\": " +
+            std::to_string(timings.iterations / steps) +
+            ", \"substeps_per_step\": " +
+            std::to_string(timings.substeps / steps) +
+            ", \"dropped_neighbors\": " + std::to_string(timings.dropped) +
+            ", \"max_strain\": " + std::to_string(result.max_strain) +
+            (result.kernel_difference >= 0
+                    ? ", \"kernel_difference\": " +
+                          format_float(result.kernel_difference)
+                    : ""s) +
+            (result.resume_difference >= 0
+                    ? ", \"resume_difference\": " +
+                          format_float(result.resume_difference)
+                    : ""s) +
+            ",\n";
+    json += "     \"phases_ns_per_particle\": {\"integration\": " +
+            per_step(timings.integration) +
+            ", \"springs\": " + per_step(timings.springs) +
+            ", \"neighbors\": " + per_step(timings.neighbors) +
+            ", \"collisions\": " + per_step(timings.collisions) +
+            ", \"velocities\": " + per_step(timings.velocities) +
+            ", \"normals\": " + per_step(timings.normals) + "}}" +
+            (idx + 1 < results.size() ? "," : "") + "\n";
+  }
+  json += "  ]\n}\n";
+  return json;
+}
+
+int main(int argc, const char* argv[]) {
+  // options
+  auto ptparams    = particle_params{};
+  auto max_size    = 512;
+  auto outfilename = "bench_particle.json"s;
+  auto threads     = 0;
+  auto scalar      = false;
+  auto difference  = false;
+  auto resume      = false;
+  ptparams.frames  = 4;
+
+  // parse command line
+  auto cli = make_cli("bench_particle", "Particle solvers benchmark");
+  add_option(cli, "--frames", ptparams.frames, "Simulated frames per run.");
+  add_option(cli, "--max-size", max_size, "Largest cloth grid size.");
+  add_option(cli, "--mssteps", ptparams.mssteps, "Mass-spring substeps.");
+  add_option(cli, "--pdbsteps", ptparams.pdbsteps, "Constraint iterations.");
+  add_option(cli, "--tolerance", ptparams.tolerance, "Pbd tolerance.");
+  add_option(cli, "--pdblevels", ptparams.pdblevels, "Pbd hierarchy levels.");
+  add_option(cli, "--levelsteps", ptparams.levelsteps, "Coarse iterations.");
+  add_option(cli, "--attachments", ptparams.attachments, "Pbd attachments.");
+  add_option(cli, "--adaptive", ptparams.adaptive, "Adaptive steps.");
+  add_option(cli, "--minsteps", ptparams.minsteps, "Min adaptive steps.");
+  add_option(cli, "--maxsteps", ptparams.maxsteps, "Max adaptive steps.");
+  add_option(cli, "--fluidsteps", ptparams.fluidsteps, "Fluid iterations.");
+  add_option(cli, "--viscosity", ptparams.viscosity, "Fluid viscosity.");
+  add_option(cli, "--matchsteps", ptparams.matchsteps, "Matching iterations.");
+  add_option(cli, "--strandsteps", ptparams.strandsteps, "Strand iterations.");
+  add_option(cli, "--compaction", ptparams.compaction, "Pool compaction.");
+  add_option(cli, "--scalar", scalar, "Scalar spring kernels only.");
+  add_option(cli, "--difference", difference, "Compare spring kernels.");
+  add_option(cli, "--resume", resume, "Compare runs resumed from checkpoints.");
+  add_option(cli, "--output,-o", outfilename, "Output json filename.");
+  add_option(cli, "--threads", threads, "Number of threads (0 for all cores).");
+  parse_cli(cli, argc, argv);
+  set_thread_count(threads);
+  ptparams.simd = !scalar;
+
+  // build scenes in memory
+  auto scenes = make_bench_scenes(max_size);
+
+  // run all solvers on all scenes, fluids only on point scenes
+  auto results  = vector<bench_result>{};
+  auto solvers  = vector<particle_solver_type>{
+      particle_solver_type::mass_spring, particle_solver_type::position_based,
+      particle_solver_type::position_fluid,
+      particle_solver_type::shape_matching,
+      particle_solver_type::follow_the_leader};
+  auto progress = vec2i{0, (int)(scenes.size() * solvers.size())};
+  for (auto& scene : scenes) {
+    auto points = true;
+    for (auto shape : scene.ptscene->shapes)
+      if (shape->points.empty()) points = false;
+    for (auto solver : solvers) {
+      print_progress("simulate " + scene.name, progress.x++, progress.y);
+      if (!points && solver == particle_solver_type::position_fluid) continue;
+      auto params   = ptparams;
+      params.solver = solver;
+      results.push_back(run_bench(scene, params));
+      if (difference)
+        results.back().kernel_difference = get_kernel_difference(
+            scene, params);
+      if (resume)
+        results.back().resume_difference = get_resume_difference(
+            scene, params, outfilename + ".state");
+    }
+  }
+  print_progress("simulate", progress.x++, progress.y);
+
+  // save results
+  auto ioerror = ""s;
+  if (!save_text(outfilename, format_results(results), ioerror))
+    print_fatal(ioerror);
+
+  // check that frames after the first do not allocate
+  auto allocating = ""s;
+  for (auto& result : results) {
+    if (!result.steady_allocations) continue;
+    allocating += "\n  " + result.scene + " " + result.solver + ": " +
+                  std::to_string(result.steady_allocations);
+  }
+  if (!allocating.empty())
+    print_fatal("simulate_frame allocated after the first frame" + allocating);
+
+  // check that resumed runs continue exactly
+  auto diverging = ""s;
+  for (auto& result : results) {
+    if (result.resume_difference <= 0) continue;
+    diverging += "\n  " + result.scene + " " + result.solver + ": " +
+                 format_float(result.resume_difference);
+  }
+  if (!diverging.empty())
+    print_fatal("resumed simulations diverged" + diverging);
+
+  // done
+  return 0;
+}
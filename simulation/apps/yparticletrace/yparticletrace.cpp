@@ -29,18 +29,28 @@
 #include <yocto/yocto_commonio.h>
 #include <yocto/yocto_image.h>
 #include <yocto/yocto_math.h>
+#include <yocto/yocto_parallel.h>
 #include <yocto/yocto_sceneio.h>
 #include <yocto/yocto_trace.h>
 #include <yocto_particle/yocto_particle.h>
+#include <yocto_profile/yocto_profile.h>
+#include <yocto_sceneload/yocto_sceneload.h>
+#include <yocto_tasks/yocto_tasks.h>
 using namespace yocto;
 
+#include <algorithm>
+#include <chrono>
+#include <future>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <sstream>
 
 // construct a scene from io
 void init_scene(trace_scene* scene, sceneio_scene* ioscene,
     trace_camera*& camera, sceneio_camera* iocamera,
-    progress_callback progress_cb = {}) {
+    unordered_map<sceneio_shape*, trace_shape*>& trshapemap,
+    progress_callback                            progress_cb = {}) {
   // handle progress
   auto progress = vec2i{
       0, (int)ioscene->cameras.size() + (int)ioscene->environments.size() +
@@ -126,6 +136,7 @@ void init_scene(trace_scene* scene, sceneio_scene* ioscene,
     shape->radius        = ioshape->radius;
     shape->tangents      = ioshape->tangents;
     shape_map[ioshape]   = shape;
+    trshapemap[ioshape]  = shape;
   }
 
   for (auto ioinstance : ioscene->instances) {
@@ -170,7 +181,8 @@ void init_ptscene(particle_scene* ptscene, sceneio_scene* ioscene,
 
   // shapes
   static auto velocity = unordered_map<string, float>{
-      {"floor", 0}, {"particles", 1}, {"cloth", 0}, {"collider", 0}};
+      {"floor", 0}, {"particles", 1}, {"cloth", 0}, {"collider", 0},
+      {"body", 0}, {"rigid", 0}, {"hair", 0}};
   for (auto ioinstance : ioscene->instances) {
     if (progress_cb) progress_cb("convert instance", progress.x++, progress.y);
     auto ioshape    = ioinstance->shape;
@@ -185,6 +197,21 @@ void init_ptscene(particle_scene* ptscene, sceneio_scene* ioscene,
           ioshape->normals, ioshape->radius, 0.5, 1 / 8000.0,
           {nverts - 1, nverts - (int)sqrt(nverts)});
       ptshapemap[ioshape] = ptshape;
+    } else if (iomaterial->name == "body" || iomaterial->name == "rigid") {
+      // bodies use clusters of a quarter of their extent, rigid ones a
+      // single stiff cluster
+      auto bounds = invalidb3f;
+      for (auto& position : ioshape->positions)
+        bounds = merge(bounds, position);
+      auto rigid   = iomaterial->name == "rigid";
+      auto ptshape = add_body(ptscene, ioshape->triangles, ioshape->quads,
+          ioshape->positions, ioshape->normals, ioshape->radius, 1,
+          rigid ? 1 : 0.5f, rigid ? 0 : max(size(bounds)) / 4);
+      ptshapemap[ioshape] = ptshape;
+    } else if (iomaterial->name == "hair") {
+      auto ptshape = add_hair(ptscene, ioshape->lines, ioshape->positions,
+          ioshape->normals, ioshape->radius, 1, 0.2f);
+      ptshapemap[ioshape] = ptshape;
     } else if (ioinstance->material->name == "collider") {
       add_collider(ptscene, ioshape->triangles, ioshape->quads,
           ioshape->positions, ioshape->normals, ioshape->radius);
@@ -200,12 +227,245 @@ void init_ptscene(particle_scene* ptscene, sceneio_scene* ioscene,
   if (progress_cb) progress_cb("convert done", progress.x++, progress.y);
 }
 
-void update_ioscene(
-    const unordered_map<sceneio_shape*, particle_shape*>& ptshapemap) {
+// Snapshot of the simulated shapes for a frame, used to hand the simulation
+// results to the renderer while the next frames are being simulated.
+struct frame_snapshot {
+  int                   frame     = 0;
+  vector<vector<vec3f>> positions = {};
+  vector<vector<vec3f>> normals   = {};
+  vector<vector<float>> radius    = {};
+};
+
+// Turns particle shapes into emitters, resizing their io shapes to the pool
+void init_emitters(
+    const unordered_map<sceneio_shape*, particle_shape*>& ptshapemap,
+    float rate, float lifetime, int capacity) {
   for (auto [ioshape, ptshape] : ptshapemap) {
-    get_positions(ptshape, ioshape->positions);
-    get_normals(ptshape, ioshape->normals);
+    if (ptshape->points.empty()) continue;
+    set_emitter(ptshape, rate, lifetime, capacity, ptshape->emit_velocity,
+        ptshape->emit_rngscale);
+    ioshape->points    = ptshape->points;
+    ioshape->positions = ptshape->positions;
+    ioshape->radius    = ptshape->radius;
+    if (!ioshape->normals.empty()) ioshape->normals = ptshape->normals;
+  }
+}
+
+// Pairs of simulated shape indices and the trace shapes that display them.
+// Indices are used so that copies of the particle scene can be displayed.
+using shape_pairs = vector<std::pair<int, trace_shape*>>;
+
+void make_snapshot(frame_snapshot& snapshot, particle_scene* ptscene,
+    const shape_pairs& shapes, int frame) {
+  snapshot.frame = frame;
+  snapshot.positions.resize(shapes.size());
+  snapshot.normals.resize(shapes.size());
+  snapshot.radius.resize(shapes.size());
+  for (auto idx = 0; idx < shapes.size(); idx++) {
+    auto ptshape = ptscene->shapes[shapes[idx].first];
+    get_positions(ptshape, snapshot.positions[idx]);
+    get_normals(ptshape, snapshot.normals[idx]);
+    get_radius(ptshape, snapshot.radius[idx]);
+  }
+}
+
+void update_trscene(trace_bvh* bvh, trace_scene* scene,
+    const frame_snapshot& snapshot, const shape_pairs& shapes,
+    const trace_params& params) {
+  auto updated_shapes = vector<trace_shape*>{};
+  for (auto idx = 0; idx < shapes.size(); idx++) {
+    auto shape = shapes[idx].second;
+    // copy assignment reuses the shape buffers since sizes do not change
+    shape->positions = snapshot.positions[idx];
+    if (!shape->normals.empty()) shape->normals = snapshot.normals[idx];
+    if (!shape->points.empty()) shape->radius = snapshot.radius[idx];
+    updated_shapes.push_back(shape);
+  }
+  // refit the shape bvhs and the top-level bvh instead of rebuilding them
+  update_bvh(bvh, scene, {}, updated_shapes, params);
+}
+
+// Filename for a frame of a sequence
+string get_frame_filename(const string& filename, int frame) {
+  auto number = std::to_string(frame);
+  while (number.size() < 3) number = "0" + number;
+  return replace_extension(filename, "_" + number + path_extension(filename));
+}
+
+// Variant of a parameter sweep with its results
+struct sweep_variant {
+  string          name         = "";
+  particle_params params       = {};
+  frame_snapshot  snapshot     = {};
+  double          seconds      = 0;
+  float           max_velocity = 0;
+  float           max_strain   = 0;
+  bool            stable       = true;
+};
+
+// Set a sweep parameter from its name and value
+bool set_sweep_param(particle_params& params, const string& name,
+    const string& value, string& error) {
+  try {
+    if (name == "solver") {
+      auto pos = std::find(particle_solver_names.begin(),
+          particle_solver_names.end(), value);
+      if (pos == particle_solver_names.end()) throw std::invalid_argument{""};
+      params.solver = (particle_solver_type)(pos -
+                                             particle_solver_names.begin());
+    } else if (name == "deltat") {
+      params.deltat = std::stof(value);
+    } else if (name == "mssteps") {
+      params.mssteps = std::stoi(value);
+    } else if (name == "pdbsteps") {
+      params.pdbsteps = std::stoi(value);
+    } else if (name == "tolerance") {
+      params.tolerance = std::stof(value);
+    } else if (name == "pdblevels") {
+      params.pdblevels = std::stoi(value);
+    } else if (name == "levelsteps") {
+      params.levelsteps = std::stoi(value);
+    } else if (name == "attachments") {
+      params.attachments = std::stoi(value) != 0;
+    } else if (name == "adaptive") {
+      params.adaptive = std::stoi(value) != 0;
+    } else if (name == "cfl") {
+      params.cfl = std::stof(value);
+    } else if (name == "maxstrain") {
+      params.maxstrain = std::stof(value);
+    } else if (name == "minsteps") {
+      params.minsteps = std::stoi(value);
+    } else if (name == "maxsteps") {
+      params.maxsteps = std::stoi(value);
+    } else if (name == "dumping") {
+      params.dumping = std::stof(value);
+    } else if (name == "minvelocity") {
+      params.minvelocity = std::stof(value);
+    } else if (name == "gravity") {
+      params.gravity = std::stof(value);
+    } else if (name == "bounce") {
+      auto split    = value.find(':');
+      params.bounce = {std::stof(value.substr(0, split)),
+          split == string::npos ? params.bounce.y
+                                : std::stof(value.substr(split + 1))};
+    } else {
+      error = "unknown sweep parameter " + name;
+      return false;
+    }
+  } catch (std::exception&) {
+    error = "bad value " + value + " for sweep parameter " + name;
+    return false;
+  }
+  return true;
+}
+
+// Load a parameter sweep. Each line lists `name=value` pairs separated by
+// spaces and adds one variant. Comma separated values add the variants for
+// all their combinations, so a single line describes a grid.
+bool load_sweep(const string& filename, const particle_params& base,
+    vector<sweep_variant>& variants, string& error) {
+  auto text = ""s;
+  if (!load_text(filename, text, error)) return false;
+  auto lines = std::istringstream{text};
+  auto line  = ""s;
+  while (std::getline(lines, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    auto line_variants = vector<sweep_variant>{{"", base}};
+    auto tokens        = std::istringstream{line};
+    auto token         = ""s;
+    while (tokens >> token) {
+      auto split = token.find('=');
+      if (split == string::npos) {
+        error = "bad sweep entry " + token;
+        return false;
+      }
+      auto name    = token.substr(0, split);
+      auto values  = std::istringstream{token.substr(split + 1)};
+      auto value   = ""s;
+      auto product = vector<sweep_variant>{};
+      while (std::getline(values, value, ',')) {
+        for (auto variant : line_variants) {
+          if (!set_sweep_param(variant.params, name, value, error))
+            return false;
+          variant.name += (variant.name.empty() ? "" : " ") + name + "=" +
+                          value;
+          product.push_back(variant);
+        }
+      }
+      line_variants = product;
+    }
+    variants.insert(variants.end(), line_variants.begin(), line_variants.end());
+  }
+  if (variants.empty()) {
+    error = "empty sweep " + filename;
+    return false;
   }
+  return true;
+}
+
+// Simulate all sweep variants concurrently, each on its own copy of the scene
+void run_sweep(vector<sweep_variant>& variants, const particle_scene* ptscene,
+    const shape_pairs& shapes, progress_callback progress_cb) {
+  auto progress       = vec2i{0, (int)variants.size()};
+  auto progress_mutex = std::mutex{};
+  if (progress_cb) progress_cb("simulate sweep", progress.x, progress.y);
+  parallel_range((int)variants.size(), [&](int idx) {
+    auto& variant       = variants[idx];
+    auto  variant_guard = std::make_unique<particle_scene>();
+    auto  variant_scene = variant_guard.get();
+    copy_scene(variant_scene, ptscene);
+    auto start = std::chrono::steady_clock::now();
+    init_simulation(variant_scene, variant.params);
+    auto frame = 0;
+    for (; frame < variant.params.frames && variant.stable; frame++) {
+      simulate_frame(variant_scene, variant.params);
+      auto velocity = get_max_velocity(variant_scene);
+      auto strain   = get_max_strain(variant_scene);
+      variant.stable = std::isfinite(velocity) && std::isfinite(strain);
+      variant.max_velocity = max(variant.max_velocity, velocity);
+      variant.max_strain   = max(variant.max_strain, strain);
+    }
+    variant.seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start)
+                          .count();
+    make_snapshot(variant.snapshot, variant_scene, shapes, frame);
+    auto lock = std::lock_guard{progress_mutex};
+    if (progress_cb) progress_cb("simulate sweep", ++progress.x, progress.y);
+  });
+}
+
+// Save sweep timings and stability metrics as json
+bool save_sweep(const string& filename, const vector<sweep_variant>& variants,
+    const vector<string>& imfilenames, string& error) {
+  auto number = [](float value) {
+    return std::isfinite(value) ? std::to_string(value) : "null"s;
+  };
+  auto json = "{\n  \"variants\": [\n"s;
+  for (auto idx = 0; idx < variants.size(); idx++) {
+    auto& variant = variants[idx];
+    auto& params  = variant.params;
+    json += "    {\"name\": \"" + variant.name + "\", \"image\": \"" +
+            imfilenames[idx] + "\",\n";
+    json += "     \"solver\": \"" +
+            particle_solver_names[(int)params.solver] +
+            "\", \"deltat\": " + number(params.deltat) +
+            ", \"mssteps\": " + std::to_string(params.mssteps) +
+            ", \"pdbsteps\": " + std::to_string(params.pdbsteps) +
+            ", \"tolerance\": " + number(params.tolerance) +
+            ", \"pdblevels\": " + std::to_string(params.pdblevels) +
+            ", \"attachments\": " + (params.attachments ? "true" : "false") +
+            ", \"adaptive\": " + (params.adaptive ? "true" : "false") +
+            ", \"dumping\": " + number(params.dumping) + ", \"bounce\": [" +
+            number(params.bounce.x) + ", " + number(params.bounce.y) + "],\n";
+    json += "     \"frames\": " + std::to_string(variant.snapshot.frame) +
+            ", \"seconds\": " + std::to_string(variant.seconds) +
+            ", \"max_velocity\": " + number(variant.max_velocity) +
+            ", \"max_strain\": " + number(variant.max_strain) +
+            ", \"stable\": " + (variant.stable ? "true" : "false") + "}" +
+            (idx + 1 < variants.size() ? "," : "") + "\n";
+  }
+  json += "  ]\n}\n";
+  return save_text(filename, json, error);
 }
 
 int main(int argc, const char* argv[]) {
@@ -215,58 +475,169 @@ int main(int argc, const char* argv[]) {
   auto camera_name = ""s;
   auto imfilename  = "out.hdr"s;
   auto filename    = "scene.json"s;
+  auto sequence    = 0;
+  auto sweepname   = ""s;
+  auto wind        = false;
+  auto emit_rate   = 0.0f;
+  auto emit_life   = 0.0f;
+  auto emit_pool   = 0;
+  auto checkpoint  = particle_checkpoint{};
+  auto resumename  = ""s;
+  auto threads     = 0;
+  auto tracename   = ""s;
 
   // parse command line
   auto cli = make_cli("yscntrace", "Offline path tracing");
   add_option(cli, "--camera", camera_name, "Camera name.");
   add_option(cli, "--solver", ptparams.solver, "Solver", particle_solver_names);
   add_option(cli, "--frames", ptparams.frames, "Simulation frames.");
+  add_option(
+      cli, "--tolerance", ptparams.tolerance, "Pbd convergence tolerance.");
+  add_option(cli, "--pdblevels", ptparams.pdblevels, "Pbd hierarchy levels.");
+  add_option(cli, "--attachments", ptparams.attachments,
+      "Pbd long range attachments.");
+  add_option(cli, "--adaptive", ptparams.adaptive,
+      "Adaptive steps from velocity and strain.");
+  add_option(cli, "--minsteps", ptparams.minsteps, "Min adaptive steps.");
+  add_option(cli, "--maxsteps", ptparams.maxsteps, "Max adaptive steps.");
+  add_option(cli, "--fluidsteps", ptparams.fluidsteps, "Fluid iterations.");
+  add_option(cli, "--viscosity", ptparams.viscosity, "Fluid viscosity.");
+  add_option(cli, "--matchsteps", ptparams.matchsteps, "Matching iterations.");
+  add_option(cli, "--strandsteps", ptparams.strandsteps, "Strand iterations.");
+  add_option(cli, "--emit-rate", emit_rate, "Particles emitted per second.");
+  add_option(cli, "--emit-lifetime", emit_life, "Emitted particles lifetime.");
+  add_option(cli, "--emit-capacity", emit_pool, "Emitted particles pool.");
+  add_option(cli, "--sequence", sequence,
+      "Render every n-th frame to numbered images (0 renders the last).");
+  add_option(cli, "--checkpoint", checkpoint.filename,
+      "Checkpoint filename, rewritten while simulating.");
+  add_option(cli, "--checkpoint-frames", checkpoint.frames,
+      "Frames between checkpoints.");
+  add_option(cli, "--resume", resumename, "Resume from a checkpoint.");
+  add_option(cli, "--sweep", sweepname,
+      "Parameter sweep file, simulating and rendering each variant.");
   add_option(cli, "--resolution", trparams.resolution, "Image resolution.");
   add_option(cli, "--samples", trparams.samples, "Number of samples.");
   add_option(
       cli, "--tracer", trparams.sampler, "Trace type.", trace_sampler_names);
   add_option(cli, "--output-image,-o", imfilename, "Image filename");
   add_option(cli, "scene", filename, "Scene filename", true);
-  add_option(cli, "--extra,-e", ptparams.flag, "Extra Filter");
+  add_option(cli, "--extra,-e", wind, "Wind instead of gravity");
+  add_option(cli, "--threads", threads, "Number of threads (0 for all cores).");
+  add_option(cli, "--trace", tracename, "Trace filename, in Chrome format.");
   parse_cli(cli, argc, argv);
+  set_thread_count(threads);
+  if (!tracename.empty()) start_profiling();
 
   // scene loading
+  auto loading       = profile_scope{"load scene"};
   auto ioscene_guard = std::make_unique<sceneio_scene>();
   auto ioscene       = ioscene_guard.get();
   auto ioerror       = ""s;
-  if (!load_scene(filename, ioscene, ioerror, print_progress))
+  if (!load_scene_parallel(filename, ioscene, ioerror, print_progress))
     print_fatal(ioerror);
   flatten_scene(ioscene);
+  loading.end();
 
   // simulate
+  auto converting    = profile_scope{"convert scene"};
   auto ptscene_guard = std::make_unique<particle_scene>();
   auto ptscene       = ptscene_guard.get();
   auto ptshapemap    = unordered_map<sceneio_shape*, particle_shape*>{};
   init_ptscene(ptscene, ioscene, ptshapemap, print_progress);
-
-  // simulate
-  simulate_frames(ptscene, ptparams, print_progress);
-
-  // update scene
-  update_ioscene(ptshapemap);
+  if (wind) {
+    ptparams.gravity = 0;
+    add_wind(ptscene, {1, 0, 0}, 4);
+  }
+  if (emit_rate > 0) init_emitters(ptshapemap, emit_rate, emit_life, emit_pool);
 
   // get camera
   auto iocamera = get_camera(ioscene, camera_name);
 
-  // convert scene
+  // convert scene once, later frames only update the simulated shapes
   auto scene_guard = std::make_unique<trace_scene>();
   auto scene       = scene_guard.get();
   auto camera      = (trace_camera*)nullptr;
-  init_scene(scene, ioscene, camera, iocamera, print_progress);
+  auto trshapemap  = unordered_map<sceneio_shape*, trace_shape*>{};
+  init_scene(scene, ioscene, camera, iocamera, trshapemap, print_progress);
+
+  // match simulated and rendered shapes
+  auto shapes = shape_pairs{};
+  for (auto [ioshape, ptshape] : ptshapemap) {
+    auto index = std::find(ptscene->shapes.begin(), ptscene->shapes.end(),
+                     ptshape) -
+                 ptscene->shapes.begin();
+    shapes.push_back({(int)index, trshapemap.at(ioshape)});
+  }
 
   // cleanup
   if (ioscene_guard) ioscene_guard.reset();
-  if (ptscene_guard) ptscene_guard.reset();
+  converting.end();
+
+  // frames to render
+  auto render_frames = vector<int>{};
+  if (sequence > 0) {
+    for (auto frame = 0; frame <= ptparams.frames; frame += sequence)
+      render_frames.push_back(frame);
+  } else {
+    render_frames.push_back(ptparams.frames);
+  }
+
+  // parameter sweeps simulate all variants before rendering
+  auto variants = vector<sweep_variant>{};
+  if (!sweepname.empty()) {
+    if (!load_sweep(sweepname, ptparams, variants, ioerror))
+      print_fatal(ioerror);
+    auto sweeping = profile_scope{"simulate sweep"};
+    run_sweep(variants, ptscene, shapes, print_progress);
+  }
+
+  // simulation runs on its own thread: it advances the particle scene up to
+  // the requested frame, checkpointing its state on the way, and stores the
+  // result in a snapshot
+  auto ptframe        = 0;
+  auto simulate_until = [ptscene, &ptparams, &ptframe, &shapes, &checkpoint](
+                            frame_snapshot* snapshot, int frame) {
+    for (; ptframe < frame; ptframe++) {
+      auto simulating = profile_scope{"simulate frame"};
+      simulate_frame(ptscene, ptparams);
+      profile_counter("simulated frames", ptframe + 1);
+      auto error = ""s;
+      if (!update_checkpoint(&checkpoint, ptscene, ptparams, error))
+        print_fatal(error);
+    }
+    make_snapshot(*snapshot, ptscene, shapes, frame);
+  };
+
+  // init simulation and start simulating the first frame to render
+  auto current   = frame_snapshot{};
+  auto pending   = frame_snapshot{};
+  auto simulator = std::future<void>{};
+  if (variants.empty()) {
+    auto initing = profile_scope{"init simulation"};
+    print_progress("init simulation", 0, 1);
+    init_simulation(ptscene, ptparams);
+    print_progress("init simulation", 1, 1);
+    if (!resumename.empty()) {
+      if (!load_simulation_state(resumename, ptscene, ptparams, ioerror))
+        print_fatal(ioerror);
+      ptframe = ptscene->frame;
+      render_frames.erase(
+          std::remove_if(render_frames.begin(), render_frames.end(),
+              [ptframe](int frame) { return frame < ptframe; }),
+          render_frames.end());
+      if (render_frames.empty()) print_fatal("checkpoint past the last frame");
+    }
+    initing.end();
+    simulator = run_async(simulate_until, &pending, render_frames.front());
+  }
 
   // build bvh
+  auto building  = profile_scope{"build bvh"};
   auto bvh_guard = std::make_unique<trace_bvh>();
   auto bvh       = bvh_guard.get();
   init_bvh(bvh, scene, trparams, print_progress);
+  building.end();
 
   // init renderer
   auto lights_guard = std::make_unique<trace_lights>();
@@ -279,14 +650,68 @@ int main(int argc, const char* argv[]) {
     trparams.sampler = trace_sampler_type::eyelight;
   }
 
-  // render
-  auto render = trace_image(
-      scene, camera, bvh, lights, trparams, print_progress, {});
+  // render the final frame of each sweep variant and save the sweep metrics
+  if (!variants.empty()) {
+    auto imfilenames = vector<string>{};
+    auto rendering   = profile_scope{"render sweep"};
+    for (auto idx = 0; idx < variants.size(); idx++) {
+      print_progress("render sweep", idx, (int)variants.size());
+      update_trscene(bvh, scene, variants[idx].snapshot, shapes, trparams);
+      auto render = trace_image(scene, camera, bvh, lights, trparams, {}, {});
+      auto outfilename = replace_extension(imfilename,
+          "_v" + std::to_string(idx) + path_extension(imfilename));
+      if (!save_image(outfilename, render, ioerror)) print_fatal(ioerror);
+      imfilenames.push_back(outfilename);
+    }
+    print_progress(
+        "render sweep", (int)variants.size(), (int)variants.size());
+    rendering.end();
+    auto statsfilename = replace_extension(imfilename, ".sweep.json");
+    if (!save_sweep(statsfilename, variants, imfilenames, ioerror))
+      print_fatal(ioerror);
+    if (!tracename.empty() && !save_profile(tracename, ioerror))
+      print_fatal(ioerror);
+    return 0;
+  }
+
+  // render frames, simulating frame n+1 while rendering frame n
+  for (auto idx = 0; idx < render_frames.size(); idx++) {
+    print_progress("render frames", idx, (int)render_frames.size());
+    auto waiting = profile_scope{"wait simulation"};
+    simulator.get();
+    waiting.end();
+    std::swap(current, pending);
+    if (idx + 1 < render_frames.size()) {
+      simulator = run_async(simulate_until, &pending, render_frames[idx + 1]);
+    }
+
+    // update scene
+    auto updating = profile_scope{"update scene"};
+    update_trscene(bvh, scene, current, shapes, trparams);
+    updating.end();
+
+    // render
+    auto rendering = profile_scope{"render frame"};
+    auto render    = trace_image(scene, camera, bvh, lights, trparams, {}, {});
+    rendering.end();
+
+    // save image
+    auto saving      = profile_scope{"save image"};
+    auto outfilename = sequence > 0
+                           ? get_frame_filename(imfilename, current.frame)
+                           : imfilename;
+    if (!save_image(outfilename, render, ioerror)) print_fatal(ioerror);
+  }
+  print_progress("render frames", (int)render_frames.size(),
+      (int)render_frames.size());
+  if (!finish_checkpoint(&checkpoint, ioerror)) print_fatal(ioerror);
+
+  // save trace
+  if (!tracename.empty() && !save_profile(tracename, ioerror))
+    print_fatal(ioerror);
 
-  // save image
-  print_progress("save image", 0, 1);
-  if (!save_image(imfilename, render, ioerror)) print_fatal(ioerror);
-  print_progress("save image", 1, 1);
+  // cleanup
+  if (ptscene_guard) ptscene_guard.reset();
 
   // done
   return 0;
@@ -37,11 +37,33 @@
 #include <yocto_particle/yocto_particle.h>
 using namespace yocto;
 
+#include <chrono>
+#include <thread>
+
 #ifdef _WIN32
 #undef near
 #undef far
 #endif
 
+// Snapshot of the simulated shapes at a frame
+struct frame_snapshot {
+  int                   frame      = -1;
+  int                   iterations = 0;
+  float                 residual   = 0;
+  vector<vector<vec3f>> positions  = {};
+  vector<vector<vec3f>> normals    = {};
+};
+
+// Single-producer single-consumer ring of simulated frames. The simulation
+// thread publishes frames in order, writing frame f in slot f % slots.size(),
+// and never overwrites the frame the viewer displays. The viewer may read
+// the frames in [produced - slots.size() + 1, produced - 1].
+struct frame_ring {
+  vector<frame_snapshot> slots     = {};
+  atomic<int>            produced  = 0;  // number of published frames
+  atomic<int>            displayed = 0;  // frame pinned by the viewer
+};
+
 // Application state
 struct app_state {
   // loading parameters
@@ -62,11 +84,19 @@ struct app_state {
   // simulation scene
   particle_scene* ptscene  = new particle_scene{};
   particle_params ptparams = {};
-  int             ptframe  = 0;
+
+  // simulation thread and playback, ptframe is the displayed frame
+  frame_ring   ptframes  = {};
+  future<void> simulator = {};
+  atomic<bool> stop      = false;
+  bool         playing   = true;
+  int          ptframe   = 0;
+  int          uploaded  = -1;
 
   // shape maps
   unordered_map<sceneio_shape*, particle_shape*> ptshapemap = {};
   unordered_map<sceneio_shape*, shade_shape*>    glshapemap = {};
+  vector<std::pair<particle_shape*, shade_shape*>> ptglshapes = {};
 
   // loading status
   atomic<bool> ok           = false;
@@ -78,6 +108,8 @@ struct app_state {
   string       loader_error = "";
 
   ~app_state() {
+    stop = true;
+    if (simulator.valid()) simulator.get();
     if (ioscene) delete ioscene;
     if (glscene) delete glscene;
     if (ptscene) delete ptscene;
@@ -184,7 +216,8 @@ void init_ptscene(particle_scene* ptscene, sceneio_scene* ioscene,
 
   // shapes
   static auto velocity = unordered_map<string, float>{
-      {"floor", 0}, {"particles", 1}, {"cloth", 0}, {"collider", 0}};
+      {"floor", 0}, {"particles", 1}, {"cloth", 0}, {"collider", 0},
+      {"body", 0}, {"rigid", 0}, {"hair", 0}};
   for (auto ioinstance : ioscene->instances) {
     if (progress_cb) progress_cb("convert instance", progress.x++, progress.y);
     auto ioshape    = ioinstance->shape;
@@ -199,6 +232,21 @@ void init_ptscene(particle_scene* ptscene, sceneio_scene* ioscene,
           ioshape->normals, ioshape->radius, 0.5, 1 / 8000.0,
           {nverts - 1, nverts - (int)sqrt(nverts)});
       ptshapemap[ioshape] = ptshape;
+    } else if (iomaterial->name == "body" || iomaterial->name == "rigid") {
+      // bodies use clusters of a quarter of their extent, rigid ones a
+      // single stiff cluster
+      auto bounds = invalidb3f;
+      for (auto& position : ioshape->positions)
+        bounds = merge(bounds, position);
+      auto rigid   = iomaterial->name == "rigid";
+      auto ptshape = add_body(ptscene, ioshape->triangles, ioshape->quads,
+          ioshape->positions, ioshape->normals, ioshape->radius, 1,
+          rigid ? 1 : 0.5f, rigid ? 0 : max(size(bounds)) / 4);
+      ptshapemap[ioshape] = ptshape;
+    } else if (iomaterial->name == "hair") {
+      auto ptshape = add_hair(ptscene, ioshape->lines, ioshape->positions,
+          ioshape->normals, ioshape->radius, 1, 0.2f);
+      ptshapemap[ioshape] = ptshape;
     } else if (ioinstance->material->name == "collider") {
       add_collider(ptscene, ioshape->triangles, ioshape->quads,
           ioshape->positions, ioshape->normals, ioshape->radius);
@@ -214,19 +262,49 @@ void init_ptscene(particle_scene* ptscene, sceneio_scene* ioscene,
   if (progress_cb) progress_cb("convert done", progress.x++, progress.y);
 }
 
-void update_glscene(
-    const unordered_map<sceneio_shape*, shade_shape*>& glshapemap) {
-  for (auto [ioshape, glshape] : glshapemap) {
-    set_positions(glshape, ioshape->positions);
-    set_normals(glshape, ioshape->normals);
+void update_glscene(const frame_snapshot& snapshot,
+    const vector<std::pair<particle_shape*, shade_shape*>>& ptglshapes) {
+  for (auto idx = 0; idx < ptglshapes.size(); idx++) {
+    set_positions(ptglshapes[idx].second, snapshot.positions[idx]);
+    set_normals(ptglshapes[idx].second, snapshot.normals[idx]);
   }
 }
 
-void update_ioscene(
-    const unordered_map<sceneio_shape*, particle_shape*>& ptshapemap) {
-  for (auto [ioshape, ptshape] : ptshapemap) {
-    get_positions(ptshape, ioshape->positions);
-    get_normals(ptshape, ioshape->normals);
+// Simulation thread: simulates all frames, publishing them in the ring. When
+// the ring is full, it waits for the viewer to move past the oldest frame.
+void run_simulation(app_state* app) {
+  auto& ring = app->ptframes;
+  auto  size = (int)ring.slots.size();
+  init_simulation(app->ptscene, app->ptparams);
+  for (auto frame = 0; frame <= app->ptparams.frames; frame++) {
+    if (frame > 0) simulate_frame(app->ptscene, app->ptparams);
+    while (frame - size >= ring.displayed && !app->stop)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    if (app->stop) return;
+    auto& snapshot      = ring.slots[frame % size];
+    snapshot.frame      = frame;
+    snapshot.iterations = app->ptscene->iterations;
+    snapshot.residual   = app->ptscene->residual;
+    for (auto idx = 0; idx < app->ptglshapes.size(); idx++) {
+      get_positions(app->ptglshapes[idx].first, snapshot.positions[idx]);
+      get_normals(app->ptglshapes[idx].first, snapshot.normals[idx]);
+    }
+    ring.produced = frame + 1;
+  }
+}
+
+// Oldest frame the viewer can read from the ring
+int get_oldest_frame(const frame_ring& ring) {
+  return max(0, ring.produced - (int)ring.slots.size() + 1);
+}
+
+// Pins a frame for display, moving it forward if it was overwritten
+int pin_frame(frame_ring& ring, int frame) {
+  while (true) {
+    ring.displayed = frame;
+    auto oldest    = get_oldest_frame(ring);
+    if (frame >= oldest) return frame;
+    frame = oldest;
   }
 }
 
@@ -245,6 +323,8 @@ int main(int argc, const char* argv[]) {
   auto app_guard   = std::make_unique<app_state>();
   auto app         = app_guard.get();
   auto camera_name = ""s;
+  auto wind        = false;
+  auto cache       = 0;
 
   // parse command line
   auto cli = make_cli("ysceneviews", "views scene inteactively");
@@ -252,9 +332,26 @@ int main(int argc, const char* argv[]) {
   add_option(cli, "--solver,-s", app->ptparams.solver, "Solver",
       particle_solver_names);
   add_option(cli, "--gravity", app->ptparams.gravity, "Gravity");
+  add_option(
+      cli, "--tolerance", app->ptparams.tolerance, "Pbd convergence tolerance");
+  add_option(
+      cli, "--pdblevels", app->ptparams.pdblevels, "Pbd hierarchy levels");
+  add_option(cli, "--attachments", app->ptparams.attachments,
+      "Pbd long range attachments");
+  add_option(cli, "--adaptive", app->ptparams.adaptive,
+      "Adaptive steps from velocity and strain");
+  add_option(cli, "--minsteps", app->ptparams.minsteps, "Min adaptive steps");
+  add_option(cli, "--maxsteps", app->ptparams.maxsteps, "Max adaptive steps");
+  add_option(cli, "--fluidsteps", app->ptparams.fluidsteps, "Fluid iterations");
+  add_option(cli, "--viscosity", app->ptparams.viscosity, "Fluid viscosity");
+  add_option(cli, "--matchsteps", app->ptparams.matchsteps,
+      "Shape matching iterations");
+  add_option(cli, "--strandsteps", app->ptparams.strandsteps,
+      "Strand bending iterations");
   add_option(cli, "--camera", camera_name, "Camera name.");
+  add_option(cli, "--cache", cache, "Cached frames (0 for all frames)");
   add_option(cli, "scene", app->filename, "Scene filename", true);
-  add_option(cli, "--extra,-e", app->ptparams.flag, "Extra Filter");
+  add_option(cli, "--extra,-e", wind, "Wind instead of gravity");
   parse_cli(cli, argc, argv);
 
   // loading scene
@@ -268,6 +365,23 @@ int main(int argc, const char* argv[]) {
 
   // initialize particles
   init_ptscene(app->ptscene, app->ioscene, app->ptshapemap, print_progress);
+  if (wind) {
+    app->ptparams.gravity = 0;
+    add_wind(app->ptscene, {1, 0, 0}, 4);
+  }
+
+  // start simulating in the background, caching frames in the ring
+  for (auto [ioshape, ptshape] : app->ptshapemap)
+    app->ptglshapes.push_back({ptshape, nullptr});
+  auto& ring = app->ptframes;
+  ring.slots.resize(cache > 0 ? cache : app->ptparams.frames + 1);
+  for (auto& snapshot : ring.slots) {
+    for (auto [ptshape, glshape] : app->ptglshapes) {
+      snapshot.positions.push_back(ptshape->positions);
+      snapshot.normals.push_back(ptshape->normals);
+    }
+  }
+  app->simulator = run_async(run_simulation, app);
 
   // callbacks
   auto callbacks    = gui_callbacks{};
@@ -278,6 +392,10 @@ int main(int argc, const char* argv[]) {
           app->current = current;
           app->total   = total;
         });
+    // ptglshapes follows the order of ptshapemap, which is not modified
+    auto idx = 0;
+    for (auto [ioshape, ptshape] : app->ptshapemap)
+      app->ptglshapes[idx++].second = app->glshapemap.at(ioshape);
   };
   callbacks.clear_cb = [app](gui_window* win, const gui_input& input) {
     clear_scene(app->glscene);
@@ -296,15 +414,43 @@ int main(int argc, const char* argv[]) {
     }
     auto& params = app->glparams;
     draw_checkbox(win, "wireframe", params.wireframe);
+    auto& ring     = app->ptframes;
+    auto  produced = (int)ring.produced;
+    draw_checkbox(win, "play", app->playing);
+    if (produced > 0) {
+      auto oldest = get_oldest_frame(ring);
+      if (draw_slider(win, "frame", app->ptframe, oldest, produced - 1))
+        app->playing = false;
+      draw_label(win, "simulated", std::to_string(produced - 1));
+    }
+    if (app->uploaded >= 0 &&
+        app->ptparams.solver == particle_solver_type::position_based) {
+      auto& snapshot = ring.slots[app->uploaded % ring.slots.size()];
+      draw_label(win, "iterations", std::to_string(snapshot.iterations));
+      draw_label(win, "residual", std::to_string(snapshot.residual));
+    }
   };
   callbacks.update_cb = [app](gui_window* win, const gui_input& input) {
-    if (app->ptframe > app->ptparams.frames) app->ptframe = 0;
-    if (app->ptframe == 0) init_simulation(app->ptscene, app->ptparams);
-    simulate_frame(app->ptscene, app->ptparams);
-    app->ptframe++;
-    update_ioscene(app->ptshapemap);
-    update_glscene(app->glshapemap);
-    app->current = app->ptframe;
+    // advance playback over the cached frames, looping once all frames are
+    // simulated, then upload the pinned frame if it changed
+    auto& ring     = app->ptframes;
+    auto  produced = (int)ring.produced;
+    if (produced == 0) return;
+    auto frame = app->ptframe;
+    if (app->playing) {
+      if (frame + 1 < produced) {
+        frame += 1;
+      } else if (produced > app->ptparams.frames) {
+        frame = get_oldest_frame(ring);
+      }
+    }
+    frame        = pin_frame(ring, clamp(frame, 0, produced - 1));
+    app->ptframe = frame;
+    if (frame != app->uploaded) {
+      update_glscene(ring.slots[frame % ring.slots.size()], app->ptglshapes);
+      app->uploaded = frame;
+    }
+    app->current = frame;
     app->total   = app->ptparams.frames;
   };
   callbacks.uiupdate_cb = [app](gui_window* win, const gui_input& input) {
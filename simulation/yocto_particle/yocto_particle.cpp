@@ -30,11 +30,24 @@
 #include "yocto_particle.h"
 
 #include <yocto/yocto_geometry.h>
+#include <yocto/yocto_parallel.h>
 #include <yocto/yocto_sampling.h>
 #include <yocto/yocto_shape.h>
+#include <yocto_tasks/yocto_tasks.h>
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <queue>
+#include <unordered_map>
 #include <unordered_set>
 
+#if defined(YOCTO_PARTICLE_AVX2) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 #include <stdexcept> /*per risolvere il problema di invalid argument*/
 
 // -----------------------------------------------------------------------------
@@ -46,6 +59,7 @@ namespace yocto {
 particle_scene::~particle_scene() {
   for (auto shape : shapes) delete shape;
   for (auto collider : colliders) delete collider;
+  for (auto field : fields) delete field;
 }
 
 // Scene creation
@@ -61,7 +75,7 @@ particle_shape* add_particles(particle_scene* scene, const vector<int>& points,
   auto shape               = add_shape(scene);
   shape->points            = points;
   shape->initial_positions = positions;
-  shape->initial_normals.assign(shape->positions.size(), {0, 0, 1});
+  shape->initial_normals.assign(positions.size(), {0, 0, 1});
   shape->initial_radius = radius;
   shape->initial_invmass.assign(
       positions.size(), 1 / (mass * positions.size()));
@@ -69,7 +83,7 @@ particle_shape* add_particles(particle_scene* scene, const vector<int>& points,
   shape->emit_rngscale = random_velocity;
   // avoid crashes
   shape->positions = shape->initial_positions;
-  shape->normals   = shape->normals;
+  shape->normals   = shape->initial_normals;
   shape->radius    = shape->initial_radius;
   return shape;
 }
@@ -89,7 +103,51 @@ particle_shape* add_cloth(particle_scene* scene, const vector<vec4i>& quads,
   shape->spring_coeff   = coeff;
   // avoid crashes
   shape->positions = shape->initial_positions;
-  shape->normals   = shape->normals;
+  shape->normals   = shape->initial_normals;
+  shape->radius    = shape->initial_radius;
+  return shape;
+}
+particle_shape* add_body(particle_scene* scene, const vector<vec3i>& triangles,
+    const vector<vec4i>& quads, const vector<vec3f>& positions,
+    const vector<vec3f>& normals, const vector<float>& radius, float mass,
+    float stiffness, float cluster_size) {
+  auto shape               = add_shape(scene);
+  shape->triangles         = triangles;
+  shape->quads             = quads;
+  shape->initial_positions = positions;
+  shape->initial_normals   = normals;
+  shape->initial_radius    = radius;
+  shape->initial_invmass.assign(
+      positions.size(), 1 / (mass * positions.size()));
+  shape->initial_velocities.assign(positions.size(), {0, 0, 0});
+  shape->cluster_stiffness = stiffness;
+  shape->cluster_size      = cluster_size;
+  // avoid crashes
+  shape->positions = shape->initial_positions;
+  shape->normals   = shape->initial_normals;
+  shape->radius    = shape->initial_radius;
+  return shape;
+}
+particle_shape* add_hair(particle_scene* scene, const vector<vec2i>& lines,
+    const vector<vec3f>& positions, const vector<vec3f>& tangents,
+    const vector<float>& radius, float mass, float bending) {
+  auto shape               = add_shape(scene);
+  shape->lines             = lines;
+  shape->initial_positions = positions;
+  shape->initial_normals   = tangents;
+  shape->initial_radius    = radius;
+  shape->initial_invmass.assign(
+      positions.size(), 1 / (mass * positions.size()));
+  shape->initial_velocities.assign(positions.size(), {0, 0, 0});
+  shape->bend_coeff = bending;
+  // pin roots, that start lines but do not end any
+  auto ends = vector<bool>(positions.size(), false);
+  for (auto& line : lines) ends[line.y] = true;
+  for (auto& line : lines)
+    if (!ends[line.x]) shape->initial_pinned.push_back(line.x);
+  // avoid crashes
+  shape->positions = shape->initial_positions;
+  shape->normals   = shape->initial_normals;
   shape->radius    = shape->initial_radius;
   return shape;
 }
@@ -103,8 +161,69 @@ particle_collider* add_collider(particle_scene* scene,
   collider->positions = positions;
   collider->normals   = normals;
   collider->radius    = radius;
+  collider->initial_positions = positions;
+  collider->initial_normals   = normals;
   return collider;
 }
+void set_collider_frames(particle_collider* collider,
+    const vector<float>& times, const vector<frame3f>& frames) {
+  collider->frame_times = times;
+  collider->key_frames  = frames;
+}
+void set_collider_positions(particle_collider* collider,
+    const vector<float>& times, const vector<vector<vec3f>>& positions) {
+  collider->position_times = times;
+  collider->key_positions  = positions;
+}
+void set_collider_animation(
+    particle_collider* collider, const particle_animation& animation) {
+  collider->animation = animation;
+}
+
+// Force fields
+particle_field* add_field(particle_scene* scene, particle_field_type type) {
+  auto field  = scene->fields.emplace_back(new particle_field{});
+  field->type = type;
+  return field;
+}
+particle_field* add_wind(particle_scene* scene, const vec3f& direction,
+    float strength, float turbulence, float frequency) {
+  auto field        = add_field(scene, particle_field_type::wind);
+  field->direction  = normalize(direction);
+  field->strength   = strength;
+  field->turbulence = turbulence;
+  field->frequency  = frequency;
+  return field;
+}
+particle_field* add_vortex(particle_scene* scene, const vec3f& origin,
+    const vec3f& axis, float strength) {
+  auto field       = add_field(scene, particle_field_type::vortex);
+  field->origin    = origin;
+  field->direction = normalize(axis);
+  field->strength  = strength;
+  return field;
+}
+particle_field* add_attractor(
+    particle_scene* scene, const vec3f& origin, float strength) {
+  auto field      = add_field(scene, particle_field_type::attractor);
+  field->origin   = origin;
+  field->strength = strength;
+  return field;
+}
+particle_field* add_drag(particle_scene* scene, float strength) {
+  auto field      = add_field(scene, particle_field_type::drag);
+  field->strength = strength;
+  return field;
+}
+particle_field* add_aerodynamics(
+    particle_scene* scene, const vec3f& wind, float drag, float lift) {
+  auto field       = add_field(scene, particle_field_type::aerodynamic);
+  field->direction = length(wind) ? normalize(wind) : vec3f{1, 0, 0};
+  field->strength  = length(wind);
+  field->drag      = drag;
+  field->lift      = lift;
+  return field;
+}
 
 // Set shapes
 void set_velocities(
@@ -120,18 +239,1726 @@ void get_positions(particle_shape* shape, vector<vec3f>& positions) {
 void get_normals(particle_shape* shape, vector<vec3f>& normals) {
   normals = shape->normals;
 }
+void get_radius(particle_shape* shape, vector<float>& radius) {
+  radius = shape->radius;
+}
+
+// Shape matching
+void set_cluster_stiffness(
+    particle_shape* shape, const vector<float>& stiffness) {
+  shape->stiffness = stiffness;
+}
+
+// Emitters
+void set_emitter(particle_shape* shape, float rate, float lifetime,
+    int capacity, const vec3f& velocity, float random_scale) {
+  // particles are emitted from the sites, so shapes without any do not emit
+  if (shape->initial_positions.empty()) return;
+  if (!shape->emit_sites) shape->emit_sites = (int)shape->points.size();
+  auto sites = shape->emit_sites;
+  if (!sites) return;
+  shape->emit_rate     = rate;
+  shape->emit_lifetime = lifetime;
+  shape->emit_velocity = velocity;
+  shape->emit_rngscale = random_scale;
+  // free slots are parked at the first site
+  capacity = max(capacity, sites);
+  shape->points.resize(capacity);
+  for (auto idx = sites; idx < capacity; idx++) shape->points[idx] = idx;
+  shape->initial_positions.resize(capacity, shape->initial_positions[0]);
+  shape->initial_normals.resize(capacity, {0, 0, 1});
+  shape->initial_velocities.resize(capacity, {0, 0, 0});
+  shape->initial_invmass.resize(capacity, 0);
+  shape->initial_radius.resize(capacity, 0);
+  shape->positions = shape->initial_positions;
+  shape->normals   = shape->initial_normals;
+  shape->radius    = shape->initial_radius;
+}
+
+// Deep copy of a scene
+void copy_scene(particle_scene* copy, const particle_scene* scene) {
+  for (auto shape : scene->shapes) *add_shape(copy) = *shape;
+  for (auto collider : scene->colliders) *add_collider(copy) = *collider;
+  for (auto field : scene->fields)
+    *copy->fields.emplace_back(new particle_field{}) = *field;
+  copy->time = scene->time;
+}
+
+// Simulation diagnostics
+float get_max_velocity(const particle_scene* scene) {
+  auto max_velocity = 0.0f;
+  for (auto shape : scene->shapes) {
+    for (auto i = 0; i < (int)shape->velocities.size(); i++) {
+      if (!shape->invmass[i]) continue;
+      auto velocity = length(shape->velocities[i]);
+      if (!std::isfinite(velocity)) return velocity;
+      max_velocity = max(max_velocity, velocity);
+    }
+  }
+  return max_velocity;
+}
+float get_max_strain(const particle_scene* scene) {
+  auto max_strain = 0.0f;
+  for (auto shape : scene->shapes) {
+    auto& springs = shape->springs;
+    for (auto s = 0; s < (int)springs.vert0.size(); s++) {
+      if (!springs.rest[s]) continue;
+      auto len    = distance(shape->positions[springs.vert0[s]],
+          shape->positions[springs.vert1[s]]);
+      auto strain = std::abs(len - springs.rest[s]) / springs.rest[s];
+      if (!std::isfinite(strain)) return strain;
+      max_strain = max(max_strain, strain);
+    }
+  }
+  return max_strain;
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR FORCE FIELDS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Resize a structure-of-arrays workspace
+static void resize_soa(particle_soa& soa, size_t size) {
+  soa.x.assign(size, 0);
+  soa.y.assign(size, 0);
+  soa.z.assign(size, 0);
+}
+
+// Copy vectors into a structure-of-arrays workspace
+static void pack_soa(particle_soa& soa, const vector<vec3f>& values) {
+  auto x = soa.x.data(), y = soa.y.data(), z = soa.z.data();
+  for (auto i = 0; i < (int)values.size(); i++) {
+    x[i] = values[i].x;
+    y[i] = values[i].y;
+    z[i] = values[i].z;
+  }
+}
+
+// Lattice hash in [-1, 1] for value noise
+static inline float field_hash(int i, int j, int k) {
+  auto h = (uint32_t)i * 73856093u ^ (uint32_t)j * 19349663u ^
+           (uint32_t)k * 83492791u;
+  h ^= h >> 13;
+  h *= 0x5bd1e995u;
+  h ^= h >> 15;
+  return (float)(h & 0xffffffu) * (2.0f / (float)0xffffffu) - 1;
+}
+
+// Value noise in [-1, 1], without branches so that field loops vectorize
+static inline float field_noise(float x, float y, float z) {
+  auto fi = std::floor(x), fj = std::floor(y), fk = std::floor(z);
+  auto i = (int)fi, j = (int)fj, k = (int)fk;
+  auto u = x - fi, v = y - fj, w = z - fk;
+  u = u * u * (3 - 2 * u);
+  v = v * v * (3 - 2 * v);
+  w = w * w * (3 - 2 * w);
+  auto c00 = field_hash(i, j, k) * (1 - u) + field_hash(i + 1, j, k) * u;
+  auto c10 = field_hash(i, j + 1, k) * (1 - u) +
+             field_hash(i + 1, j + 1, k) * u;
+  auto c01 = field_hash(i, j, k + 1) * (1 - u) +
+             field_hash(i + 1, j, k + 1) * u;
+  auto c11 = field_hash(i, j + 1, k + 1) * (1 - u) +
+             field_hash(i + 1, j + 1, k + 1) * u;
+  return (c00 * (1 - v) + c10 * v) * (1 - w) + (c01 * (1 - v) + c11 * v) * w;
+}
+
+// Directional wind with noise turbulence
+static void eval_wind(const particle_field* field, float time,
+    const particle_soa& positions, particle_soa& accelerations, int count) {
+  auto px = positions.x.data(), py = positions.y.data(),
+       pz = positions.z.data();
+  auto ax = accelerations.x.data(), ay = accelerations.y.data(),
+       az = accelerations.z.data();
+  auto wind = field->direction * field->strength;
+  auto freq = field->frequency, turb = field->turbulence;
+  for (auto i = 0; i < count; i++) {
+    auto gust = 1 + turb * field_noise(
+                               px[i] * freq + time, py[i] * freq, pz[i] * freq);
+    ax[i] += wind.x * gust;
+    ay[i] += wind.y * gust;
+    az[i] += wind.z * gust;
+  }
+}
+
+// Vortex around an axis, decaying with the distance from the axis
+static void eval_vortex(const particle_field* field,
+    const particle_soa& positions, particle_soa& accelerations, int count) {
+  auto px = positions.x.data(), py = positions.y.data(),
+       pz = positions.z.data();
+  auto ax = accelerations.x.data(), ay = accelerations.y.data(),
+       az = accelerations.z.data();
+  auto o = field->origin, a = field->direction;
+  auto strength = field->strength;
+  for (auto i = 0; i < count; i++) {
+    auto rx = px[i] - o.x, ry = py[i] - o.y, rz = pz[i] - o.z;
+    auto ra = rx * a.x + ry * a.y + rz * a.z;
+    rx -= ra * a.x;
+    ry -= ra * a.y;
+    rz -= ra * a.z;
+    auto scale = strength / (rx * rx + ry * ry + rz * rz + 0.01f);
+    ax[i] += (a.y * rz - a.z * ry) * scale;
+    ay[i] += (a.z * rx - a.x * rz) * scale;
+    az[i] += (a.x * ry - a.y * rx) * scale;
+  }
+}
+
+// Radial attractor with softened inverse square falloff
+static void eval_attractor(const particle_field* field,
+    const particle_soa& positions, particle_soa& accelerations, int count) {
+  auto px = positions.x.data(), py = positions.y.data(),
+       pz = positions.z.data();
+  auto ax = accelerations.x.data(), ay = accelerations.y.data(),
+       az = accelerations.z.data();
+  auto o = field->origin;
+  auto strength = field->strength;
+  for (auto i = 0; i < count; i++) {
+    auto dx = o.x - px[i], dy = o.y - py[i], dz = o.z - pz[i];
+    auto d2    = dx * dx + dy * dy + dz * dz + 0.01f;
+    auto scale = strength / (d2 * std::sqrt(d2));
+    ax[i] += dx * scale;
+    ay[i] += dy * scale;
+    az[i] += dz * scale;
+  }
+}
+
+// Linear drag
+static void eval_drag(const particle_field* field,
+    const particle_soa& velocities, particle_soa& accelerations, int count) {
+  auto vx = velocities.x.data(), vy = velocities.y.data(),
+       vz = velocities.z.data();
+  auto ax = accelerations.x.data(), ay = accelerations.y.data(),
+       az = accelerations.z.data();
+  auto strength = field->strength;
+  for (auto i = 0; i < count; i++) {
+    ax[i] -= vx[i] * strength;
+    ay[i] -= vy[i] * strength;
+    az[i] -= vz[i] * strength;
+  }
+}
+
+// Aerodynamic drag and lift on a cloth triangle, split among its vertices
+static void eval_aerodynamics(
+    const particle_field* field, particle_shape* shape, int a, int b, int c) {
+  auto& positions  = shape->positions;
+  auto& velocities = shape->velocities;
+  auto  wind       = field->direction * field->strength;
+  auto  flow  = (velocities[a] + velocities[b] + velocities[c]) / 3 - wind;
+  auto  speed = length(flow);
+  if (!speed) return;
+  auto normal = cross(positions[b] - positions[a], positions[c] - positions[a]);
+  auto area   = length(normal) / 2;
+  if (!area) return;
+  normal = normalize(normal);
+  flow /= speed;
+  auto cosine = dot(normal, flow);
+  if (cosine < 0) {
+    normal = -normal;
+    cosine = -cosine;
+  }
+  auto pressure = 0.5f * area * speed * speed;
+  auto force    = -pressure * field->drag * cosine * flow;
+  auto side     = normal - cosine * flow;
+  if (length(side)) {
+    auto sine = std::sqrt(max(0.0f, 1 - cosine * cosine));
+    force -= pressure * field->lift * cosine * sine * normalize(side);
+  }
+  shape->forces[a] += force / 3;
+  shape->forces[b] += force / 3;
+  shape->forces[c] += force / 3;
+}
+
+// Adds the force fields contribution to the shape forces. Per-particle fields
+// are evaluated one field at a time in tight loops over the SoA workspaces,
+// that are sized by init_simulation, and resized here if the shape changed.
+static void apply_fields(
+    const particle_scene* scene, particle_shape* shape, float time) {
+  if (scene->fields.empty()) return;
+  auto  count         = (int)shape->positions.size();
+  auto& positions     = shape->field_positions;
+  auto& velocities    = shape->field_velocities;
+  auto& accelerations = shape->field_accelerations;
+  if ((int)positions.x.size() != count) {
+    resize_soa(positions, count);
+    resize_soa(velocities, count);
+    resize_soa(accelerations, count);
+  }
+  pack_soa(positions, shape->positions);
+  pack_soa(velocities, shape->velocities);
+  std::fill(accelerations.x.begin(), accelerations.x.end(), 0.0f);
+  std::fill(accelerations.y.begin(), accelerations.y.end(), 0.0f);
+  std::fill(accelerations.z.begin(), accelerations.z.end(), 0.0f);
+  for (auto field : scene->fields) {
+    switch (field->type) {
+      case particle_field_type::wind:
+        eval_wind(field, time, positions, accelerations, count);
+        break;
+      case particle_field_type::vortex:
+        eval_vortex(field, positions, accelerations, count);
+        break;
+      case particle_field_type::attractor:
+        eval_attractor(field, positions, accelerations, count);
+        break;
+      case particle_field_type::drag:
+        eval_drag(field, velocities, accelerations, count);
+        break;
+      case particle_field_type::aerodynamic:
+        for (auto& t : shape->triangles)
+          eval_aerodynamics(field, shape, t.x, t.y, t.z);
+        for (auto& q : shape->quads) {
+          eval_aerodynamics(field, shape, q.x, q.y, q.z);
+          if (q.z != q.w) eval_aerodynamics(field, shape, q.x, q.z, q.w);
+        }
+        break;
+    }
+  }
+  for (auto i = 0; i < count; i++) {
+    if (!shape->invmass[i]) continue;
+    shape->forces[i] += vec3f{accelerations.x[i], accelerations.y[i],
+                            accelerations.z[i]} /
+                        shape->invmass[i];
+  }
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR SPRINGS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Sorts springs into batches that do not share vertices using a greedy
+// coloring, and stores them as structure-of-arrays.
+static void make_springs(particle_springs& springs,
+    const vector<particle_spring>& list, int num_vertices) {
+  auto colors  = vector<vector<bool>>{};
+  auto buckets = vector<vector<int>>{};
+  for (auto idx = 0; idx < (int)list.size(); idx++) {
+    auto& spring = list[idx];
+    auto  color  = 0;
+    while (color < (int)colors.size() &&
+           (colors[color][spring.vert0] || colors[color][spring.vert1]))
+      color++;
+    if (color == (int)colors.size()) {
+      colors.emplace_back(num_vertices, false);
+      buckets.emplace_back();
+    }
+    colors[color][spring.vert0] = true;
+    colors[color][spring.vert1] = true;
+    buckets[color].push_back(idx);
+  }
+
+  springs = {};
+  springs.vert0.reserve(list.size());
+  springs.vert1.reserve(list.size());
+  springs.rest.reserve(list.size());
+  springs.coeff.reserve(list.size());
+  springs.batches.reserve(buckets.size() + 1);
+  for (auto& bucket : buckets) {
+    springs.batches.push_back((int)springs.vert0.size());
+    for (auto idx : bucket) {
+      springs.vert0.push_back(list[idx].vert0);
+      springs.vert1.push_back(list[idx].vert1);
+      springs.rest.push_back(list[idx].rest);
+      springs.coeff.push_back(list[idx].coeff);
+    }
+  }
+  springs.batches.push_back((int)springs.vert0.size());
+}
+
+// Evaluates springs in [start, end) one at a time. With `project`, springs are
+// solved as position constraints, otherwise spring forces are accumulated.
+// Projection also updates the residual, i.e. the maximum relative stretch of
+// the springs before they were projected. With `stretch_only`, compressed
+// springs are skipped.
+template <bool project, bool stretch_only>
+static void solve_springs_scalar(particle_shape* shape,
+    const particle_springs& springs, int start, int end, float& residual) {
+  for (auto s = start; s < end; s++) {
+    auto v0 = springs.vert0[s], v1 = springs.vert1[s];
+    auto w0 = shape->invmass[v0], w1 = shape->invmass[v1];
+    auto invmass = w0 + w1;
+    if (!invmass) continue;
+    auto delta   = shape->positions[v1] - shape->positions[v0];
+    auto length2 = dot(delta, delta);
+    if (!length2) continue;
+    auto invlen = 1 / std::sqrt(length2);
+    auto len    = length2 * invlen;
+    auto dir    = delta * invlen;
+    auto rest = springs.rest[s], coeff = springs.coeff[s];
+    if constexpr (stretch_only) {
+      if (len <= rest) continue;
+    }
+    if constexpr (project) {
+      if (rest > 0) residual = max(residual, std::abs(len - rest) / rest);
+      auto lambda = (1 - coeff) * (len - rest) / invmass;
+      shape->positions[v0] += w0 * lambda * dir;
+      shape->positions[v1] -= w1 * lambda * dir;
+    } else {
+      // we take invcoeff in [0,1]
+      auto force     = dir * (len / rest - 1) / (coeff * invmass);
+      auto delta_vel = shape->velocities[v1] - shape->velocities[v0];
+      force += dot(delta_vel / rest, dir) * dir / (coeff * 1000 * invmass);
+      shape->forces[v0] += force;
+      shape->forces[v1] -= force;
+    }
+  }
+}
+
+#if defined(YOCTO_PARTICLE_AVX2)
+
+// Evaluates springs in [start, end) eight at a time, as solve_springs_scalar.
+// Returns the first spring that was not evaluated. Built with AVX2 enabled in
+// yocto_particle_avx2.cpp, and called only if the cpu supports it.
+template <bool project, bool stretch_only>
+int solve_springs_avx2(float* positions, float* forces,
+    const float* velocities, const float* invmass, const int* vert0,
+    const int* vert1, const float* rest, const float* coeff, int start,
+    int end, float& residual);
+
+// Whether the cpu and the os support AVX2 and FMA
+static bool supports_avx2() {
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) return false;
+  __cpuid(info, 1);
+  auto fma = (info[2] >> 12) & 1, osxsave = (info[2] >> 27) & 1,
+       avx = (info[2] >> 28) & 1;
+  if (!fma || !osxsave || !avx) return false;
+  if ((_xgetbv(0) & 6) != 6) return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] >> 5) & 1;
+#else
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+}
+
+#endif
+
+// Evaluates all springs batch by batch, using SIMD kernels when built, enabled
+// with `simd` and supported by the cpu. Mass-spring forces and position-based distance
+// constraints share the same kernels, selected with `project`. Returns the
+// constraint residual.
+template <bool project, bool stretch_only = false>
+static float solve_springs(
+    particle_shape* shape, const particle_springs& springs, bool simd) {
+  auto& batches  = springs.batches;
+  auto  residual = 0.0f;
+#if defined(YOCTO_PARTICLE_AVX2)
+  static const auto avx2 = supports_avx2();
+#endif
+  for (auto batch = 0; batch + 1 < (int)batches.size(); batch++) {
+    auto start = batches[batch], end = batches[batch + 1];
+#if defined(YOCTO_PARTICLE_AVX2)
+    if (simd && avx2)
+      start = solve_springs_avx2<project, stretch_only>(
+          (float*)shape->positions.data(), (float*)shape->forces.data(),
+          (const float*)shape->velocities.data(), shape->invmass.data(),
+          springs.vert0.data(), springs.vert1.data(), springs.rest.data(),
+          springs.coeff.data(), start, end, residual);
+#endif
+    solve_springs_scalar<project, stretch_only>(
+        shape, springs, start, end, residual);
+  }
+  return residual;
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR EMITTERS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Whether the shape has a particle pool
+static bool has_emitter(const particle_shape* shape) {
+  return shape->emit_sites > 0;
+}
+
+// Frees a slot of the pool
+static void kill_particle(particle_shape* shape, int slot) {
+  shape->ages[slot]       = -1;
+  shape->invmass[slot]    = 0;
+  shape->radius[slot]     = 0;
+  shape->velocities[slot] = {0, 0, 0};
+  shape->free_particles.push_back(slot);
+}
+
+// Ages particles, frees the expired ones and spawns new ones at random sites.
+// Slots come from the free list, so neither changes the size of the arrays.
+static void update_emitter(particle_shape* shape, float dt) {
+  if (shape->emit_lifetime > 0) {
+    for (auto slot = 0; slot < (int)shape->ages.size(); slot++) {
+      if (shape->ages[slot] < 0) continue;
+      shape->ages[slot] += dt;
+      if (shape->ages[slot] > shape->emit_lifetime) kill_particle(shape, slot);
+    }
+  }
+  shape->emit_pending += shape->emit_rate * dt;
+  auto& rng = shape->emit_rng;
+  while (shape->emit_pending >= 1 && !shape->free_particles.empty()) {
+    shape->emit_pending -= 1;
+    auto slot = shape->free_particles.back();
+    auto site = rand1i(rng, shape->emit_sites);
+    shape->free_particles.pop_back();
+    shape->ages[slot]       = 0;
+    shape->positions[slot]  = shape->initial_positions[site];
+    shape->invmass[slot]    = shape->initial_invmass[site];
+    shape->radius[slot]     = shape->initial_radius[site];
+    shape->velocities[slot] = shape->emit_velocity +
+                              sample_sphere(rand2f(rng)) *
+                                  shape->emit_rngscale * rand1f(rng);
+  }
+  // drop emission that does not fit in the pool
+  if (shape->free_particles.empty()) shape->emit_pending = 0;
+}
+
+// Packs live particles at the front of the pool, moving the last live ones
+// into the first free slots, and rebuilds the free list.
+static void compact_emitter(particle_shape* shape) {
+  auto& ages = shape->ages;
+  auto  last = (int)ages.size() - 1;
+  for (auto slot = 0; slot < last; slot++) {
+    if (ages[slot] >= 0) continue;
+    while (last > slot && ages[last] < 0) last--;
+    if (last <= slot) break;
+    ages[slot]              = ages[last];
+    shape->positions[slot]  = shape->positions[last];
+    shape->normals[slot]    = shape->normals[last];
+    shape->velocities[slot] = shape->velocities[last];
+    shape->invmass[slot]    = shape->invmass[last];
+    shape->radius[slot]     = shape->radius[last];
+    shape->positions[last]  = shape->initial_positions[0];
+    ages[last]              = -1;
+    shape->invmass[last]    = 0;
+    shape->radius[last]     = 0;
+    shape->velocities[last] = {0, 0, 0};
+    last--;
+  }
+  shape->free_particles.clear();
+  for (auto slot = (int)ages.size() - 1; slot >= 0; slot--)
+    if (ages[slot] < 0) shape->free_particles.push_back(slot);
+}
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR FLUIDS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Hash of the grid cell, of size the kernel radius, in a table of size
+// power of two
+static inline int fluid_hash(int i, int j, int k, int table) {
+  return (int)(((uint32_t)i * 73856093u) ^ ((uint32_t)j * 19349663u) ^
+               ((uint32_t)k * 83492791u)) &
+         (table - 1);
+}
+static inline vec3i fluid_cell(float x, float y, float z, float radius) {
+  return {(int)std::floor(x / radius), (int)std::floor(y / radius),
+      (int)std::floor(z / radius)};
+}
+
+// Smoothing kernels: poly6 for density and spiky gradient, whose value is the
+// factor of the distance vector. Their constants only depend on the kernel
+// radius, so they are computed once per pass, and their support is clamped
+// with max instead of branches, so that the neighbor loops vectorize.
+struct fluid_kernel {
+  float h     = 0;  // kernel radius
+  float h2    = 0;  // squared radius
+  float poly6 = 0;  // poly6 normalization
+  float spiky = 0;  // spiky gradient normalization
+};
+static inline fluid_kernel make_fluid_kernel(float h) {
+  auto h3 = h * h * h;
+  return {h, h * h, 315 / (64 * pif * h3 * h3 * h3), -45 / (pif * h3 * h3)};
+}
+static inline float fluid_poly6(float r2, const fluid_kernel& kernel) {
+  auto d = max(kernel.h2 - r2, 0.0f);
+  return kernel.poly6 * d * d * d;
+}
+static inline float fluid_spiky(float r2, const fluid_kernel& kernel) {
+  auto r = std::sqrt(r2);
+  auto d = max(kernel.h - r, 0.0f);
+  return r > 0 ? kernel.spiky * d * d / r : 0.0f;
+}
+
+// Init fluid workspaces. The kernel radius spans two particle diameters and
+// the rest density is the one of particles on a cubic lattice of spacing one
+// diameter.
+static void init_fluid(particle_shape* shape) {
+  auto& fluid = shape->fluid;
+  auto  count = (int)shape->positions.size();
+  auto  size  = 0.0f;
+  for (auto radius : shape->initial_radius) size = max(size, radius);
+  if (size <= 0) size = 0.01f;
+  fluid.radius  = 4 * size;
+  fluid.density = 0;
+  auto kernel   = make_fluid_kernel(fluid.radius);
+  for (auto k = -2; k <= 2; k++)
+    for (auto j = -2; j <= 2; j++)
+      for (auto i = -2; i <= 2; i++)
+        fluid.density += fluid_poly6(
+            (i * i + j * j + k * k) * 4 * size * size, kernel);
+  auto table = 1;
+  while (table < 2 * count) table *= 2;
+  fluid.active = 0;
+  fluid.keys.assign(count, 0);
+  fluid.order.assign(count, 0);
+  fluid.buckets.assign(table + 2, 0);
+  fluid.neighbors.assign((size_t)count * fluid.max_neighbors, 0);
+  fluid.counts.assign(count, 0);
+  fluid.lambdas.assign(count, 0);
+  resize_soa(fluid.positions, count);
+  resize_soa(fluid.velocities, count);
+  resize_soa(fluid.deltas, count);
+  // one collision slot per particle, filled in parallel
+  shape->collisions.assign(count, {-1, {0, 0, 0}, {0, 0, 0}});
+}
+
+// Sorts particles with mass by cell with a counting sort over the hash table,
+// copies their positions in sorted order and builds the neighbor lists.
+// Neighbors past max_neighbors are ignored, and counted in the shape timings.
+static void sort_fluid(particle_shape* shape) {
+  auto& fluid   = shape->fluid;
+  auto  count   = (int)shape->positions.size();
+  auto  table   = (int)fluid.buckets.size() - 2;
+  auto  h       = fluid.radius;
+  auto& buckets = fluid.buckets;
+
+  // cell keys in parallel, particles without mass go in the last bucket
+  parallel_blocks(count, [&](int start, int end) {
+    for (auto i = start; i < end; i++) {
+      auto& p       = shape->positions[i];
+      auto  cell    = fluid_cell(p.x, p.y, p.z, h);
+      fluid.keys[i] = shape->invmass[i]
+                          ? fluid_hash(cell.x, cell.y, cell.z, table)
+                          : table;
+    }
+  });
+
+  // counting sort
+  std::fill(buckets.begin(), buckets.end(), 0);
+  for (auto i = 0; i < count; i++) buckets[fluid.keys[i] + 1]++;
+  for (auto key = 0; key <= table; key++) buckets[key + 1] += buckets[key];
+  for (auto i = 0; i < count; i++) fluid.order[buckets[fluid.keys[i]]++] = i;
+  for (auto key = table; key > 0; key--) buckets[key] = buckets[key - 1];
+  buckets[0]   = 0;
+  fluid.active = buckets[table];
+
+  // sorted positions
+  auto& positions = fluid.positions;
+  parallel_blocks(fluid.active, [&](int start, int end) {
+    for (auto s = start; s < end; s++) {
+      auto& p        = shape->positions[fluid.order[s]];
+      positions.x[s] = p.x;
+      positions.y[s] = p.y;
+      positions.z[s] = p.z;
+    }
+  });
+
+  // neighbor lists, skipping cells that hash to buckets already visited
+  auto dropped = std::atomic<int>{0};
+  parallel_blocks(fluid.active, [&](int start, int end) {
+    auto block_dropped = 0;
+    for (auto s = start; s < end; s++) {
+      auto px = positions.x[s], py = positions.y[s], pz = positions.z[s];
+      auto cell      = fluid_cell(px, py, pz, h);
+      auto neighbors = fluid.neighbors.data() + (size_t)s * fluid.max_neighbors;
+      auto found     = 0;
+      int  visited[27];
+      auto nvisited = 0;
+      for (auto k = -1; k <= 1; k++) {
+        for (auto j = -1; j <= 1; j++) {
+          for (auto i = -1; i <= 1; i++) {
+            auto key = fluid_hash(cell.x + i, cell.y + j, cell.z + k, table);
+            if (std::find(visited, visited + nvisited, key) !=
+                visited + nvisited)
+              continue;
+            visited[nvisited++] = key;
+            for (auto t = buckets[key]; t < buckets[key + 1]; t++) {
+              auto dx = px - positions.x[t], dy = py - positions.y[t],
+                   dz = pz - positions.z[t];
+              auto r2 = dx * dx + dy * dy + dz * dz;
+              if (t == s || r2 >= h * h) continue;
+              if (found < fluid.max_neighbors) {
+                neighbors[found++] = t;
+              } else {
+                block_dropped += 1;
+              }
+            }
+          }
+        }
+      }
+      fluid.counts[s] = found;
+    }
+    if (block_dropped) dropped += block_dropped;
+  });
+  shape->timings.dropped += dropped.load();
+}
+
+// Computes the density constraint multipliers. The constraint is one sided,
+// so particles at the free surface are not pulled together, and relaxed by a
+// term of the scale of the gradients.
+static void solve_fluid_lambdas(particle_shape* shape) {
+  auto& fluid     = shape->fluid;
+  auto& positions = fluid.positions;
+  auto  kernel    = make_fluid_kernel(fluid.radius);
+  auto  rest      = fluid.density;
+  auto  self      = fluid_poly6(0, kernel);
+  parallel_blocks(fluid.active, [&](int start, int end) {
+    for (auto s = start; s < end; s++) {
+      auto neighbors = fluid.neighbors.data() + (size_t)s * fluid.max_neighbors;
+      auto px = positions.x[s], py = positions.y[s], pz = positions.z[s];
+      auto density = self;
+      auto gx = 0.0f, gy = 0.0f, gz = 0.0f, sum2 = 0.0f;
+      for (auto n = 0; n < fluid.counts[s]; n++) {
+        auto t  = neighbors[n];
+        auto dx = px - positions.x[t], dy = py - positions.y[t],
+             dz = pz - positions.z[t];
+        auto r2 = dx * dx + dy * dy + dz * dz;
+        auto w  = fluid_spiky(r2, kernel) / rest;
+        density += fluid_poly6(r2, kernel);
+        gx += w * dx;
+        gy += w * dy;
+        gz += w * dz;
+        sum2 += w * w * r2;
+      }
+      auto constraint  = max(density / rest - 1, 0.0f);
+      auto gradients   = sum2 + gx * gx + gy * gy + gz * gz;
+      fluid.lambdas[s] = -constraint / (gradients + 0.01f / kernel.h2);
+    }
+  });
+}
+
+// Computes position corrections from the multipliers, with the artificial
+// pressure term that prevents clustering, then applies them together. The
+// pressure term is scaled by the kernel area to match the multipliers.
+static void solve_fluid_deltas(particle_shape* shape) {
+  auto& fluid     = shape->fluid;
+  auto& positions = fluid.positions;
+  auto& deltas    = fluid.deltas;
+  auto  kernel    = make_fluid_kernel(fluid.radius);
+  auto  rest      = fluid.density;
+  auto  wq        = fluid_poly6(0.04f * kernel.h2, kernel);
+  parallel_blocks(fluid.active, [&](int start, int end) {
+    for (auto s = start; s < end; s++) {
+      auto neighbors = fluid.neighbors.data() + (size_t)s * fluid.max_neighbors;
+      auto px = positions.x[s], py = positions.y[s], pz = positions.z[s];
+      auto lambda = fluid.lambdas[s];
+      auto ddx = 0.0f, ddy = 0.0f, ddz = 0.0f;
+      for (auto n = 0; n < fluid.counts[s]; n++) {
+        auto t  = neighbors[n];
+        auto dx = px - positions.x[t], dy = py - positions.y[t],
+             dz = pz - positions.z[t];
+        auto r2    = dx * dx + dy * dy + dz * dz;
+        auto ratio = fluid_poly6(r2, kernel) / wq;
+        auto corr  = -0.1f * kernel.h2 * ratio * ratio * ratio * ratio;
+        auto w     = (lambda + fluid.lambdas[t] + corr) *
+                 fluid_spiky(r2, kernel) / rest;
+        ddx += w * dx;
+        ddy += w * dy;
+        ddz += w * dz;
+      }
+      deltas.x[s] = ddx;
+      deltas.y[s] = ddy;
+      deltas.z[s] = ddz;
+    }
+  });
+  parallel_blocks(fluid.active, [&](int start, int end) {
+    for (auto s = start; s < end; s++) {
+      positions.x[s] += deltas.x[s];
+      positions.y[s] += deltas.y[s];
+      positions.z[s] += deltas.z[s];
+    }
+  });
+}
+
+// Moves sorted particles out of the colliders they hit this step
+static void solve_fluid_collisions(particle_shape* shape) {
+  auto& fluid     = shape->fluid;
+  auto& positions = fluid.positions;
+  parallel_blocks(fluid.active, [&](int start, int end) {
+    for (auto s = start; s < end; s++) {
+      auto& collision = shape->collisions[fluid.order[s]];
+      if (collision.vert < 0) continue;
+      auto position   = vec3f{positions.x[s], positions.y[s], positions.z[s]};
+      auto projection = dot(position - collision.position, collision.normal);
+      if (projection >= 0) continue;
+      position -= projection * collision.normal;
+      positions.x[s] = position.x;
+      positions.y[s] = position.y;
+      positions.z[s] = position.z;
+    }
+  });
+}
+
+// Smooths sorted velocities with xsph viscosity and writes them back
+static void apply_fluid_viscosity(particle_shape* shape, float viscosity) {
+  auto& fluid      = shape->fluid;
+  auto& positions  = fluid.positions;
+  auto& velocities = fluid.velocities;
+  auto  kernel     = make_fluid_kernel(fluid.radius);
+  auto  rest       = fluid.density;
+  parallel_blocks(fluid.active, [&](int start, int end) {
+    for (auto s = start; s < end; s++) {
+      auto& v         = shape->velocities[fluid.order[s]];
+      velocities.x[s] = v.x;
+      velocities.y[s] = v.y;
+      velocities.z[s] = v.z;
+    }
+  });
+  parallel_blocks(fluid.active, [&](int start, int end) {
+    for (auto s = start; s < end; s++) {
+      auto neighbors = fluid.neighbors.data() + (size_t)s * fluid.max_neighbors;
+      auto px = positions.x[s], py = positions.y[s], pz = positions.z[s];
+      auto vx = velocities.x[s], vy = velocities.y[s], vz = velocities.z[s];
+      auto sx = 0.0f, sy = 0.0f, sz = 0.0f;
+      for (auto n = 0; n < fluid.counts[s]; n++) {
+        auto t  = neighbors[n];
+        auto dx = px - positions.x[t], dy = py - positions.y[t],
+             dz = pz - positions.z[t];
+        auto w = fluid_poly6(dx * dx + dy * dy + dz * dz, kernel) / rest;
+        sx += w * (velocities.x[t] - vx);
+        sy += w * (velocities.y[t] - vy);
+        sz += w * (velocities.z[t] - vz);
+      }
+      shape->velocities[fluid.order[s]] = {
+          vx + viscosity * sx, vy + viscosity * sy, vz + viscosity * sz};
+    }
+  });
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR SHAPE MATCHING
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Rotates v by the unit quaternion q, stored as (x, y, z, w)
+static inline vec3f rotate_quat(const vec4f& q, const vec3f& v) {
+  auto u = vec3f{q.x, q.y, q.z};
+  auto t = 2 * cross(u, v);
+  return v + q.w * t + cross(u, t);
+}
+
+// Rotational part of the matrix of columns a, by the iterative method of
+// Muller et al. "A Robust Method to Extract the Rotational Part of
+// Deformations", warm started from the previous rotation q. Unlike the polar
+// decomposition from the eigenvectors, it is stable for flat clusters.
+static vec4f extract_rotation(const vec3f a[3], vec4f q, int iterations) {
+  for (auto iteration = 0; iteration < iterations; iteration++) {
+    auto r0 = rotate_quat(q, {1, 0, 0}), r1 = rotate_quat(q, {0, 1, 0}),
+         r2 = rotate_quat(q, {0, 0, 1});
+    auto omega = (cross(r0, a[0]) + cross(r1, a[1]) + cross(r2, a[2])) /
+                 (std::abs(dot(r0, a[0]) + dot(r1, a[1]) + dot(r2, a[2])) +
+                     1e-9f);
+    auto angle = length(omega);
+    if (angle < 1e-9f) break;
+    auto axis = omega * (std::sin(angle / 2) / angle);
+    auto w    = std::cos(angle / 2);
+    q         = {w * q.x + q.w * axis.x + axis.y * q.z - axis.z * q.y,
+        w * q.y + q.w * axis.y + axis.z * q.x - axis.x * q.z,
+        w * q.z + q.w * axis.z + axis.x * q.y - axis.y * q.x,
+        w * q.w - axis.x * q.x - axis.y * q.y - axis.z * q.z};
+    auto norm = std::sqrt(q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w);
+    q         = {q.x / norm, q.y / norm, q.z / norm, q.w / norm};
+  }
+  return q;
+}
+
+// Groups particles in overlapping clusters. Clusters are anchored at the
+// cells of a grid of size cluster_size and hold the particles of the 2x2x2
+// cells from their anchor, so each particle is in up to 8 clusters.
+static void make_clusters(particle_shape* shape) {
+  auto& clusters  = shape->clusters;
+  auto& positions = shape->positions;
+  auto  nverts    = (int)positions.size();
+  auto  members   = vector<vector<int>>{};
+  if (shape->cluster_size <= 0) {
+    auto& cluster = members.emplace_back();
+    for (auto vert = 0; vert < nverts; vert++) cluster.push_back(vert);
+  } else {
+    auto anchors = std::unordered_map<int64_t, int>{};
+    for (auto vert = 0; vert < nverts; vert++) {
+      auto cell = positions[vert] / shape->cluster_size;
+      auto x    = (int64_t)std::floor(cell.x),
+           y = (int64_t)std::floor(cell.y), z = (int64_t)std::floor(cell.z);
+      for (auto corner = 0; corner < 8; corner++) {
+        auto key = (((x - (corner & 1)) & 0x1fffff) << 42) |
+                   (((y - ((corner >> 1) & 1)) & 0x1fffff) << 21) |
+                   ((z - ((corner >> 2) & 1)) & 0x1fffff);
+        auto [it, inserted] = anchors.insert({key, (int)members.size()});
+        if (inserted) members.emplace_back();
+        members[it->second].push_back(vert);
+      }
+    }
+  }
+
+  // clusters of one particle do not constrain it
+  clusters = {};
+  clusters.start.push_back(0);
+  for (auto& cluster : members) {
+    if (cluster.size() < 2) continue;
+    auto center = zero3f;
+    for (auto vert : cluster) center += positions[vert];
+    center /= (float)cluster.size();
+    for (auto vert : cluster) {
+      clusters.verts.push_back(vert);
+      clusters.offsets.push_back(positions[vert] - center);
+      clusters.owners.push_back((int)clusters.stiffness.size());
+    }
+    clusters.start.push_back((int)clusters.verts.size());
+    if ((int)shape->stiffness.size() != nverts) {
+      clusters.stiffness.push_back(shape->cluster_stiffness);
+    } else {
+      auto stiffness = 0.0f;
+      for (auto vert : cluster) stiffness += shape->stiffness[vert];
+      clusters.stiffness.push_back(stiffness / (float)cluster.size());
+    }
+    clusters.rotations.push_back({0, 0, 0, 1});
+    clusters.centers.push_back(center);
+  }
+
+  // entries of each vertex
+  clusters.vstart.assign(nverts + 1, 0);
+  for (auto vert : clusters.verts) clusters.vstart[vert + 1]++;
+  for (auto vert = 0; vert < nverts; vert++)
+    clusters.vstart[vert + 1] += clusters.vstart[vert];
+  clusters.ventries.assign(clusters.verts.size(), 0);
+  auto next = vector<int>(clusters.vstart.begin(), clusters.vstart.end() - 1);
+  for (auto entry = 0; entry < (int)clusters.verts.size(); entry++)
+    clusters.ventries[next[clusters.verts[entry]]++] = entry;
+}
+
+// Matches each cluster to its rest shape, in parallel over clusters, then
+// moves each particle toward the average of its goal positions, weighted by
+// the cluster stiffness. Pinned particles do not move.
+static void solve_clusters(particle_shape* shape) {
+  auto& clusters  = shape->clusters;
+  auto& positions = shape->positions;
+  auto  nclusters = (int)clusters.stiffness.size();
+  parallel_blocks(
+      nclusters,
+      [&](int start, int end) {
+        for (auto cluster = start; cluster < end; cluster++) {
+          auto first = clusters.start[cluster],
+               last  = clusters.start[cluster + 1];
+          auto center = zero3f;
+          for (auto entry = first; entry < last; entry++)
+            center += positions[clusters.verts[entry]];
+          center /= (float)(last - first);
+          vec3f covariance[3] = {zero3f, zero3f, zero3f};
+          for (auto entry = first; entry < last; entry++) {
+            auto  position = positions[clusters.verts[entry]] - center;
+            auto& offset   = clusters.offsets[entry];
+            covariance[0] += position * offset.x;
+            covariance[1] += position * offset.y;
+            covariance[2] += position * offset.z;
+          }
+          clusters.centers[cluster]   = center;
+          clusters.rotations[cluster] = extract_rotation(
+              covariance, clusters.rotations[cluster], 4);
+        }
+      },
+      64);
+  parallel_blocks((int)positions.size(), [&](int start, int end) {
+    for (auto vert = start; vert < end; vert++) {
+      auto first = clusters.vstart[vert], last = clusters.vstart[vert + 1];
+      if (!shape->invmass[vert] || first == last) continue;
+      auto delta = zero3f;
+      for (auto item = first; item < last; item++) {
+        auto entry   = clusters.ventries[item];
+        auto cluster = clusters.owners[entry];
+        auto goal    = clusters.centers[cluster] +
+                    rotate_quat(clusters.rotations[cluster],
+                        clusters.offsets[entry]);
+        delta += clusters.stiffness[cluster] * (goal - positions[vert]);
+      }
+      positions[vert] += delta / (float)(last - first);
+    }
+  });
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR STRANDS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Chains lines into strands from their roots. Each vertex is followed by at
+// most one other, as in the polylines of make_hair.
+static void make_strands(particle_shape* shape) {
+  auto& strands   = shape->strands;
+  auto& positions = shape->positions;
+  auto  nverts    = (int)positions.size();
+  auto  next      = vector<int>(nverts, -1);
+  auto  ends      = vector<bool>(nverts, false);
+  for (auto& line : shape->lines) {
+    next[line.x] = line.y;
+    ends[line.y] = true;
+  }
+  strands = {};
+  strands.start.push_back(0);
+  for (auto root = 0; root < nverts; root++) {
+    if (ends[root] || next[root] < 0) continue;
+    // the length check stops on malformed lines with cycles
+    auto& verts = strands.verts;
+    auto  first = (int)verts.size();
+    auto  vert  = root;
+    while (vert >= 0 && (int)verts.size() - first < nverts) {
+      auto entry = (int)verts.size();
+      auto prev1 = entry - first >= 1 ? verts[entry - 1] : vert;
+      auto prev2 = entry - first >= 2 ? verts[entry - 2] : vert;
+      strands.lengths.push_back(distance(positions[vert], positions[prev1]));
+      strands.bends.push_back(distance(positions[vert], positions[prev2]));
+      verts.push_back(vert);
+      vert = next[vert];
+    }
+    strands.start.push_back((int)strands.verts.size());
+  }
+  strands.corrections.assign(strands.verts.size(), {0, 0, 0});
+}
+
+// Sets the samples farther than the band, marked by flt_max, to the band
+// distance, negative if they are enclosed by the surface. Far samples on the
+// grid boundary or next to positive ones are outside, and the fill from them
+// stops at the negative samples behind the surface.
+static void flood_sdf(particle_collider* collider, float band) {
+  auto& size      = collider->sdf_size;
+  auto& distances = collider->sdf_distances;
+  auto& stack     = collider->sdf_stack;
+  auto  strides   = vec3i{1, size.x, size.x * size.y};
+  auto  is_near   = [](float dist) { return dist >= 0 && dist < flt_max; };
+  stack.clear();
+  for (auto cell = 0; cell < (int)distances.size(); cell++) {
+    if (distances[cell] != flt_max) continue;
+    auto ijk = vec3i{cell % size.x, (cell / size.x) % size.y,
+        cell / (size.x * size.y)};
+    auto outside = false;
+    for (auto axis = 0; axis < 3 && !outside; axis++) {
+      outside = ijk[axis] == 0 || ijk[axis] == size[axis] - 1 ||
+                is_near(distances[cell - strides[axis]]) ||
+                is_near(distances[cell + strides[axis]]);
+    }
+    if (!outside) continue;
+    distances[cell] = band;
+    stack.push_back(cell);
+  }
+  while (!stack.empty()) {
+    auto cell = stack.back();
+    stack.pop_back();
+    auto ijk = vec3i{cell % size.x, (cell / size.x) % size.y,
+        cell / (size.x * size.y)};
+    for (auto axis = 0; axis < 3; axis++) {
+      for (auto dir : {-1, 1}) {
+        if (ijk[axis] + dir < 0 || ijk[axis] + dir >= size[axis]) continue;
+        auto next = cell + dir * strides[axis];
+        if (distances[next] != flt_max) continue;
+        distances[next] = band;
+        stack.push_back(next);
+      }
+    }
+  }
+  for (auto& dist : distances) {
+    if (dist == flt_max) dist = -band;
+  }
+}
+
+// Samples the signed distances of the cells in [start, end), from the
+// closest points found with the bvh closer than the band. Farther samples
+// are marked by flt_max.
+static void sample_sdf(
+    particle_collider* collider, const vec3i& start, const vec3i& end) {
+  auto band = 4 * collider->sdf_cell;
+  parallel_range(end.z - start.z, [collider, &start, &end, band](int slice) {
+    auto& size = collider->sdf_size;
+    auto  k    = start.z + slice;
+    for (auto j = start.y; j < end.y; j++) {
+      for (auto i = start.x; i < end.x; i++) {
+        auto  cell     = vec3f{(float)i, (float)j, (float)k};
+        auto  position = collider->sdf_origin + cell * collider->sdf_cell;
+        auto  index    = ((size_t)k * size.y + j) * size.x + i;
+        auto& sample   = collider->sdf_distances[index];
+        auto  closest = zero3f, normal = zero3f;
+        sample = flt_max;
+        if (!collider->quads.empty()) {
+          auto isec = overlap_quads_bvh(collider->bvh, collider->quads,
+              collider->positions, collider->radius, position, band);
+          if (!isec.hit) continue;
+          auto q  = collider->quads[isec.element];
+          closest = interpolate_quad(collider->positions[q.x],
+              collider->positions[q.y], collider->positions[q.z],
+              collider->positions[q.w], isec.uv);
+          normal  = interpolate_quad(collider->normals[q.x],
+              collider->normals[q.y], collider->normals[q.z],
+              collider->normals[q.w], isec.uv);
+        } else if (!collider->triangles.empty()) {
+          auto isec = overlap_triangles_bvh(collider->bvh, collider->triangles,
+              collider->positions, collider->radius, position, band);
+          if (!isec.hit) continue;
+          auto t  = collider->triangles[isec.element];
+          closest = interpolate_triangle(collider->positions[t.x],
+              collider->positions[t.y], collider->positions[t.z], isec.uv);
+          normal  = interpolate_triangle(collider->normals[t.x],
+              collider->normals[t.y], collider->normals[t.z], isec.uv);
+        } else {
+          continue;
+        }
+        auto dist = distance(position, closest);
+        if (dist >= band) continue;
+        sample = dot(position - closest, normal) < 0 ? -dist : dist;
+      }
+    }
+  });
+}
+
+// Samples the collider signed distances on a grid, within a band of a few
+// cells from the surface. Farther samples are set to the band distance,
+// negative inside the surface.
+static void make_sdf(particle_collider* collider, int resolution) {
+  collider->sdf_distances.clear();
+  collider->sdf_size = {0, 0, 0};
+  if (collider->positions.empty() || resolution <= 0) return;
+  auto bounds = invalidb3f;
+  for (auto& position : collider->positions) bounds = merge(bounds, position);
+  auto extent = bounds.max - bounds.min;
+  auto cell   = max(extent) / resolution;
+  if (cell <= 0) return;
+  auto band            = 4 * cell;
+  collider->sdf_cell   = cell;
+  collider->sdf_origin = bounds.min - band;
+  collider->sdf_size   = {(int)std::ceil((extent.x + 2 * band) / cell) + 1,
+      (int)std::ceil((extent.y + 2 * band) / cell) + 1,
+      (int)std::ceil((extent.z + 2 * band) / cell) + 1};
+  auto& size = collider->sdf_size;
+  collider->sdf_distances.assign((size_t)size.x * size.y * size.z, flt_max);
+  sample_sdf(collider, {0, 0, 0}, size);
+  flood_sdf(collider, band);
+}
+
+// Trilinear sample of the collider signed distance, false outside the grid
+static bool eval_sdf(
+    const particle_collider* collider, const vec3f& position, float& dist) {
+  auto& size = collider->sdf_size;
+  auto  uvw  = (position - collider->sdf_origin) / collider->sdf_cell;
+  if (uvw.x < 0 || uvw.y < 0 || uvw.z < 0 || uvw.x >= size.x - 1 ||
+      uvw.y >= size.y - 1 || uvw.z >= size.z - 1)
+    return false;
+  auto i = (int)uvw.x, j = (int)uvw.y, k = (int)uvw.z;
+  auto u = uvw.x - i, v = uvw.y - j, w = uvw.z - k;
+  auto sample = [collider, &size](int i, int j, int k) {
+    return collider->sdf_distances[((size_t)k * size.y + j) * size.x + i];
+  };
+  auto d00 = sample(i, j, k) * (1 - u) + sample(i + 1, j, k) * u;
+  auto d10 = sample(i, j + 1, k) * (1 - u) + sample(i + 1, j + 1, k) * u;
+  auto d01 = sample(i, j, k + 1) * (1 - u) + sample(i + 1, j, k + 1) * u;
+  auto d11 = sample(i, j + 1, k + 1) * (1 - u) +
+             sample(i + 1, j + 1, k + 1) * u;
+  dist = (d00 * (1 - v) + d10 * v) * (1 - w) + (d01 * (1 - v) + d11 * v) * w;
+  return true;
+}
+
+// Whether a point is in the bounds inflated by margin
+static inline bool inside_bounds(
+    const bbox3f& bounds, const vec3f& position, float margin) {
+  return position.x >= bounds.min.x - margin &&
+         position.x <= bounds.max.x + margin &&
+         position.y >= bounds.min.y - margin &&
+         position.y <= bounds.max.y + margin &&
+         position.z >= bounds.min.z - margin &&
+         position.z <= bounds.max.z + margin;
+}
+
+// Updates the signed distances of a deformed collider, sampling again only
+// the cells within the band of the elements whose positions or normals
+// changed. The grid is made again when the collider grows out of it.
+static void update_sdf(particle_collider* collider,
+    const vector<vec3f>& old_positions, const vector<vec3f>& old_normals,
+    int resolution) {
+  auto& positions = collider->positions;
+  auto& normals   = collider->normals;
+  auto& size      = collider->sdf_size;
+  auto  cell      = collider->sdf_cell;
+  auto  band      = 4 * cell;
+  auto  bounds    = invalidb3f;
+  for (auto& position : positions) bounds = merge(bounds, position);
+  auto grid = bbox3f{collider->sdf_origin,
+      collider->sdf_origin + vec3f{(float)size.x - 1, (float)size.y - 1,
+                                 (float)size.z - 1} *
+                                 cell};
+  if (collider->sdf_distances.empty() ||
+      old_positions.size() != positions.size() ||
+      old_normals.size() != normals.size() ||
+      !inside_bounds(grid, bounds.min, -band) ||
+      !inside_bounds(grid, bounds.max, -band))
+    return make_sdf(collider, resolution);
+
+  // bounds of the moved elements, before and after moving
+  auto moved = invalidb3f;
+  auto merge_moved = [&](const auto& element) {
+    auto changed = false;
+    for (auto vert : element) {
+      changed = changed || positions[vert] != old_positions[vert] ||
+                normals[vert] != old_normals[vert];
+    }
+    if (!changed) return;
+    for (auto vert : element) {
+      moved = merge(moved, positions[vert]);
+      moved = merge(moved, old_positions[vert]);
+    }
+  };
+  for (auto& quad : collider->quads)
+    merge_moved(std::array<int, 4>{quad.x, quad.y, quad.z, quad.w});
+  for (auto& triangle : collider->triangles)
+    merge_moved(std::array<int, 3>{triangle.x, triangle.y, triangle.z});
+  if (moved.min.x > moved.max.x) return;
+
+  // far samples are signed again after the near ones are updated
+  auto start = vec3i{0, 0, 0}, end = vec3i{0, 0, 0};
+  for (auto axis = 0; axis < 3; axis++) {
+    auto min = (moved.min[axis] - band - collider->sdf_origin[axis]) / cell;
+    auto max = (moved.max[axis] + band - collider->sdf_origin[axis]) / cell;
+    start[axis] = clamp((int)std::floor(min), 0, size[axis]);
+    end[axis]   = clamp((int)std::ceil(max) + 1, 0, size[axis]);
+  }
+  for (auto& dist : collider->sdf_distances) {
+    if (std::abs(dist) >= band) dist = flt_max;
+  }
+  sample_sdf(collider, start, end);
+  flood_sdf(collider, band);
+}
+
+// Pushes a particle out of the colliders along the distance gradient, taken
+// with central differences in the collider local space
+static void collide_sdf(const particle_scene* scene, vec3f& position,
+    float radius) {
+  for (auto collider : scene->colliders) {
+    if (collider->sdf_distances.empty()) continue;
+    if (!inside_bounds(collider->bounds, position, radius)) continue;
+    auto local = transform_point(collider->inverse, position);
+    auto dist  = 0.0f;
+    if (!eval_sdf(collider, local, dist) || dist >= radius) continue;
+    auto h        = collider->sdf_cell / 2;
+    auto gradient = zero3f;
+    for (auto axis = 0; axis < 3; axis++) {
+      auto offset = zero3f;
+      auto d0 = dist, d1 = dist;
+      offset[axis] = h;
+      eval_sdf(collider, local - offset, d0);
+      eval_sdf(collider, local + offset, d1);
+      gradient[axis] = d1 - d0;
+    }
+    if (length(gradient) == 0) continue;
+    position += transform_direction(collider->frame, gradient) *
+                (radius - dist);
+  }
+}
+
+// Bending constraints between vertices two apart, projected in order from the
+// root, in parallel over strands
+static void solve_bending(particle_shape* shape) {
+  auto& strands   = shape->strands;
+  auto& positions = shape->positions;
+  auto& invmass   = shape->invmass;
+  auto  stiffness = shape->bend_coeff;
+  parallel_blocks(
+      (int)strands.start.size() - 1,
+      [&](int start, int end) {
+        for (auto strand = start; strand < end; strand++) {
+          for (auto entry = strands.start[strand] + 2;
+               entry < strands.start[strand + 1]; entry++) {
+            auto vert0 = strands.verts[entry - 2], vert1 = strands.verts[entry];
+            auto weight = invmass[vert0] + invmass[vert1];
+            if (!weight) continue;
+            auto direction = positions[vert1] - positions[vert0];
+            auto len       = length(direction);
+            if (!len) continue;
+            auto delta = stiffness * (len - strands.bends[entry]) / weight *
+                         direction / len;
+            positions[vert0] += invmass[vert0] * delta;
+            positions[vert1] -= invmass[vert1] * delta;
+          }
+        }
+      },
+      256);
+}
+
+// Follow the leader: places each vertex at its rest length from the previous
+// one, from the root, and records the corrections for the velocity update.
+static void solve_follow_the_leader(particle_shape* shape) {
+  auto& strands   = shape->strands;
+  auto& positions = shape->positions;
+  parallel_blocks(
+      (int)strands.start.size() - 1,
+      [&](int start, int end) {
+        for (auto strand = start; strand < end; strand++) {
+          auto first = strands.start[strand];
+          strands.corrections[first] = {0, 0, 0};
+          for (auto entry = first + 1; entry < strands.start[strand + 1];
+               entry++) {
+            auto  leader    = positions[strands.verts[entry - 1]];
+            auto& position  = positions[strands.verts[entry]];
+            auto  direction = position - leader;
+            auto  len       = length(direction);
+            auto  target    = position;
+            if (len) target = leader + direction * strands.lengths[entry] / len;
+            strands.corrections[entry] = target - position;
+            if (shape->invmass[strands.verts[entry]]) position = target;
+          }
+        }
+      },
+      256);
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR MOVING COLLIDERS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Finds the keyframe before time and the interpolation weight to the next
+static int find_keyframe(const vector<float>& times, float time, float& t) {
+  auto next = (int)(std::upper_bound(times.begin(), times.end(), time) -
+                    times.begin());
+  t         = 0;
+  if (next == 0) return 0;
+  if (next == (int)times.size()) return next - 1;
+  t = (time - times[next - 1]) / (times[next] - times[next - 1]);
+  return next - 1;
+}
+
+// Interpolates rigid frames, orthonormalizing the interpolated axes
+static frame3f interpolate_frames(
+    const frame3f& a, const frame3f& b, float t) {
+  auto z = normalize(a.z * (1 - t) + b.z * t);
+  auto x = orthonormalize(a.x * (1 - t) + b.x * t, z);
+  return {x, cross(z, x), z, a.o * (1 - t) + b.o * t};
+}
+
+// Sorts bvh nodes by depth, so that refitting can update each depth in
+// parallel from the leaves up
+static void make_bvh_levels(particle_collider* collider) {
+  auto& nodes  = collider->bvh.nodes;
+  auto  depths = vector<int>(nodes.size(), 0);
+  auto  levels = 1;
+  for (auto idx = 0; idx < (int)nodes.size(); idx++) {
+    if (!nodes[idx].internal) continue;
+    for (auto child = 0; child < nodes[idx].num; child++) {
+      depths[nodes[idx].start + child] = depths[idx] + 1;
+      levels = max(levels, depths[idx] + 2);
+    }
+  }
+  auto& order = collider->bvh_order;
+  auto& start = collider->bvh_levels;
+  start.assign(levels + 1, 0);
+  for (auto depth : depths) start[depth + 1]++;
+  for (auto level = 0; level < levels; level++)
+    start[level + 1] += start[level];
+  order.assign(nodes.size(), 0);
+  auto next = vector<int>(start.begin(), start.end() - 1);
+  for (auto idx = 0; idx < (int)nodes.size(); idx++)
+    order[next[depths[idx]]++] = idx;
+}
+
+// Refits the bvh bounds to the current positions, one depth at a time from
+// the deepest, with the nodes of each depth in parallel
+static void refit_bvh(particle_collider* collider) {
+  auto& bvh       = collider->bvh;
+  auto& positions = collider->positions;
+  auto& levels    = collider->bvh_levels;
+  for (auto level = (int)levels.size() - 2; level >= 0; level--) {
+    parallel_blocks(
+        levels[level + 1] - levels[level],
+        [&](int start, int end) {
+          for (auto idx = start; idx < end; idx++) {
+            auto& node = bvh.nodes[collider->bvh_order[levels[level] + idx]];
+            node.bbox  = invalidb3f;
+            for (auto item = node.start; item < node.start + node.num;
+                 item++) {
+              if (node.internal) {
+                node.bbox = merge(node.bbox, bvh.nodes[item].bbox);
+              } else if (!collider->quads.empty()) {
+                auto& q   = collider->quads[bvh.primitives[item]];
+                node.bbox = merge(node.bbox,
+                    quad_bounds(positions[q.x], positions[q.y],
+                        positions[q.z], positions[q.w]));
+              } else {
+                auto& t   = collider->triangles[bvh.primitives[item]];
+                node.bbox = merge(node.bbox,
+                    triangle_bounds(
+                        positions[t.x], positions[t.y], positions[t.z]));
+              }
+            }
+          }
+        },
+        256);
+  }
+}
+
+// World bounds of the collider, from the root of its bvh
+static void update_collider_bounds(particle_collider* collider) {
+  collider->bounds = collider->bvh.nodes.empty()
+                         ? invalidb3f
+                         : transform_bbox(
+                               collider->frame, collider->bvh.nodes[0].bbox);
+}
+
+// Moves a collider to its configuration at time, reached in deltat. Rigid
+// motion only changes the frame. Deformations update the vertex velocities,
+// refit the bvh and update the signed distances if present. Returns whether
+// the collider may have moved.
+static bool update_collider(particle_collider* collider, float time,
+    float deltat, const particle_params& params) {
+  if (collider->key_frames.empty() && collider->key_positions.empty() &&
+      !collider->animation)
+    return false;
+  collider->old_frame = collider->frame;
+  collider->deltat    = deltat;
+  std::copy(collider->positions.begin(), collider->positions.end(),
+      collider->old_positions.begin());
+  std::copy(collider->normals.begin(), collider->normals.end(),
+      collider->old_normals.begin());
+  if (!collider->key_frames.empty()) {
+    auto t          = 0.0f;
+    auto key        = find_keyframe(collider->frame_times, time, t);
+    auto next       = min(key + 1, (int)collider->key_frames.size() - 1);
+    collider->frame = interpolate_frames(
+        collider->key_frames[key], collider->key_frames[next], t);
+  }
+  if (!collider->key_positions.empty()) {
+    auto  t    = 0.0f;
+    auto  key  = find_keyframe(collider->position_times, time, t);
+    auto  next = min(key + 1, (int)collider->key_positions.size() - 1);
+    auto& from = collider->key_positions[key];
+    auto& to   = collider->key_positions[next];
+    parallel_blocks((int)collider->positions.size(), [&](int start, int end) {
+      for (auto vert = start; vert < end; vert++)
+        collider->positions[vert] = from[vert] * (1 - t) + to[vert] * t;
+    });
+  }
+  if (collider->animation) collider->animation(collider, time);
+  collider->inverse = inverse(collider->frame);
+
+  // deformations
+  auto deformed = collider->positions != collider->old_positions;
+  parallel_blocks((int)collider->positions.size(), [&](int start, int end) {
+    for (auto vert = start; vert < end; vert++) {
+      auto motion = collider->positions[vert] - collider->old_positions[vert];
+      collider->velocities[vert] = deformed && deltat > 0 ? motion / deltat
+                                                          : zero3f;
+    }
+  });
+  if (deformed) {
+    refit_bvh(collider);
+    if (!collider->quads.empty()) {
+      update_normals(collider->normals, collider->quads, collider->positions);
+    } else if (!collider->triangles.empty()) {
+      update_normals(
+          collider->normals, collider->triangles, collider->positions);
+    }
+    if (!collider->sdf_distances.empty())
+      update_sdf(collider, collider->old_positions, collider->old_normals,
+          params.sdfsize);
+  }
+  update_collider_bounds(collider);
+  return true;
+}
+
+// Builds the scene hierarchy over the collider bounds, splitting nodes at
+// the median of their largest axis, breadth first so that children are next
+// to each other as in the shape bvh. The node ranges are kept in the scene,
+// so that rebuilding does not allocate.
+static void make_collider_bvh(particle_scene* scene) {
+  auto& nodes      = scene->collider_nodes;
+  auto& order      = scene->collider_order;
+  auto  ncolliders = (int)scene->colliders.size();
+  nodes.clear();
+  order.resize(ncolliders);
+  for (auto idx = 0; idx < ncolliders; idx++) order[idx] = idx;
+  if (ncolliders == 0) return;
+  auto bounds = [scene, &order](int idx) -> const bbox3f& {
+    return scene->colliders[order[idx]]->bounds;
+  };
+  auto& ranges = scene->collider_ranges;
+  ranges.clear();
+  ranges.push_back({0, ncolliders});
+  nodes.emplace_back();
+  for (auto nodeid = 0; nodeid < (int)nodes.size(); nodeid++) {
+    auto [start, end] = ranges[nodeid];
+    auto& node        = nodes[nodeid];
+    node.bbox         = invalidb3f;
+    for (auto idx = start; idx < end; idx++)
+      node.bbox = merge(node.bbox, bounds(idx));
+    if (end - start <= 2) {
+      node.internal = false;
+      node.start    = start;
+      node.num      = end - start;
+      continue;
+    }
+    auto size = node.bbox.max - node.bbox.min;
+    auto axis = size.x >= size.y && size.x >= size.z ? 0
+                : size.y >= size.z                   ? 1
+                                                     : 2;
+    auto mid  = (start + end) / 2;
+    std::nth_element(order.begin() + start, order.begin() + mid,
+        order.begin() + end, [scene, axis](int a, int b) {
+          auto& ba = scene->colliders[a]->bounds;
+          auto& bb = scene->colliders[b]->bounds;
+          return ba.min[axis] + ba.max[axis] < bb.min[axis] + bb.max[axis];
+        });
+    node.internal = true;
+    node.axis     = (int8_t)axis;
+    node.num      = 2;
+    node.start    = (int)nodes.size();
+    ranges.push_back({start, mid});
+    ranges.push_back({mid, end});
+    nodes.emplace_back();
+    nodes.emplace_back();
+  }
+}
+
+// Carries colliding particles along moving colliders. The normal velocity is
+// left to the projection, while the tangential velocity relative to the
+// collider is damped by the friction in bounce.x. Collisions with static
+// colliders keep their velocities.
+static void apply_collision_velocities(
+    particle_shape* shape, const particle_params& params) {
+  for (auto& collision : shape->collisions) {
+    if (collision.vert < 0 || !shape->invmass[collision.vert]) continue;
+    if (collision.velocity == zero3f) continue;
+    auto& velocity = shape->velocities[collision.vert];
+    auto  relative = velocity - collision.velocity;
+    auto  normal   = dot(relative, collision.normal) * collision.normal;
+    velocity       = collision.velocity + normal +
+               (relative - normal) * (1 - params.bounce.x);
+  }
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR HIERARCHICAL PBD
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Builds the coarse levels of the pbd hierarchy from the spring graph. Each
+// level keeps a maximal independent set of the vertices of the finer one,
+// chosen greedily starting from pinned vertices, so that every finer vertex
+// is either kept or adjacent to a kept one. Kept vertices within two finer
+// edges are connected by springs at their initial distance.
+static void make_levels(particle_shape* shape,
+    const vector<particle_spring>& springs, int num_levels) {
+  auto nverts    = (int)shape->positions.size();
+  auto adjacency = vector<vector<int>>(nverts);
+  for (auto& spring : springs) {
+    adjacency[spring.vert0].push_back(spring.vert1);
+    adjacency[spring.vert1].push_back(spring.vert0);
+  }
+  auto vertices = vector<int>(nverts);
+  for (auto vert = 0; vert < nverts; vert++) vertices[vert] = vert;
+
+  shape->levels.clear();
+  auto coarse  = vector<bool>(nverts);
+  auto covered = vector<bool>(nverts);
+  for (auto level = 1; level < num_levels && vertices.size() > 4; level++) {
+    // select coarse vertices
+    std::fill(coarse.begin(), coarse.end(), false);
+    std::fill(covered.begin(), covered.end(), false);
+    auto select = [&](int vert) {
+      if (covered[vert]) return;
+      coarse[vert] = covered[vert] = true;
+      for (auto neighbor : adjacency[vert]) covered[neighbor] = true;
+    };
+    for (auto vert : vertices)
+      if (!shape->invmass[vert]) select(vert);
+    for (auto vert : vertices) select(vert);
+
+    // prolongation weights, by inverse distance to the coarse neighbors
+    auto& hierarchy = shape->levels.emplace_back();
+    hierarchy.start.push_back(0);
+    for (auto vert : vertices) {
+      if (coarse[vert]) continue;
+      auto first = hierarchy.weights.size();
+      auto sum   = 0.0f;
+      for (auto neighbor : adjacency[vert]) {
+        if (!coarse[neighbor]) continue;
+        auto weight = 1 / max(distance(shape->positions[vert],
+                                  shape->positions[neighbor]),
+                              1e-6f);
+        hierarchy.parents.push_back(neighbor);
+        hierarchy.weights.push_back(weight);
+        sum += weight;
+      }
+      for (auto idx = first; idx < hierarchy.weights.size(); idx++)
+        hierarchy.weights[idx] /= sum;
+      hierarchy.fine.push_back(vert);
+      hierarchy.start.push_back((int)hierarchy.parents.size());
+    }
+
+    // coarse springs and graph
+    auto coarse_vertices  = vector<int>{};
+    auto coarse_adjacency = vector<vector<int>>(nverts);
+    auto coarse_springs   = vector<particle_spring>{};
+    for (auto vert : vertices) {
+      if (!coarse[vert]) continue;
+      auto& neighbors = coarse_adjacency[vert];
+      for (auto neighbor : adjacency[vert]) {
+        if (coarse[neighbor]) neighbors.push_back(neighbor);
+        for (auto second : adjacency[neighbor])
+          if (coarse[second] && second != vert) neighbors.push_back(second);
+      }
+      std::sort(neighbors.begin(), neighbors.end());
+      neighbors.erase(
+          std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+      for (auto neighbor : neighbors) {
+        if (neighbor < vert) continue;
+        coarse_springs.push_back({vert, neighbor,
+            distance(shape->positions[vert], shape->positions[neighbor]),
+            shape->spring_coeff});
+      }
+      coarse_vertices.push_back(vert);
+    }
+    make_springs(hierarchy.springs, coarse_springs, nverts);
+    vertices  = std::move(coarse_vertices);
+    adjacency = std::move(coarse_adjacency);
+  }
+}
+
+// Links each free vertex to its nearest pinned vertex along the springs at
+// their initial distance. Nearest anchors are found by a shortest path search
+// from all pinned vertices at once, so the cost does not grow with their
+// number. Vertices not connected to pinned ones are not tethered.
+static void make_tethers(
+    particle_shape* shape, const vector<particle_spring>& springs) {
+  auto& positions = shape->positions;
+  auto  nverts    = (int)positions.size();
+  auto  adjacency = vector<vector<int>>(nverts);
+  for (auto& spring : springs) {
+    adjacency[spring.vert0].push_back(spring.vert1);
+    adjacency[spring.vert1].push_back(spring.vert0);
+  }
+  auto lengths = vector<float>(nverts, flt_max);
+  auto anchors = vector<int>(nverts, -1);
+  auto queue   = std::priority_queue<std::pair<float, int>,
+      vector<std::pair<float, int>>, std::greater<>>{};
+  for (auto vert = 0; vert < nverts; vert++) {
+    if (shape->invmass[vert]) continue;
+    lengths[vert] = 0;
+    anchors[vert] = vert;
+    queue.push({0.0f, vert});
+  }
+  while (!queue.empty()) {
+    auto [path, vert] = queue.top();
+    queue.pop();
+    if (path > lengths[vert]) continue;
+    for (auto neighbor : adjacency[vert]) {
+      auto next = path + distance(positions[vert], positions[neighbor]);
+      if (next >= lengths[neighbor]) continue;
+      lengths[neighbor] = next;
+      anchors[neighbor] = anchors[vert];
+      queue.push({next, neighbor});
+    }
+  }
+
+  auto& tethers = shape->tethers;
+  tethers       = {};
+  for (auto vert = 0; vert < nverts; vert++) {
+    if (!shape->invmass[vert] || anchors[vert] < 0) continue;
+    tethers.vert.push_back(vert);
+    tethers.anchor.push_back(anchors[vert]);
+    tethers.rest.push_back(distance(positions[vert], positions[anchors[vert]]));
+  }
+}
+
+// Projects vertices that went too far from their anchors back on the sphere
+// of allowed positions. Anchors are pinned, so only the vertex moves, and each
+// vertex has one tether, so tethers are solved in parallel.
+static void solve_tethers(particle_shape* shape) {
+  auto& tethers = shape->tethers;
+  parallel_blocks((int)tethers.vert.size(), [&](int start, int end) {
+    for (auto idx = start; idx < end; idx++) {
+      auto& position = shape->positions[tethers.vert[idx]];
+      auto& anchor   = shape->positions[tethers.anchor[idx]];
+      auto  delta    = position - anchor;
+      auto  len      = length(delta);
+      if (len > tethers.rest[idx])
+        position = anchor + delta * (tethers.rest[idx] / len);
+    }
+  });
+}
+
+// Solves the coarse levels from the coarsest, prolongating the corrections
+// of each level to the vertices of the finer one. Corrections are measured
+// from the positions before the pass, so they add up over levels.
+static void solve_levels(particle_shape* shape, int steps, bool simd) {
+  if (shape->levels.empty()) return;
+  std::copy(shape->positions.begin(), shape->positions.end(),
+      shape->level_positions.begin());
+  auto& positions = shape->positions;
+  auto& initial   = shape->level_positions;
+  for (auto level = (int)shape->levels.size() - 1; level >= 0; level--) {
+    auto& hierarchy = shape->levels[level];
+    for (auto step = 0; step < steps; step++)
+      solve_springs<true, true>(shape, hierarchy.springs, simd);
+    for (auto idx = 0; idx < hierarchy.fine.size(); idx++) {
+      auto vert = hierarchy.fine[idx];
+      if (!shape->invmass[vert]) continue;
+      auto correction = vec3f{0, 0, 0};
+      for (auto p = hierarchy.start[idx]; p < hierarchy.start[idx + 1]; p++) {
+        auto parent = hierarchy.parents[p];
+        correction += hierarchy.weights[p] *
+                      (positions[parent] - initial[parent]);
+      }
+      positions[vert] = initial[vert] + correction;
+    }
+  }
+}
+
+}  // namespace yocto
 
 // -----------------------------------------------------------------------------
 // SIMULATION DATA AND API
 // -----------------------------------------------------------------------------
 namespace yocto {
 
+// Particles per block in the parallel collision detection
+static const auto collision_block = 1024;
+
+// Substeps per frame without adaptive steps
+static int get_fixed_steps(const particle_params& params) {
+  return params.solver == particle_solver_type::mass_spring ? params.mssteps
+                                                            : 1;
+}
+
+// Accumulates the time elapsed since the previous lap in a timing slot
+struct particle_clock {
+  std::chrono::steady_clock::time_point last =
+      std::chrono::steady_clock::now();
+  void lap(double& slot) {
+    auto now = std::chrono::steady_clock::now();
+    slot += std::chrono::duration<double>(now - last).count();
+    last = now;
+  }
+};
+
 // Init simulation
 void init_simulation(particle_scene* scene, const particle_params& params) {
-  auto rng = make_rng(params.seed);
+  auto rng          = make_rng(params.seed);
+  scene->time       = 0;
+  scene->timings    = {};
+  scene->frame      = 0;
+  scene->iterations = 0;
+  scene->residual   = 0;
+  scene->substeps   = get_fixed_steps(params);
+  scene->min_length = flt_max;
+  scene->strain     = 0;
   /*COPY INITIAL VALUES*/
   for (auto& shape : scene->shapes) {
     shape->positions  = shape->initial_positions;
@@ -139,15 +1966,45 @@ void init_simulation(particle_scene* scene, const particle_params& params) {
     shape->velocities = shape->initial_velocities;
     shape->invmass    = shape->initial_invmass;
     shape->radius     = shape->initial_radius;
-    auto init_pinned  = shape->initial_pinned;
 
-    /*inizializzo il vettore delle forze*/
-    for (int i = 0; i < shape->invmass.size(); i++) {
-      shape->forces.push_back({0, 0, 0});
+    /*WORKSPACES: sized once here, so that restarting the simulation does not
+    grow them and simulating a frame does not allocate*/
+    auto nverts = shape->positions.size();
+    shape->forces.assign(nverts, {0, 0, 0});
+    shape->old_positions.assign(nverts, {0, 0, 0});
+    if (shape->normals.size() != nverts)
+      shape->normals.assign(nverts, {0, 0, 1});
+    shape->collisions.clear();
+    shape->collisions.reserve(nverts * scene->colliders.size());
+    shape->collision_blocks.resize(
+        (nverts + collision_block - 1) / collision_block);
+    for (auto& hits : shape->collision_blocks) {
+      hits.clear();
+      hits.reserve(collision_block * scene->colliders.size());
+    }
+    resize_soa(shape->field_positions, nverts);
+    resize_soa(shape->field_velocities, nverts);
+    resize_soa(shape->field_accelerations, nverts);
+
+    /*EMITTER POOL: sites are alive, the rest of the pool is free*/
+    shape->ages.clear();
+    shape->free_particles.clear();
+    if (has_emitter(shape)) {
+      shape->ages.assign(nverts, -1);
+      shape->free_particles.reserve(nverts);
+      for (auto slot = (int)nverts - 1; slot >= 0; slot--) {
+        if (slot < shape->emit_sites) {
+          shape->ages[slot] = 0;
+        } else {
+          shape->free_particles.push_back(slot);
+        }
+      }
+      shape->emit_rng     = make_rng(params.seed, 2 * rand1i(rng, 1 << 20) + 1);
+      shape->emit_pending = 0;
     }
 
     /*SETUP PINNED*/
-    for (auto& vertex : init_pinned) {
+    for (auto& vertex : shape->initial_pinned) {
       shape->invmass[vertex] = 0;
     }
 
@@ -158,50 +2015,120 @@ void init_simulation(particle_scene* scene, const particle_params& params) {
     }
 
     /*MAKE SPRINGS*/
+    auto springs = vector<particle_spring>{};
     if (shape->spring_coeff > 0) {
       if (!shape->quads.empty()) {
         for (auto& edge : get_edges(shape->quads)) {
-          shape->springs.push_back({edge.x, edge.y,
+          springs.push_back({edge.x, edge.y,
               distance(shape ->positions[edge.x], shape ->positions[edge.y]),
               shape->spring_coeff});
         }
         /*make diagonal*/
         for (auto& quad : shape->quads) {
-          shape->springs.push_back({quad.x, quad.z,
+          springs.push_back({quad.x, quad.z,
               distance(shape->positions[quad.x], shape->positions[quad.z]),
               shape->spring_coeff});
-          shape->springs.push_back({quad.w, quad.y,
+          springs.push_back({quad.w, quad.y,
               distance(shape->positions[quad.w], shape->positions[quad.y]),
               shape->spring_coeff});
         }
 
       } else if (!shape->triangles.empty()) {
         for (auto& edge : get_edges(shape->triangles)) {
-          shape->springs.push_back({edge.x, edge.y,
+          springs.push_back({edge.x, edge.y,
               distance(shape ->positions[edge.x], shape ->positions[edge.y]),
               shape->spring_coeff});
         }
       }
     }
+    make_springs(shape->springs, springs, (int)nverts);
 
-    /*INITIALIZE COLLIDERS BVH: costruisco il bvh*/
-    for (auto& collider : scene->colliders) {
-      if (!collider->quads.empty()) {
-        collider->bvh = make_quads_bvh(
-            collider->quads, collider->positions, collider->radius);
-      } else if (!collider->triangles.empty()) {
-        collider->bvh = make_triangles_bvh(
-            collider->triangles, collider->positions, collider->radius);
-      }
+    /*SMALLEST LENGTH: bounds the adaptive steps, from edges or radius*/
+    for (auto& spring : springs)
+      if (spring.rest > 0)
+        scene->min_length = min(scene->min_length, spring.rest);
+    if (springs.empty()) {
+      for (auto radius : shape->radius)
+        if (radius > 0) scene->min_length = min(scene->min_length, radius);
+    }
+
+    /*FLUID WORKSPACES: point shapes only*/
+    shape->fluid = {};
+    if (params.solver == particle_solver_type::position_fluid &&
+        !shape->points.empty())
+      init_fluid(shape);
+
+    /*SHAPE MATCHING CLUSTERS: bodies only*/
+    shape->clusters = {};
+    if (params.solver == particle_solver_type::shape_matching &&
+        (shape->cluster_stiffness > 0 || !shape->stiffness.empty()))
+      make_clusters(shape);
+
+    /*STRANDS: line shapes only*/
+    shape->strands = {};
+    if (params.solver == particle_solver_type::follow_the_leader &&
+        !shape->lines.empty())
+      make_strands(shape);
+
+    /*PBD HIERARCHY AND ATTACHMENTS: only the position based solver uses them*/
+    auto pbd = params.solver == particle_solver_type::position_based;
+    make_levels(shape, springs, pbd ? params.pdblevels : 1);
+    shape->level_positions.assign(
+        shape->levels.empty() ? 0 : nverts, {0, 0, 0});
+    shape->tethers = {};
+    if (pbd && params.attachments) make_tethers(shape, springs);
+  }
+
+  /*INITIALIZE COLLIDERS BVH: costruisco il bvh*/
+  for (auto& collider : scene->colliders) {
+    /*RESET MOTION: the bvh and sdf are built on the initial pose*/
+    if (!collider->initial_positions.empty())
+      collider->positions = collider->initial_positions;
+    if (!collider->initial_normals.empty())
+      collider->normals = collider->initial_normals;
+    collider->frame     = collider->initial_frame;
+    collider->inverse   = inverse(collider->frame);
+    collider->old_frame = collider->frame;
+    collider->deltat    = 0;
+    collider->old_positions.assign(collider->positions.size(), {0, 0, 0});
+    collider->old_normals.assign(collider->normals.size(), {0, 0, 0});
+    collider->velocities.assign(collider->positions.size(), {0, 0, 0});
+    if (!collider->quads.empty()) {
+      collider->bvh = make_quads_bvh(
+          collider->quads, collider->positions, collider->radius);
+    } else if (!collider->triangles.empty()) {
+      collider->bvh = make_triangles_bvh(
+          collider->triangles, collider->positions, collider->radius);
+    }
+    make_bvh_levels(collider);
+    update_collider_bounds(collider);
+
+    /*SIGNED DISTANCES: only the strand solver uses them*/
+    if (params.solver == particle_solver_type::follow_the_leader) {
+      make_sdf(collider, params.sdfsize);
+    } else {
+      collider->sdf_distances.clear();
     }
+
+    /*INITIAL POSE: colliders start at their configuration at time zero*/
+    update_collider(collider, 0, 0, params);
+  }
+  make_collider_bvh(scene);
+
+  /*BROAD PHASE WORKSPACES*/
+  for (auto shape : scene->shapes) {
+    shape->candidates.clear();
+    shape->candidates.reserve(scene->colliders.size());
   }
 }
 
 
-// check if a point is inside a collider
+// check if a point is inside a collider. The query runs in the collider local
+// space, and the hit is returned in world space with the collider velocity.
 bool collide_collider(particle_collider* collider, const vec3f& position,
-    vec3f& hit_position, vec3f& hit_normal) {
-  auto ray = ray3f{position, vec3f{0, 1, 0}};
+    vec3f& hit_position, vec3f& hit_normal, vec3f& hit_velocity) {
+  auto ray = ray3f{transform_point(collider->inverse, position),
+      transform_direction(collider->inverse, vec3f{0, 1, 0})};
   if (!collider->quads.empty()) {
     auto isec = intersect_quads_bvh(
         collider->bvh, collider->quads, collider->positions, ray);
@@ -213,7 +2140,9 @@ bool collide_collider(particle_collider* collider, const vec3f& position,
     hit_normal   = normalize(
         interpolate_quad(collider->normals[q.x], collider->normals[q.y],
             collider->normals[q.z], collider->normals[q.w], isec.uv));
-
+    hit_velocity = interpolate_quad(collider->velocities[q.x],
+        collider->velocities[q.y], collider->velocities[q.z],
+        collider->velocities[q.w], isec.uv);
   } else if (!collider->triangles.empty()) {
     auto isec = intersect_triangles_bvh(
         collider->bvh, collider->triangles, collider->positions, ray);
@@ -223,62 +2152,174 @@ bool collide_collider(particle_collider* collider, const vec3f& position,
         collider->positions[t.y], collider->positions[t.z], isec.uv);
     hit_normal   = normalize(interpolate_triangle(collider->normals[t.x],
         collider->normals[t.y], collider->normals[t.z], isec.uv));
+    hit_velocity = interpolate_triangle(collider->velocities[t.x],
+        collider->velocities[t.y], collider->velocities[t.z], isec.uv);
+  } else {
+    return false;
+  }
+
+  // back to world space, adding the rigid motion to the deformation
+  auto local   = hit_position;
+  hit_position = transform_point(collider->frame, local);
+  hit_normal   = transform_direction(collider->frame, hit_normal);
+  hit_velocity = transform_vector(collider->frame, hit_velocity);
+  if (collider->deltat > 0) {
+    auto old_position = transform_point(collider->old_frame, local);
+    hit_velocity += (hit_position - old_position) / collider->deltat;
   }
+  return dot(hit_normal, transform_direction(collider->frame, ray.d)) > 0;
+}
 
-  return dot(hit_normal, ray.d) > 0;
+// Finds the colliders near the shape particles with the scene hierarchy.
+// Returns the margin that inflates bounds for the particles, the largest
+// motion since the old positions plus the particle radius, since particles
+// can only have entered colliders by that much.
+static float find_colliders(
+    const particle_scene* scene, particle_shape* shape) {
+  auto& candidates = shape->candidates;
+  candidates.clear();
+  if (scene->collider_nodes.empty()) return 0;
+  auto bounds = invalidb3f;
+  auto margin = 0.0f;
+  for (auto i = 0; i < (int)shape->positions.size(); i++) {
+    if (!shape->invmass[i]) continue;
+    bounds = merge(bounds, shape->positions[i]);
+    margin = max(margin,
+        distance(shape->positions[i], shape->old_positions[i]) +
+            (shape->radius.empty() ? 0 : shape->radius[i]));
+  }
+  bounds.min -= margin;
+  bounds.max += margin;
+  int  stack[64];
+  auto size = 0;
+  stack[size++] = 0;
+  while (size > 0) {
+    auto& node = scene->collider_nodes[stack[--size]];
+    if (!overlap_bbox(node.bbox, bounds)) continue;
+    if (node.internal) {
+      stack[size++] = node.start;
+      stack[size++] = node.start + 1;
+    } else {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto collider = scene->collider_order[idx];
+        if (overlap_bbox(scene->colliders[collider]->bounds, bounds))
+          candidates.push_back(collider);
+      }
+    }
+  }
+  // keep the scene order, so that collisions are found in the same order
+  std::sort(candidates.begin(), candidates.end());
+  return margin;
+}
+
+// Detects the collisions of the shape particles with the colliders whose
+// inflated bounds contain them. Particles are tested in parallel blocks, and
+// the collisions of the blocks are appended in order, so the list is the
+// same as with a serial loop.
+static void detect_collisions(
+    const particle_scene* scene, particle_shape* shape) {
+  shape->collisions.clear();
+  auto margin = find_colliders(scene, shape);
+  if (shape->candidates.empty()) return;
+  auto  count   = (int)shape->positions.size();
+  auto  nblocks = (count + collision_block - 1) / collision_block;
+  auto& blocks  = shape->collision_blocks;
+  if ((int)blocks.size() < nblocks) blocks.resize(nblocks);
+  parallel_blocks(
+      count,
+      [&](int start, int end) {
+        auto& hits = blocks[start / collision_block];
+        hits.clear();
+        for (auto i = start; i < end; i++) {
+          if (!shape->invmass[i]) continue;
+          for (auto candidate : shape->candidates) {
+            auto collider = scene->colliders[candidate];
+            if (!inside_bounds(
+                    collider->bounds, shape->positions[i], margin))
+              continue;
+            auto hit_position = zero3f, hit_normal = zero3f,
+                 hit_velocity = zero3f;
+            if (!collide_collider(collider, shape->positions[i],
+                    hit_position, hit_normal, hit_velocity))
+              continue;
+            hits.push_back({i, hit_position, hit_normal, hit_velocity});
+          }
+        }
+      },
+      collision_block);
+  for (auto idx = 0; idx < nblocks; idx++)
+    shape->collisions.insert(
+        shape->collisions.end(), blocks[idx].begin(), blocks[idx].end());
+}
+
+// Adds the timings of a shape step to the totals
+static void merge_timings(particle_timings& total, const particle_timings& t) {
+  total.integration += t.integration;
+  total.springs += t.springs;
+  total.neighbors += t.neighbors;
+  total.collisions += t.collisions;
+  total.velocities += t.velocities;
+  total.normals += t.normals;
+  total.iterations += t.iterations;
+  total.dropped += t.dropped;
+}
+
+// Runs func(shape) on all shapes, that never interact, as one task each. The
+// loops inside shapes are nested tasks on the same scheduler, so idle threads
+// steal blocks of large shapes once small ones are done. Shape statistics are
+// merged in the scene in shape order, so they do not depend on scheduling.
+template <typename Func>
+static void parallel_shapes(particle_scene* scene, Func&& func) {
+  auto& shapes = scene->shapes;
+  for (auto shape : shapes) {
+    shape->timings    = {};
+    shape->iterations = 0;
+    shape->residual   = 0;
+  }
+  if (shapes.size() == 1) {
+    func(shapes.front());
+  } else {
+    auto group = task_group{};
+    for (auto shape : shapes) group.run([&func, shape]() { func(shape); });
+    group.wait();
+  }
+  for (auto shape : shapes) {
+    merge_timings(scene->timings, shape->timings);
+    scene->iterations = max(scene->iterations, shape->iterations);
+    scene->residual   = max(scene->residual, shape->residual);
+  }
 }
 
 // simulate mass-spring
-void simulate_massspring(particle_scene* scene, const particle_params& params) {
-  /*SAVE OLD POSITIONS*/
-  for (auto& particle : scene->shapes) {
-    particle->old_positions = particle->positions;
-  }
-  /*COMPUTE DYNAMICS*/
-  for (auto s = 0; s < params.mssteps; s++) {
-    auto ddt = params.deltat / params.mssteps;
-    /*compute forces*/
-    for (auto& particle : scene->shapes) {
+void simulate_massspring(
+    particle_scene* scene, const particle_params& params, int steps) {
+  auto ddt = params.deltat / steps;
+  parallel_shapes(scene, [&](particle_shape* particle) {
+    auto& timings = particle->timings;
+    auto  clock   = particle_clock{};
+    auto  time    = scene->time;
+    /*SAVE OLD POSITIONS*/
+    std::copy(particle->positions.begin(), particle->positions.end(),
+        particle->old_positions.begin());
+    /*COMPUTE DYNAMICS*/
+    for (auto s = 0; s < steps; s++) {
+      /*compute forces*/
       /*ciclo sulla size di invmass per prendere gli indici di tutti i vettori*/
       for (int i = 0; i < particle->invmass.size(); i++) {
         if (particle->invmass[i] != 0) {
           particle->forces[i] = vec3f{0, -params.gravity, 0} /
                                 particle->invmass[i];
         }
-        /*per il vento, inserisco un flag di controllo e cambio le forze, 
-        settando a un valore pari a 4 l'intensit del vento*/
-        if (params.flag) {
-          particle->forces[i] = vec3f{4, 0, 0} /
-                                particle->invmass[i];
-        }
-
       }
 
-      for (auto& spring : particle->springs) {
-        auto& particle0 = spring.vert0;
-        auto& particle1 = spring.vert1;
-
-        auto invmass = particle->invmass[particle0] +
-                       particle->invmass[particle1];
-        if (!invmass) continue;
-        auto delta_pos = particle->positions[particle1] -
-                         particle->positions[particle0];
-        auto spring_dir = normalize(delta_pos);
-        auto spring_len = length(delta_pos);
-        auto force      = spring_dir * (spring_len / spring.rest - 1) /
-                     (spring.coeff * invmass);  // we take invcoeff in [0,1]
-
-        auto delta_vel = particle->velocities[particle1] -
-                         particle->velocities[particle0];
-        force += dot(delta_vel / spring.rest, spring_dir) * spring_dir /
-                 (spring.coeff * 1000 * invmass);
-        particle->forces[particle0] += force;
-        particle->forces[particle1] -= force;
-      }
-    }
+      /*force fields, like wind, are added in a separate pass*/
+      apply_fields(scene, particle, time);
+      clock.lap(timings.integration);
+
+      /*spring forces*/
+      solve_springs<false>(particle, particle->springs, params.simd);
+      clock.lap(timings.springs);
 
-    /*update state*/
-    for (auto particle : scene->shapes) {
       /*update velocity and positions using Euler's method*/
       for (int i = 0; i < particle->invmass.size(); i++) {
         if (particle->invmass[i] != 0) {
@@ -286,33 +2327,25 @@ void simulate_massspring(particle_scene* scene, const particle_params& params) {
                                      particle->invmass[i];
           particle->positions[i] += ddt * particle->velocities[i];
         }
-        
       }
+      time += ddt;
+      clock.lap(timings.integration);
     }
-  }
-  /*HANDLE COLLISIONS*/
-  for (auto particle : scene->shapes) {
-      for (auto i = 0; i < particle->invmass.size(); i++) {
-      if (!particle->invmass[i]) continue;
-      for (auto collider : scene->colliders) {
-        auto hitpos     = zero3f;
-        auto hit_normal = zero3f;
-
-        if (collide_collider(
-                collider, particle->positions[i], hitpos, hit_normal)) {
-          particle->positions[i] = hitpos + hit_normal * 0.005;   
-          auto projection        = dot(particle->velocities[i], hit_normal);
-          particle->velocities[i] =
-              (particle->velocities[i] - projection * hit_normal) *
-                  (1 - params.bounce.x) -
-              projection * hit_normal * (1 - params.bounce.y);
-          
-        }
-      }
+    /*HANDLE COLLISIONS*/
+    detect_collisions(scene, particle);
+    for (auto& collision : particle->collisions) {
+      auto i = collision.vert;
+      particle->positions[i] = collision.position + collision.normal * 0.005;
+      /*bounce relative to the collider velocity*/
+      auto relative   = particle->velocities[i] - collision.velocity;
+      auto projection = dot(relative, collision.normal);
+      particle->velocities[i] =
+          collision.velocity +
+          (relative - projection * collision.normal) * (1 - params.bounce.x) -
+          projection * collision.normal * (1 - params.bounce.y);
     }
-  }
-  // VELOCITY FILTER
-  for (auto& particle : scene->shapes) {
+    clock.lap(timings.collisions);
+    // VELOCITY FILTER
     for (int i = 0; i < particle->invmass.size(); i++) {
       if (!particle->invmass[i]) continue;
       particle->velocities[i] *= (1 - params.dumping * params.deltat);
@@ -320,64 +2353,58 @@ void simulate_massspring(particle_scene* scene, const particle_params& params) {
       if (length(particle->velocities[i]) < params.minvelocity) /*sleeping*/
         particle->velocities[i] = {0, 0, 0};
     }
-  }
-  // RECOMPUTE NORMALS
-  for (auto& particle : scene->shapes) {
+    clock.lap(timings.velocities);
+    // RECOMPUTE NORMALS
     if (!particle->quads.empty()) {
-      particle->normals = compute_normals(particle->quads, particle->positions);
+      update_normals(particle->normals, particle->quads, particle->positions);
     } else if (!particle->triangles.empty()) {
-      particle->normals = compute_normals(
-          particle->triangles, particle->positions);
+      update_normals(
+          particle->normals, particle->triangles, particle->positions);
     }
-  }
- 
+    clock.lap(timings.normals);
+  });
+  for (auto s = 0; s < steps; s++) scene->time += ddt;
 }
 
+// simulate pbd for a step of duration dt
+void simulate_pbd(
+    particle_scene* scene, const particle_params& params, float dt) {
+  parallel_shapes(scene, [&](particle_shape* particle) {
+    auto& timings = particle->timings;
+    auto  clock   = particle_clock{};
+    /*SAVE OLD POSITIONS*/
+    std::copy(particle->positions.begin(), particle->positions.end(),
+        particle->old_positions.begin());
 
-// simulate pbd
-void simulate_pbd(particle_scene* scene, const particle_params& params) {
-  /*SAVE OLD POSITIONS*/
-  for (auto& particle : scene->shapes) {
-    particle->old_positions = particle->positions;
+    /*APPLY FORCE FIELDS*/
+    std::fill(particle->forces.begin(), particle->forces.end(), zero3f);
+    apply_fields(scene, particle, scene->time);
 
     /*PREDICT POSITIONS*/
     for (int i = 0; i < particle->invmass.size(); i++) {
       if (!particle->invmass[i]) continue;
-      particle->velocities[i] += vec3f{0, -params.gravity, 0} * params.deltat;
-      particle->positions[i] += particle->velocities[i] * params.deltat;
+      auto acceleration = vec3f{0, -params.gravity, 0} +
+                          particle->forces[i] * particle->invmass[i];
+      particle->velocities[i] += acceleration * dt;
+      particle->positions[i] += particle->velocities[i] * dt;
     }
+    clock.lap(timings.integration);
 
-    /*COMPUTE COLLISIONS*/
-    particle->collisions.clear();
-    for (int i = 0; i < particle->invmass.size(); i++) {
-      if (!particle->invmass[i]) continue;
-      for (auto collider : scene->colliders) {
-        auto hit_position = zero3f, hit_normal = zero3f;
-        if (!collide_collider(
-                collider, particle->positions[i], hit_position, hit_normal)) {
-          continue;
-        }
-        particle->collisions.push_back({i, hit_position, hit_normal});
-      }
-    }
-    // SOLVE CONSTRAINTS (vincoli)
-    for (int i = 0; i < params.pdbsteps; i++) {
-      for (auto& spring : particle->springs) {
-        auto particle0 = spring.vert0;
-        auto particle1 = spring.vert1;  
-        auto invmass   = particle->invmass[particle0] +
-                       particle->invmass[particle1];
-        if (!invmass) continue;
-        auto dir = particle->positions[particle1] -
-                   particle->positions[particle0];
-        auto len = length(dir);
-        dir /= len;
-        auto lambda = (1 - spring.coeff) * (len - spring.rest) / invmass;
-        particle->positions[particle0] += particle->invmass[particle0] *
-                                          lambda * dir;
-        particle->positions[particle1] -= particle->invmass[particle1] *
-                                          lambda * dir;
-      }
+    /*COMPUTE COLLISIONS: the buffer capacity is reserved at init*/
+    detect_collisions(scene, particle);
+    clock.lap(timings.collisions);
+    // SOLVE COARSE LEVELS: spreads corrections over the whole shape
+    solve_levels(particle, params.levelsteps, params.simd);
+
+    // SOLVE CONSTRAINTS (vincoli): stop early once the springs stretch less
+    // than the tolerance, measured while projecting them
+    auto iterations = 0;
+    auto residual   = 0.0f;
+    while (iterations < params.pdbsteps) {
+      iterations += 1;
+      residual = solve_springs<true>(
+          particle, particle->springs, params.simd);
+      solve_tethers(particle);
       for (auto& collision : particle->collisions) {
         auto particle1 = collision.vert;
         if (!particle->invmass[particle1]) continue;
@@ -387,41 +2414,379 @@ void simulate_pbd(particle_scene* scene, const particle_params& params) {
         if (projection >= 0) continue;
         particle->positions[particle1] += -projection * collision.normal;
       }
+      if (params.tolerance > 0 && residual <= params.tolerance) break;
     }
+    particle->iterations = iterations;
+    particle->residual   = residual;
+    timings.iterations += iterations;
+    clock.lap(timings.springs);
 
     // COMPUTE VELOCITIES
     for (int i = 0; i < particle->invmass.size(); i++) {
       if (!particle->invmass[i]) continue;
       particle->velocities[i] =
-          (particle->positions[i] - particle->old_positions[i]) / params.deltat;
+          (particle->positions[i] - particle->old_positions[i]) / dt;
     }
+    apply_collision_velocities(particle, params);
+    clock.lap(timings.integration);
 
     // VELOCITY FILTER
     for (int i = 0; i < particle->invmass.size(); i++) {
       if (!particle->invmass[i]) continue;
-      particle->velocities[i] *= (1 - params.dumping * params.deltat);
+      particle->velocities[i] *= (1 - params.dumping * dt);
       if (length(particle->velocities[i]) < params.minvelocity) {
         particle->velocities[i] = {0, 0, 0};
       }
     }
+    clock.lap(timings.velocities);
     // RECOMPUTE NORMALS
     if (!particle->quads.empty()) {
-      particle->normals = compute_normals(particle->quads, particle->positions);
+      update_normals(particle->normals, particle->quads, particle->positions);
     } else if (!particle->triangles.empty()) {
-      particle->normals = compute_normals(
-          particle->triangles, particle->positions);
+      update_normals(
+          particle->normals, particle->triangles, particle->positions);
     }
-  }
+    clock.lap(timings.normals);
+  });
+  scene->time += dt;
+}
+
+// simulate shape matching for a step of duration dt. Bodies are matched to
+// their clusters, while cloth springs are projected as in pbd.
+void simulate_shapematching(
+    particle_scene* scene, const particle_params& params, float dt) {
+  parallel_shapes(scene, [&](particle_shape* particle) {
+    auto& timings = particle->timings;
+    auto  clock   = particle_clock{};
+    /*SAVE OLD POSITIONS*/
+    std::copy(particle->positions.begin(), particle->positions.end(),
+        particle->old_positions.begin());
+
+    /*APPLY FORCE FIELDS*/
+    std::fill(particle->forces.begin(), particle->forces.end(), zero3f);
+    apply_fields(scene, particle, scene->time);
+
+    /*PREDICT POSITIONS*/
+    for (int i = 0; i < particle->invmass.size(); i++) {
+      if (!particle->invmass[i]) continue;
+      auto acceleration = vec3f{0, -params.gravity, 0} +
+                          particle->forces[i] * particle->invmass[i];
+      particle->velocities[i] += acceleration * dt;
+      particle->positions[i] += particle->velocities[i] * dt;
+    }
+    clock.lap(timings.integration);
+
+    /*COMPUTE COLLISIONS: the buffer capacity is reserved at init*/
+    detect_collisions(scene, particle);
+    clock.lap(timings.collisions);
+
+    /*SOLVE CONSTRAINTS: clusters, springs and collisions*/
+    for (auto iteration = 0; iteration < params.matchsteps; iteration++) {
+      if (!particle->clusters.stiffness.empty()) solve_clusters(particle);
+      solve_springs<true>(particle, particle->springs, params.simd);
+      for (auto& collision : particle->collisions) {
+        auto projection = dot(
+            particle->positions[collision.vert] - collision.position,
+            collision.normal);
+        if (projection >= 0) continue;
+        particle->positions[collision.vert] += -projection * collision.normal;
+      }
+    }
+    particle->iterations = params.matchsteps;
+    timings.iterations += params.matchsteps;
+    clock.lap(timings.springs);
+
+    /*COMPUTE VELOCITIES*/
+    for (int i = 0; i < particle->invmass.size(); i++) {
+      if (!particle->invmass[i]) continue;
+      particle->velocities[i] =
+          (particle->positions[i] - particle->old_positions[i]) / dt;
+    }
+    apply_collision_velocities(particle, params);
+    clock.lap(timings.integration);
+
+    /*VELOCITY FILTER*/
+    for (int i = 0; i < particle->invmass.size(); i++) {
+      if (!particle->invmass[i]) continue;
+      particle->velocities[i] *= (1 - params.dumping * dt);
+      if (length(particle->velocities[i]) < params.minvelocity) {
+        particle->velocities[i] = {0, 0, 0};
+      }
+    }
+    clock.lap(timings.velocities);
+
+    /*RECOMPUTE NORMALS*/
+    if (!particle->quads.empty()) {
+      update_normals(particle->normals, particle->quads, particle->positions);
+    } else if (!particle->triangles.empty()) {
+      update_normals(
+          particle->normals, particle->triangles, particle->positions);
+    }
+    clock.lap(timings.normals);
+  });
+  scene->time += dt;
+}
+
+// simulate strands with dynamic follow the leader for a step of duration dt.
+// Bending, cloth springs and collisions with the collider signed distances
+// are projected first, then follow the leader keeps strands inextensible and
+// part of its correction damps the velocities.
+void simulate_strands(
+    particle_scene* scene, const particle_params& params, float dt) {
+  parallel_shapes(scene, [&](particle_shape* particle) {
+    auto& timings = particle->timings;
+    auto  clock   = particle_clock{};
+    auto  count   = (int)particle->positions.size();
+
+    /*APPLY FORCE FIELDS*/
+    std::fill(particle->forces.begin(), particle->forces.end(), zero3f);
+    apply_fields(scene, particle, scene->time);
+
+    /*PREDICT POSITIONS*/
+    parallel_blocks(count, [&](int start, int end) {
+      for (auto i = start; i < end; i++) {
+        particle->old_positions[i] = particle->positions[i];
+        if (!particle->invmass[i]) continue;
+        auto acceleration = vec3f{0, -params.gravity, 0} +
+                            particle->forces[i] * particle->invmass[i];
+        particle->velocities[i] += acceleration * dt;
+        particle->positions[i] += particle->velocities[i] * dt;
+      }
+    });
+    clock.lap(timings.integration);
+
+    /*SOLVE CONSTRAINTS: bending, springs and collisions*/
+    auto& strands = particle->strands;
+    for (auto iteration = 0; iteration < params.strandsteps; iteration++) {
+      if (!strands.verts.empty() && particle->bend_coeff > 0)
+        solve_bending(particle);
+      solve_springs<true>(particle, particle->springs, params.simd);
+      clock.lap(timings.springs);
+      parallel_blocks(count, [&](int start, int end) {
+        for (auto i = start; i < end; i++) {
+          if (!particle->invmass[i]) continue;
+          collide_sdf(scene, particle->positions[i],
+              particle->radius.empty() ? 0 : particle->radius[i]);
+        }
+      });
+      clock.lap(timings.collisions);
+    }
+    if (!strands.verts.empty()) solve_follow_the_leader(particle);
+    particle->iterations = params.strandsteps;
+    timings.iterations += params.strandsteps;
+    clock.lap(timings.springs);
+
+    /*COMPUTE VELOCITIES: strands are damped by the correction of the next
+    vertex*/
+    parallel_blocks(count, [&](int start, int end) {
+      for (auto i = start; i < end; i++) {
+        if (!particle->invmass[i]) continue;
+        particle->velocities[i] =
+            (particle->positions[i] - particle->old_positions[i]) / dt;
+      }
+    });
+    parallel_blocks(
+        (int)strands.start.size() - 1,
+        [&](int start, int end) {
+          for (auto strand = start; strand < end; strand++) {
+            for (auto entry = strands.start[strand];
+                 entry + 1 < strands.start[strand + 1]; entry++) {
+              auto vert = strands.verts[entry];
+              if (!particle->invmass[vert]) continue;
+              particle->velocities[vert] -= params.ftldamping *
+                                            strands.corrections[entry + 1] /
+                                            dt;
+            }
+          }
+        },
+        256);
+    clock.lap(timings.integration);
+
+    /*VELOCITY FILTER*/
+    parallel_blocks(count, [&](int start, int end) {
+      for (auto i = start; i < end; i++) {
+        if (!particle->invmass[i]) continue;
+        particle->velocities[i] *= (1 - params.dumping * dt);
+        if (length(particle->velocities[i]) < params.minvelocity)
+          particle->velocities[i] = {0, 0, 0};
+      }
+    });
+    clock.lap(timings.velocities);
+
+    /*RECOMPUTE NORMALS: tangents for lines*/
+    if (!particle->quads.empty()) {
+      update_normals(particle->normals, particle->quads, particle->positions);
+    } else if (!particle->triangles.empty()) {
+      update_normals(
+          particle->normals, particle->triangles, particle->positions);
+    } else if (!particle->lines.empty()) {
+      update_tangents(particle->normals, particle->lines, particle->positions);
+    }
+    clock.lap(timings.normals);
+  });
+  scene->time += dt;
+}
+
+// simulate position based fluids for a step of duration dt
+void simulate_fluid(
+    particle_scene* scene, const particle_params& params, float dt) {
+  parallel_shapes(scene, [&](particle_shape* particle) {
+    if (particle->points.empty() || particle->fluid.keys.empty()) return;
+    auto& timings = particle->timings;
+    auto  clock   = particle_clock{};
+    auto  count   = (int)particle->positions.size();
+
+    /*APPLY FORCE FIELDS*/
+    std::fill(particle->forces.begin(), particle->forces.end(), zero3f);
+    apply_fields(scene, particle, scene->time);
+
+    /*PREDICT POSITIONS*/
+    parallel_blocks(count, [&](int start, int end) {
+      for (auto i = start; i < end; i++) {
+        particle->old_positions[i] = particle->positions[i];
+        if (!particle->invmass[i]) continue;
+        auto acceleration = vec3f{0, -params.gravity, 0} +
+                            particle->forces[i] * particle->invmass[i];
+        particle->velocities[i] += acceleration * dt;
+        particle->positions[i] += particle->velocities[i] * dt;
+      }
+    });
+    clock.lap(timings.integration);
+
+    /*COMPUTE COLLISIONS: one slot per particle, near colliders only*/
+    auto margin = find_colliders(scene, particle);
+    parallel_blocks(count, [&](int start, int end) {
+      for (auto i = start; i < end; i++) {
+        auto& collision = particle->collisions[i];
+        collision.vert  = -1;
+        if (!particle->invmass[i]) continue;
+        for (auto candidate : particle->candidates) {
+          auto collider = scene->colliders[candidate];
+          if (!inside_bounds(collider->bounds, particle->positions[i], margin))
+            continue;
+          if (collide_collider(collider, particle->positions[i],
+                  collision.position, collision.normal, collision.velocity)) {
+            collision.vert = i;
+            break;
+          }
+        }
+      }
+    });
+    clock.lap(timings.collisions);
 
+    /*NEIGHBORS*/
+    sort_fluid(particle);
+    clock.lap(timings.neighbors);
+
+    /*SOLVE DENSITY CONSTRAINTS*/
+    for (auto iteration = 0; iteration < params.fluidsteps; iteration++) {
+      solve_fluid_lambdas(particle);
+      solve_fluid_deltas(particle);
+      solve_fluid_collisions(particle);
+    }
+    timings.iterations += params.fluidsteps;
+    particle->iterations = params.fluidsteps;
+    clock.lap(timings.springs);
+
+    /*COMPUTE VELOCITIES*/
+    auto& fluid = particle->fluid;
+    parallel_blocks(fluid.active, [&](int start, int end) {
+      for (auto s = start; s < end; s++) {
+        auto i                  = fluid.order[s];
+        particle->positions[i]  = {fluid.positions.x[s], fluid.positions.y[s],
+            fluid.positions.z[s]};
+        particle->velocities[i] = (particle->positions[i] -
+                                      particle->old_positions[i]) /
+                                  dt;
+      }
+    });
+    apply_collision_velocities(particle, params);
+    clock.lap(timings.integration);
+
+    /*VELOCITY FILTER: viscosity and dumping*/
+    apply_fluid_viscosity(particle, params.viscosity);
+    parallel_blocks(count, [&](int start, int end) {
+      for (auto i = start; i < end; i++) {
+        if (!particle->invmass[i]) continue;
+        particle->velocities[i] *= (1 - params.dumping * dt);
+        if (length(particle->velocities[i]) < params.minvelocity)
+          particle->velocities[i] = {0, 0, 0};
+      }
+    });
+    clock.lap(timings.velocities);
+  });
+  scene->time += dt;
+}
+
+// Picks the substeps of a frame. Steps double when the strain grew more than
+// the target over the previous frame, as on impacts, and slowly shrink when
+// it is stable, but never so few that the fastest particle moves more than a
+// fraction of the smallest edge or radius in one step. Steps never go below
+// minsteps, or the fixed steps if 0, since explicit mass-spring needs the
+// steps it was tuned with to keep its stiffest springs stable.
+static int get_adaptive_steps(
+    particle_scene* scene, const particle_params& params) {
+  auto velocity = get_max_velocity(scene);
+  auto strain   = get_max_strain(scene);
+  if (!std::isfinite(velocity) || !std::isfinite(strain))
+    return params.maxsteps;
+  auto growth   = strain - scene->strain;
+  auto steps    = scene->substeps;
+  scene->strain = strain;
+  if (growth > params.maxstrain) {
+    steps *= 2;
+  } else if (growth < params.maxstrain / 4) {
+    steps = steps * 3 / 4;
+  }
+  auto cfl_steps = std::ceil(
+      velocity * params.deltat / (params.cfl * scene->min_length));
+  steps = max(steps, (int)min(cfl_steps, (float)params.maxsteps));
+  auto minsteps = params.minsteps > 0 ? params.minsteps
+                                      : get_fixed_steps(params);
+  return clamp(steps, minsteps, max(minsteps, params.maxsteps));
 }
 
 // Simulate one step
 void simulate_frame(particle_scene* scene, const particle_params& params) {
+  if (params.adaptive) scene->substeps = get_adaptive_steps(scene, params);
+  auto steps = params.adaptive ? scene->substeps : get_fixed_steps(params);
+  scene->iterations = 0;
+  scene->residual   = 0;
+  scene->timings.frames += 1;
+  scene->timings.substeps += steps;
+  for (auto shape : scene->shapes) {
+    if (!has_emitter(shape)) continue;
+    if (params.compaction > 0 && scene->frame % params.compaction == 0)
+      compact_emitter(shape);
+    update_emitter(shape, params.deltat);
+  }
+  auto moved = false;
+  for (auto collider : scene->colliders) {
+    if (update_collider(
+            collider, scene->time + params.deltat, params.deltat, params))
+      moved = true;
+  }
+  if (moved) make_collider_bvh(scene);
+  scene->frame += 1;
   switch (params.solver) {
     case particle_solver_type::mass_spring:
-      return simulate_massspring(scene, params);
+      return simulate_massspring(scene, params, steps);
     case particle_solver_type::position_based:
-      return simulate_pbd(scene, params);
+      for (auto step = 0; step < steps; step++)
+        simulate_pbd(scene, params, params.deltat / steps);
+      return;
+    case particle_solver_type::position_fluid:
+      for (auto step = 0; step < steps; step++)
+        simulate_fluid(scene, params, params.deltat / steps);
+      return;
+    case particle_solver_type::shape_matching:
+      for (auto step = 0; step < steps; step++)
+        simulate_shapematching(scene, params, params.deltat / steps);
+      return;
+    case particle_solver_type::follow_the_leader:
+      for (auto step = 0; step < steps; step++)
+        simulate_strands(scene, params, params.deltat / steps);
+      return;
     default: throw std::invalid_argument("unknown solver");
   }
 }
@@ -444,3 +2809,270 @@ void simulate_frames(particle_scene* scene, const particle_params& params,
 }
 
 }  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR SIMULATION CHECKPOINTS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Checkpoint header, followed by the state as raw values in native byte
+// order, with each array preceded by its size
+static const auto checkpoint_magic   = (uint32_t)0x4b435059;  // "YPCK"
+static const auto checkpoint_version = (uint32_t)1;
+
+// Appends the state to a buffer
+struct state_writer {
+  vector<byte>& data;
+
+  template <typename T>
+  void value(const T& value) {
+    auto start = data.size();
+    data.resize(start + sizeof(T));
+    memcpy(data.data() + start, &value, sizeof(T));
+  }
+  template <typename T>
+  void values(const vector<T>& values) {
+    value((uint64_t)values.size());
+    auto start = data.size();
+    data.resize(start + values.size() * sizeof(T));
+    if (!values.empty())
+      memcpy(data.data() + start, values.data(), values.size() * sizeof(T));
+  }
+  template <typename T>
+  void list(const vector<T>& values) {
+    this->values(values);
+  }
+  void count(size_t count) { value((uint64_t)count); }
+};
+
+// Reads the state back from a buffer. Arrays must have the sizes set by
+// init_simulation, except lists, and counts must match the scene, so that a
+// checkpoint of a different scene is rejected.
+struct state_reader {
+  const vector<byte>& data;
+  size_t              offset = 0;
+  bool                ok     = true;
+
+  bool read(void* values, size_t size) {
+    if (!ok || offset + size > data.size()) return ok = false;
+    if (size) memcpy(values, data.data() + offset, size);
+    offset += size;
+    return true;
+  }
+  template <typename T>
+  void value(T& value) {
+    read(&value, sizeof(T));
+  }
+  template <typename T>
+  void values(vector<T>& values) {
+    auto size = (uint64_t)0;
+    if (!read(&size, sizeof(size))) return;
+    if (size != values.size()) {
+      ok = false;
+      return;
+    }
+    read(values.data(), values.size() * sizeof(T));
+  }
+  template <typename T>
+  void list(vector<T>& values) {
+    auto size = (uint64_t)0;
+    if (!read(&size, sizeof(size))) return;
+    if (size > (data.size() - offset) / sizeof(T)) {
+      ok = false;
+      return;
+    }
+    values.resize(size);
+    read(values.data(), values.size() * sizeof(T));
+  }
+  void count(size_t count) {
+    auto size = (uint64_t)0;
+    if (read(&size, sizeof(size)) && size != count) ok = false;
+  }
+};
+
+// Visits the state that evolves with the simulation, for saving or loading.
+// Everything else is rebuilt by init_simulation or every step.
+template <typename Archive, typename Scene>
+static void visit_state(Archive& archive, Scene* scene) {
+  archive.value(scene->time);
+  archive.value(scene->frame);
+  archive.value(scene->iterations);
+  archive.value(scene->residual);
+  archive.value(scene->substeps);
+  archive.value(scene->strain);
+  archive.count(scene->shapes.size());
+  for (auto shape : scene->shapes) {
+    archive.values(shape->positions);
+    archive.values(shape->normals);
+    archive.values(shape->radius);
+    archive.values(shape->invmass);
+    archive.values(shape->velocities);
+    archive.values(shape->old_positions);
+    archive.values(shape->springs.vert0);
+    archive.values(shape->springs.vert1);
+    archive.values(shape->springs.rest);
+    archive.values(shape->springs.coeff);
+    archive.values(shape->springs.batches);
+    archive.values(shape->lambdas);
+    archive.values(shape->clusters.rotations);
+    archive.values(shape->clusters.centers);
+    archive.values(shape->strands.corrections);
+    archive.value(shape->emit_rng);
+    archive.value(shape->emit_pending);
+    archive.values(shape->ages);
+    archive.list(shape->free_particles);
+  }
+  archive.count(scene->colliders.size());
+  for (auto collider : scene->colliders) {
+    archive.value(collider->frame);
+    archive.value(collider->inverse);
+    archive.value(collider->old_frame);
+    archive.value(collider->deltat);
+    archive.values(collider->positions);
+    archive.values(collider->normals);
+    archive.values(collider->old_positions);
+    archive.values(collider->velocities);
+  }
+}
+
+// Serializes the state in a buffer, reusing its memory
+static void save_state(vector<byte>& data, const particle_scene* scene,
+    particle_solver_type solver, float deltat) {
+  data.clear();
+  auto writer = state_writer{data};
+  writer.value(checkpoint_magic);
+  writer.value(checkpoint_version);
+  writer.value((int)solver);
+  writer.value(deltat);
+  visit_state(writer, scene);
+}
+
+// Writes a buffer to a temporary file renamed to filename once complete, so
+// that a crash while writing leaves the previous checkpoint intact
+static bool save_state_data(
+    const string& filename, const vector<byte>& data, string& error) {
+  auto tmpname = filename + ".tmp";
+  auto fs      = fopen(tmpname.c_str(), "wb");
+  if (!fs) {
+    error = filename + ": file not found";
+    return false;
+  }
+  auto ok = fwrite(data.data(), 1, data.size(), fs) == data.size();
+  if (fclose(fs) != 0) ok = false;
+  if (!ok || std::rename(tmpname.c_str(), filename.c_str()) != 0) {
+    std::remove(tmpname.c_str());
+    error = filename + ": write error";
+    return false;
+  }
+  return true;
+}
+
+// Reads a whole file in a buffer
+static bool load_state_data(
+    const string& filename, vector<byte>& data, string& error) {
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) {
+    error = filename + ": file not found";
+    return false;
+  }
+  auto ok   = fseek(fs, 0, SEEK_END) == 0;
+  auto size = ok ? ftell(fs) : -1;
+  ok        = ok && size >= 0 && fseek(fs, 0, SEEK_SET) == 0;
+  if (ok) {
+    data.resize(size);
+    ok = fread(data.data(), 1, data.size(), fs) == data.size();
+  }
+  fclose(fs);
+  if (!ok) {
+    error = filename + ": read error";
+    return false;
+  }
+  return true;
+}
+
+// Save the simulation state
+bool save_simulation_state(const string& filename, const particle_scene* scene,
+    const particle_params& params, string& error) {
+  auto data = vector<byte>{};
+  save_state(data, scene, params.solver, params.deltat);
+  return save_state_data(filename, data, error);
+}
+
+// Load the simulation state, then bring the colliders acceleration structures
+// to the loaded positions as update_collider does
+bool load_simulation_state(const string& filename, particle_scene* scene,
+    const particle_params& params, string& error) {
+  auto data = vector<byte>{};
+  if (!load_state_data(filename, data, error)) return false;
+  auto reader  = state_reader{data};
+  auto magic   = (uint32_t)0;
+  auto version = (uint32_t)0;
+  auto solver  = 0;
+  auto deltat  = 0.0f;
+  reader.value(magic);
+  reader.value(version);
+  reader.value(solver);
+  reader.value(deltat);
+  if (!reader.ok || magic != checkpoint_magic ||
+      version != checkpoint_version) {
+    error = filename + ": unknown checkpoint format";
+    return false;
+  }
+  if (solver != (int)params.solver || deltat != params.deltat) {
+    error = filename + ": checkpoint of different solver params";
+    return false;
+  }
+
+  // load in a copy of the collider positions and normals, to know which
+  // ones deformed
+  auto positions = vector<vector<vec3f>>{};
+  auto normals   = vector<vector<vec3f>>{};
+  for (auto collider : scene->colliders) {
+    positions.push_back(collider->positions);
+    normals.push_back(collider->normals);
+  }
+  visit_state(reader, scene);
+  if (!reader.ok || reader.offset != data.size()) {
+    error = filename + ": checkpoint of a different scene";
+    return false;
+  }
+  for (auto idx = 0; idx < (int)scene->colliders.size(); idx++) {
+    auto collider = scene->colliders[idx];
+    if (collider->positions != positions[idx] ||
+        collider->normals != normals[idx]) {
+      refit_bvh(collider);
+      if (!collider->sdf_distances.empty())
+        update_sdf(collider, positions[idx], normals[idx], params.sdfsize);
+    }
+    update_collider_bounds(collider);
+  }
+  make_collider_bvh(scene);
+  return true;
+}
+
+// Start an asynchronous checkpoint
+bool update_checkpoint(particle_checkpoint* checkpoint,
+    const particle_scene* scene, const particle_params& params,
+    string& error) {
+  if (checkpoint->frames <= 0 || checkpoint->filename.empty()) return true;
+  if (scene->frame % checkpoint->frames != 0) return true;
+  if (!finish_checkpoint(checkpoint, error)) return false;
+  save_state(checkpoint->data, scene, params.solver, params.deltat);
+  checkpoint->writer = run_async([checkpoint]() {
+    return save_state_data(
+        checkpoint->filename, checkpoint->data, checkpoint->error);
+  });
+  return true;
+}
+
+// Wait for the last checkpoint
+bool finish_checkpoint(particle_checkpoint* checkpoint, string& error) {
+  if (!checkpoint->writer.valid()) return true;
+  if (!checkpoint->writer.get()) {
+    error = checkpoint->error;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace yocto
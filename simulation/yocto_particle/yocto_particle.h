@@ -39,6 +39,7 @@
 #include <yocto/yocto_shape.h>
 
 #include <functional>
+#include <future>
 #include <string>
 #include <vector>
 
@@ -67,11 +68,111 @@ struct particle_spring {
   float coeff = 0;
 };
 
+// Springs stored as structure-of-arrays and sorted in batches of springs that
+// do not share vertices, so that the springs in a batch can be evaluated
+// together in SIMD lanes. Batches are ranges [batches[i], batches[i+1]).
+struct particle_springs {
+  vector<int>   vert0   = {};
+  vector<int>   vert1   = {};
+  vector<float> rest    = {};
+  vector<float> coeff   = {};
+  vector<int>   batches = {};
+};
+
+// Coarse level of the pbd hierarchy. Its vertices are a subset of the
+// vertices of the finer level, connected by stretch-only springs. Corrections
+// are prolongated to the finer vertices not in the level, each moved by the
+// weighted corrections of its parents in [start[i], start[i+1]).
+struct particle_level {
+  particle_springs springs = {};
+  vector<int>      fine    = {};
+  vector<int>      start   = {};
+  vector<int>      parents = {};
+  vector<float>    weights = {};
+};
+
+// Long range attachments, that keep each vertex within its initial distance
+// from its nearest pinned vertex along the springs
+struct particle_tethers {
+  vector<int>   vert   = {};
+  vector<int>   anchor = {};
+  vector<float> rest   = {};
+};
+
 // Collisions
 struct particle_collision {
   int   vert     = 0;
   vec3f position = {0, 0, 0};
   vec3f normal   = {0, 0, 0};
+  vec3f velocity = {0, 0, 0};  // collider velocity at the hit
+};
+
+// Structure-of-arrays copy of per-particle vectors, used by vectorized passes
+struct particle_soa {
+  vector<float> x = {};
+  vector<float> y = {};
+  vector<float> z = {};
+};
+
+// Fluid workspaces. Particles are sorted by the hash of their grid cell and
+// copied in that order as structure-of-arrays, so that neighbors are close in
+// memory. Neighbor lists hold up to max_neighbors sorted slots per particle.
+struct particle_fluid {
+  float         radius        = 0;  // kernel radius
+  float         density       = 0;  // rest density
+  int           active        = 0;  // particles with mass, sorted first
+  int           max_neighbors = 48;
+  vector<int>   keys          = {};  // cell hash of each particle
+  vector<int>   order         = {};  // particle of each sorted slot
+  vector<int>   buckets       = {};  // first sorted slot of each hash bucket
+  vector<int>   neighbors     = {};
+  vector<int>   counts        = {};
+  vector<float> lambdas       = {};
+  particle_soa  positions     = {};
+  particle_soa  velocities    = {};
+  particle_soa  deltas        = {};
+};
+
+// Shape matching clusters, stored as lists of entries. Each entry is a vertex
+// of a cluster with its offset from the rest center of the cluster. Clusters
+// overlap, so the entries of each vertex are listed too.
+struct particle_clusters {
+  vector<int>   start     = {};  // first entry of each cluster
+  vector<int>   verts     = {};  // vertex of each entry
+  vector<vec3f> offsets   = {};  // rest offset of each entry
+  vector<float> stiffness = {};  // stiffness of each cluster
+  vector<vec4f> rotations = {};  // rotation quaternion of each cluster
+  vector<vec3f> centers   = {};  // center of mass of each cluster
+  vector<int>   owners    = {};  // cluster of each entry
+  vector<int>   vstart    = {};  // first item of each vertex in ventries
+  vector<int>   ventries  = {};  // entries of each vertex
+};
+
+// Strands built from the lines of a shape, with vertices listed from the
+// root. Lengths are the rest distances to the previous vertex and bends the
+// ones to the vertex two before, used for bending constraints.
+struct particle_strands {
+  vector<int>   start       = {};  // first entry of each strand
+  vector<int>   verts       = {};  // vertex of each entry
+  vector<float> lengths     = {};  // rest length to the previous entry
+  vector<float> bends       = {};  // rest length to two entries before
+  vector<vec3f> corrections = {};  // follow the leader correction
+};
+
+// Time spent by the solvers in each phase, in seconds, accumulated over all
+// frames simulated since init_simulation and summed over shapes, so phases of
+// shapes simulated concurrently add up to more than the elapsed time
+struct particle_timings {
+  double integration = 0;  // forces, fields and time integration
+  double springs     = 0;  // spring forces or constraint projection
+  double neighbors   = 0;  // fluid neighbor search
+  double collisions  = 0;  // collision detection and response
+  double velocities  = 0;  // velocity filter
+  double normals     = 0;  // normal recomputation
+  int    frames      = 0;  // simulated frames
+  int    iterations  = 0;  // constraint iterations
+  int    substeps    = 0;  // solver steps
+  int    dropped     = 0;  // fluid neighbors over max_neighbors, ignored
 };
 
 // Simulation shape
@@ -84,12 +185,20 @@ struct particle_shape {
   vector<vec3f> velocities = {};
 
   // material data
-  float spring_coeff = 0;
+  float         spring_coeff      = 0;
+  float         cluster_stiffness = 0;   // shape matching stiffness, 0 for none
+  float         cluster_size      = 0;   // cluster cell size, 0 for one cluster
+  float         bend_coeff        = 0;   // strand bending stiffness
+  vector<float> stiffness         = {};  // per particle cluster stiffness
 
-  // particle emitter
+  // particle emitter, spawning particles at the initial ones, the sites
   vec3f     emit_velocity = {0, 0, 0};
   float     emit_rngscale = 0;
   rng_state emit_rng      = {};
+  float     emit_rate     = 0;  // particles per second
+  float     emit_lifetime = 0;  // seconds, 0 for no limit
+  int       emit_sites    = 0;  // initial particles, the rest is the pool
+  float     emit_pending  = 0;  // fraction of particle left to emit
 
   // shape data
   vector<int>   points    = {};
@@ -97,13 +206,48 @@ struct particle_shape {
   vector<vec3i> triangles = {};
   vector<vec4i> quads     = {};
 
-  // simulation data
+  // simulation data, sized once by init_simulation and reused every frame
   vector<vec3f>              old_positions = {};
   vector<vec3f>              forces        = {};
-  vector<particle_spring>    springs       = {};
+  particle_springs           springs       = {};
   vector<float>              lambdas       = {};
   vector<particle_collision> collisions    = {};
 
+  // collision broad phase: colliders near the shape, and collisions found by
+  // each parallel block before they are appended in order
+  vector<int>                        candidates       = {};
+  vector<vector<particle_collision>> collision_blocks = {};
+
+  // emitter pool: particle ages, negative for free slots, and free slots
+  // with the lowest on top
+  vector<float> ages           = {};
+  vector<int>   free_particles = {};
+
+  // fluid workspaces, for point shapes simulated as fluids
+  particle_fluid fluid = {};
+
+  // shape matching clusters, for bodies simulated with shape matching
+  particle_clusters clusters = {};
+
+  // strands, for line shapes
+  particle_strands strands = {};
+
+  // statistics of the last step, merged in the scene ones, since shapes are
+  // simulated concurrently
+  particle_timings timings    = {};
+  int              iterations = 0;
+  float            residual   = 0;
+
+  // pbd hierarchy, from the finest coarse level, and attachments
+  vector<particle_level> levels          = {};
+  particle_tethers       tethers         = {};
+  vector<vec3f>          level_positions = {};
+
+  // force field workspaces
+  particle_soa field_positions     = {};
+  particle_soa field_velocities    = {};
+  particle_soa field_accelerations = {};
+
   // initial configuration to reply animation
   vector<vec3f> initial_positions  = {};
   vector<vec3f> initial_normals    = {};
@@ -113,7 +257,15 @@ struct particle_shape {
   vector<int>   initial_pinned     = {};
 };
 
-// Simulation collider
+// Scripted collider motion, that sets the collider frame or its positions
+// at the given time
+struct particle_collider;
+using particle_animation =
+    function<void(particle_collider* collider, float time)>;
+
+// Simulation collider. Positions are in local space and the frame places them
+// in the scene, so rigid movers only change the frame, while deforming
+// colliders change their positions and refit their bvh.
 struct particle_collider {
   // Vertex data
   vector<vec3f> positions = {};
@@ -124,23 +276,95 @@ struct particle_collider {
   vector<vec3i> triangles = {};
   vector<vec4i> quads     = {};
 
-  // bvh
-  shape_bvh bvh = {};
+  // world space bounds, for the collision broad phase
+  bbox3f bounds = invalidb3f;
+
+  // bvh, with its nodes sorted by depth for refitting
+  shape_bvh   bvh        = {};
+  vector<int> bvh_order  = {};  // nodes sorted by depth
+  vector<int> bvh_levels = {};  // first sorted node of each depth
+
+  // motion: frame with its inverse, for queries in local space, and the
+  // previous configuration, for the collider velocity
+  frame3f       frame         = identity3x4f;
+  frame3f       inverse       = identity3x4f;
+  frame3f       old_frame     = identity3x4f;
+  vector<vec3f> old_positions = {};
+  vector<vec3f> old_normals   = {};
+  vector<vec3f> velocities    = {};  // local vertex velocities
+  float         deltat        = 0;   // time since the previous configuration
+
+  // keyframed frames or positions, and scripted motion applied after them
+  vector<float>         frame_times    = {};
+  vector<frame3f>       key_frames     = {};
+  vector<float>         position_times = {};
+  vector<vector<vec3f>> key_positions  = {};
+  particle_animation    animation      = {};
+
+  // initial configuration
+  frame3f       initial_frame     = identity3x4f;
+  vector<vec3f> initial_positions = {};
+  vector<vec3f> initial_normals   = {};
+
+  // signed distances sampled on a grid of cells of size cell from origin,
+  // negative behind the surface, used by the strand solver
+  vec3f         sdf_origin    = {0, 0, 0};
+  vec3i         sdf_size      = {0, 0, 0};
+  float         sdf_cell      = 0;
+  vector<float> sdf_distances = {};
+  vector<int>   sdf_stack     = {};  // flood fill workspace
+};
+
+// Force field types
+enum struct particle_field_type { wind, vortex, attractor, drag, aerodynamic };
+
+// Force field acting on all simulated particles. Wind, vortex, attractor and
+// drag are accelerations evaluated per particle, while aerodynamic forces are
+// evaluated on cloth elements from the air velocity `direction * strength`.
+struct particle_field {
+  particle_field_type type       = particle_field_type::wind;
+  vec3f               origin     = {0, 0, 0};  // vortex and attractor center
+  vec3f               direction  = {1, 0, 0};  // wind direction, vortex axis
+  float               strength   = 0;          // field intensity
+  float               turbulence = 0;          // wind noise amplitude
+  float               frequency  = 1;          // wind noise frequency
+  float               drag       = 0;          // aerodynamic drag coefficient
+  float               lift       = 0;          // aerodynamic lift coefficient
 };
 
 // Simulation scene
 struct particle_scene {
-  vector<particle_shape*>    shapes    = {};
-  vector<particle_collider*> colliders = {};
+  vector<particle_shape*>    shapes          = {};
+  vector<particle_collider*> colliders       = {};
+  vector<particle_field*>    fields          = {};
+  vector<bvh_node>           collider_nodes  = {};  // hierarchy of colliders
+  vector<int>                collider_order  = {};  // colliders in its leaves
+  vector<vec2i>              collider_ranges = {};  // ranges while building
+  float                      time            = 0;
+  particle_timings           timings         = {};
+  int                        frame           = 0;  // frames since init
+  int                        iterations      = 0;  // last frame pbd iterations
+  float                      residual        = 0;  // last frame pbd residual
+  int                        substeps        = 0;  // last frame solver steps
+  float                      min_length      = 0;  // smallest edge or radius
+  float                      strain          = 0;  // last frame max strain
   ~particle_scene();
 };
 
-// Solver type
-enum struct particle_solver_type { mass_spring, position_based };
+// Solver type. Position based fluids simulate point shapes only. Shape
+// matching simulates bodies and follow the leader simulates strands, while
+// cloth and particles move as in pbd.
+enum struct particle_solver_type {
+  mass_spring,
+  position_based,
+  position_fluid,
+  shape_matching,
+  follow_the_leader
+};
 
 // Solver names
-const auto particle_solver_names = vector<string>{
-    "mass_spring", "position_based"};
+const auto particle_solver_names = vector<string>{"mass_spring",
+    "position_based", "position_fluid", "shape_matching", "follow_the_leader"};
 
 // Simulation parameters
 struct particle_params {
@@ -149,13 +373,29 @@ struct particle_params {
   float                deltat       = 0.5 * 1.0 / 60.0;
   int                  mssteps      = 200;
   int                  pdbsteps     = 100;
+  float                tolerance    = 0;      // pbd stretch to stop, or 0
+  int                  pdblevels    = 1;      // pbd hierarchy levels
+  int                  levelsteps   = 4;      // iterations on coarse levels
+  bool                 attachments  = false;  // long range attachments
+  bool                 adaptive     = false;  // adaptive steps per frame
+  float                cfl          = 0.5;    // max step motion over length
+  float                maxstrain    = 0.05;   // strain growth per frame
+  int                  minsteps     = 0;      // min adaptive steps, 0 fixed
+  int                  maxsteps     = 1000;   // max adaptive steps
+  int                  compaction   = 30;     // frames between pool packing
+  int                  fluidsteps   = 4;      // fluid density iterations
+  float                viscosity    = 0.01;   // fluid xsph viscosity
+  int                  matchsteps   = 2;      // shape matching iterations
+  int                  strandsteps  = 2;      // strand bending iterations
+  float                ftldamping   = 0.9;    // follow the leader damping
+  int                  sdfsize      = 64;     // collider sdf resolution
+  bool                 simd         = true;   // simd kernels if cpu has them
   int                  frames       = 120;
   float                initvelocity = 0;
   float                dumping      = 2;
   float                minvelocity  = 0.01;
   vec2f                bounce       = {0.05f, 1};
   int                  seed         = 987121;
-  bool              flag         = false; 
 };
 
 // Initialize the simulation state
@@ -183,14 +423,104 @@ particle_shape* add_cloth(particle_scene* scene, const vector<vec4i>& quads,
     const vector<vec3f>& positions, const vector<vec3f>& normals,
     const vector<float>& radius, float mass, float coeff,
     const vector<int>& pinned);
+// Deformable body kept in shape by overlapping clusters of size cluster_size,
+// or by a single cluster if 0, each pulling its particles toward its rest
+// shape by stiffness. Bodies are simulated by the shape matching solver.
+particle_shape* add_body(particle_scene* scene, const vector<vec3i>& triangles,
+    const vector<vec4i>& quads, const vector<vec3f>& positions,
+    const vector<vec3f>& normals, const vector<float>& radius, float mass,
+    float stiffness, float cluster_size);
+// Per particle stiffness of a body, so that parts of it are softer or more
+// rigid. It overrides the stiffness of the body, and each cluster takes the
+// average stiffness of its particles.
+void set_cluster_stiffness(
+    particle_shape* shape, const vector<float>& stiffness);
+// Strands from polylines, with roots pinned. Strands are simulated by the
+// follow the leader solver, and bend with stiffness bending.
+particle_shape* add_hair(particle_scene* scene, const vector<vec2i>& lines,
+    const vector<vec3f>& positions, const vector<vec3f>& tangents,
+    const vector<float>& radius, float mass, float bending);
 particle_collider* add_collider(particle_scene* scene,
     const vector<vec3i>& triangles, const vector<vec4i>& quads,
     const vector<vec3f>& positions, const vector<vec3f>& normals,
     const vector<float>& radius);
 
+// Collider motion. Keyframes are interpolated linearly and clamped at the
+// ends, frames for rigid movers and positions for deforming colliders.
+// Scripted motion runs every frame, after the keyframes.
+void set_collider_frames(particle_collider* collider,
+    const vector<float>& times, const vector<frame3f>& frames);
+void set_collider_positions(particle_collider* collider,
+    const vector<float>& times, const vector<vector<vec3f>>& positions);
+void set_collider_animation(
+    particle_collider* collider, const particle_animation& animation);
+
+// Continuous emission from the shape particles into a fixed pool of capacity
+// particles. Free slots have zero radius and mass, so shapes keep their size.
+// Shapes without points have no emission sites and are left unchanged.
+void set_emitter(particle_shape* shape, float rate, float lifetime,
+    int capacity, const vec3f& velocity, float random_scale);
+
+// Force fields
+particle_field* add_wind(particle_scene* scene, const vec3f& direction,
+    float strength, float turbulence = 0, float frequency = 1);
+particle_field* add_vortex(particle_scene* scene, const vec3f& origin,
+    const vec3f& axis, float strength);
+particle_field* add_attractor(
+    particle_scene* scene, const vec3f& origin, float strength);
+particle_field* add_drag(particle_scene* scene, float strength);
+particle_field* add_aerodynamics(particle_scene* scene, const vec3f& wind,
+    float drag, float lift);
+
 // Get shape properties
 void get_positions(particle_shape* shape, vector<vec3f>& positions);
 void get_normals(particle_shape* shape, vector<vec3f>& normals);
+void get_radius(particle_shape* shape, vector<float>& radius);
+
+// Deep copy of a scene, including its simulation state
+void copy_scene(particle_scene* copy, const particle_scene* scene);
+
+// Simulation diagnostics: maximum particle speed and maximum relative spring
+// stretch over all shapes. Non-finite values denote an unstable simulation.
+float get_max_velocity(const particle_scene* scene);
+float get_max_strain(const particle_scene* scene);
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// SIMULATION CHECKPOINTS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Save and load the simulation state in a compact binary format: particles
+// with their pins, springs, multipliers, cluster rotations, strand
+// corrections, emitter pools with their rng, collider motion and scene time.
+// Load after init_simulation of the same scene with the same params, and the
+// simulation continues bit-identically. After a failed load, the simulation
+// needs to be initialized again.
+bool save_simulation_state(const string& filename, const particle_scene* scene,
+    const particle_params& params, string& error);
+bool load_simulation_state(const string& filename, particle_scene* scene,
+    const particle_params& params, string& error);
+
+// Asynchronous checkpoints, written every frames frames to filename. The state
+// is copied to data on the simulation thread, and written by a background
+// thread that replaces the file only once complete.
+struct particle_checkpoint {
+  string            filename = "";
+  int               frames   = 0;  // frames between checkpoints, 0 for none
+  vector<byte>      data     = {};
+  std::future<bool> writer   = {};
+  string            error    = "";
+};
+
+// Starts writing a checkpoint if the scene frame is a multiple of frames,
+// after waiting for the previous write. Returns false if that one failed.
+bool update_checkpoint(particle_checkpoint* checkpoint,
+    const particle_scene* scene, const particle_params& params,
+    string& error);
+// Waits for the last checkpoint write. Returns false if it failed.
+bool finish_checkpoint(particle_checkpoint* checkpoint, string& error);
 
 }  // namespace yocto
 
@@ -0,0 +1,181 @@
+//
+// AVX2 spring kernels for Yocto/Particle.
+//
+
+//
+// LICENSE:
+//
+// Copyright (c) 2020 -- 2020 Fabio Pellacini
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+
+// This file alone is built with AVX2 and FMA enabled, and yocto_particle.cpp
+// calls its kernels only after checking the cpu at runtime. It includes no
+// yocto or standard headers, so that no inline function compiled here with
+// AVX2 can be picked by the linker in place of the copies used elsewhere.
+
+#include <immintrin.h>
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR AVX2 SPRING KERNELS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Evaluates springs in [start, end) eight at a time, as solve_springs_scalar.
+// Positions, forces and velocities are arrays of vec3f. Springs in the range
+// must not share vertices. Returns the first spring that was not evaluated.
+// Results differ from the scalar kernel in the last bits, since lengths come
+// from rsqrt refined by one Newton step.
+template <bool project, bool stretch_only>
+int solve_springs_avx2(float* positions, float* forces,
+    const float* velocities, const float* invmass, const int* vert0,
+    const int* vert1, const float* rest_, const float* coeff_, int start,
+    int end, float& residual) {
+  auto zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1);
+  auto half = _mm256_set1_ps(0.5f), three_halves = _mm256_set1_ps(1.5f);
+  auto sign = _mm256_set1_ps(-0.0f), stretch_max = zero;
+  auto s    = start;
+  for (; s + 8 <= end; s += 8) {
+    auto i0    = _mm256_loadu_si256((const __m256i*)(vert0 + s));
+    auto i1    = _mm256_loadu_si256((const __m256i*)(vert1 + s));
+    auto rest  = _mm256_loadu_ps(rest_ + s);
+    auto coeff = _mm256_loadu_ps(coeff_ + s);
+    auto w0    = _mm256_i32gather_ps(invmass, i0, 4);
+    auto w1    = _mm256_i32gather_ps(invmass, i1, 4);
+    auto w     = _mm256_add_ps(w0, w1);
+
+    // gather positions from the array of vec3f
+    auto o0  = _mm256_mullo_epi32(i0, _mm256_set1_epi32(3));
+    auto o1  = _mm256_mullo_epi32(i1, _mm256_set1_epi32(3));
+    auto p0x = _mm256_i32gather_ps(positions + 0, o0, 4);
+    auto p0y = _mm256_i32gather_ps(positions + 1, o0, 4);
+    auto p0z = _mm256_i32gather_ps(positions + 2, o0, 4);
+    auto p1x = _mm256_i32gather_ps(positions + 0, o1, 4);
+    auto p1y = _mm256_i32gather_ps(positions + 1, o1, 4);
+    auto p1z = _mm256_i32gather_ps(positions + 2, o1, 4);
+    auto dx  = _mm256_sub_ps(p1x, p0x);
+    auto dy  = _mm256_sub_ps(p1y, p0y);
+    auto dz  = _mm256_sub_ps(p1z, p0z);
+    auto length2 = _mm256_add_ps(_mm256_mul_ps(dx, dx),
+        _mm256_add_ps(_mm256_mul_ps(dy, dy), _mm256_mul_ps(dz, dz)));
+
+    // skip springs between pinned vertices or with zero length
+    auto valid = _mm256_and_ps(_mm256_cmp_ps(w, zero, _CMP_GT_OQ),
+        _mm256_cmp_ps(length2, zero, _CMP_GT_OQ));
+    auto invw = _mm256_and_ps(_mm256_div_ps(one, w), valid);
+
+    // fast reciprocal square root refined by a Newton-Raphson step
+    auto invlen = _mm256_rsqrt_ps(length2);
+    invlen      = _mm256_mul_ps(invlen,
+        _mm256_sub_ps(three_halves,
+            _mm256_mul_ps(_mm256_mul_ps(half, length2),
+                _mm256_mul_ps(invlen, invlen))));
+    invlen   = _mm256_and_ps(invlen, valid);
+    auto len = _mm256_mul_ps(length2, invlen);
+    if constexpr (stretch_only) {
+      valid  = _mm256_and_ps(valid, _mm256_cmp_ps(len, rest, _CMP_GT_OQ));
+      invw   = _mm256_and_ps(invw, valid);
+      invlen = _mm256_and_ps(invlen, valid);
+    }
+    auto nx = _mm256_mul_ps(dx, invlen);
+    auto ny = _mm256_mul_ps(dy, invlen);
+    auto nz = _mm256_mul_ps(dz, invlen);
+
+    alignas(32) int   v0[8], v1[8];
+    alignas(32) float x0[8], y0[8], z0[8], x1[8], y1[8], z1[8];
+    _mm256_store_si256((__m256i*)v0, o0);
+    _mm256_store_si256((__m256i*)v1, o1);
+    if constexpr (project) {
+      auto error   = _mm256_andnot_ps(sign, _mm256_sub_ps(len, rest));
+      auto stretch = _mm256_and_ps(_mm256_div_ps(error, rest),
+          _mm256_and_ps(valid, _mm256_cmp_ps(rest, zero, _CMP_GT_OQ)));
+      stretch_max  = _mm256_max_ps(stretch_max, stretch);
+      auto lambda  = _mm256_mul_ps(
+          _mm256_mul_ps(_mm256_sub_ps(one, coeff), _mm256_sub_ps(len, rest)),
+          invw);
+      auto c0 = _mm256_mul_ps(w0, lambda), c1 = _mm256_mul_ps(w1, lambda);
+      _mm256_store_ps(x0, _mm256_add_ps(p0x, _mm256_mul_ps(c0, nx)));
+      _mm256_store_ps(y0, _mm256_add_ps(p0y, _mm256_mul_ps(c0, ny)));
+      _mm256_store_ps(z0, _mm256_add_ps(p0z, _mm256_mul_ps(c0, nz)));
+      _mm256_store_ps(x1, _mm256_sub_ps(p1x, _mm256_mul_ps(c1, nx)));
+      _mm256_store_ps(y1, _mm256_sub_ps(p1y, _mm256_mul_ps(c1, ny)));
+      _mm256_store_ps(z1, _mm256_sub_ps(p1z, _mm256_mul_ps(c1, nz)));
+      for (auto lane = 0; lane < 8; lane++) {
+        positions[v0[lane] + 0] = x0[lane];
+        positions[v0[lane] + 1] = y0[lane];
+        positions[v0[lane] + 2] = z0[lane];
+        positions[v1[lane] + 0] = x1[lane];
+        positions[v1[lane] + 1] = y1[lane];
+        positions[v1[lane] + 2] = z1[lane];
+      }
+    } else {
+      auto q0x = _mm256_i32gather_ps(velocities + 0, o0, 4);
+      auto q0y = _mm256_i32gather_ps(velocities + 1, o0, 4);
+      auto q0z = _mm256_i32gather_ps(velocities + 2, o0, 4);
+      auto q1x = _mm256_i32gather_ps(velocities + 0, o1, 4);
+      auto q1y = _mm256_i32gather_ps(velocities + 1, o1, 4);
+      auto q1z = _mm256_i32gather_ps(velocities + 2, o1, 4);
+      auto projection = _mm256_add_ps(
+          _mm256_mul_ps(_mm256_sub_ps(q1x, q0x), nx),
+          _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(q1y, q0y), ny),
+              _mm256_mul_ps(_mm256_sub_ps(q1z, q0z), nz)));
+      auto invcoeff = _mm256_div_ps(invw, coeff);
+      auto stretch  = _mm256_sub_ps(_mm256_div_ps(len, rest), one);
+      auto damping  = _mm256_div_ps(projection,
+          _mm256_mul_ps(rest, _mm256_set1_ps(1000)));
+      auto scale = _mm256_mul_ps(_mm256_add_ps(stretch, damping), invcoeff);
+      _mm256_store_ps(x0, _mm256_mul_ps(scale, nx));
+      _mm256_store_ps(y0, _mm256_mul_ps(scale, ny));
+      _mm256_store_ps(z0, _mm256_mul_ps(scale, nz));
+      for (auto lane = 0; lane < 8; lane++) {
+        forces[v0[lane] + 0] += x0[lane];
+        forces[v0[lane] + 1] += y0[lane];
+        forces[v0[lane] + 2] += z0[lane];
+        forces[v1[lane] + 0] -= x0[lane];
+        forces[v1[lane] + 1] -= y0[lane];
+        forces[v1[lane] + 2] -= z0[lane];
+      }
+    }
+  }
+  if constexpr (project) {
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, stretch_max);
+    for (auto lane = 0; lane < 8; lane++)
+      if (lanes[lane] > residual) residual = lanes[lane];
+  }
+  return s;
+}
+
+// Kernels used by solve_springs
+template int solve_springs_avx2<false, false>(float* positions, float* forces,
+    const float* velocities, const float* invmass, const int* vert0,
+    const int* vert1, const float* rest, const float* coeff, int start,
+    int end, float& residual);
+template int solve_springs_avx2<true, false>(float* positions, float* forces,
+    const float* velocities, const float* invmass, const int* vert0,
+    const int* vert1, const float* rest, const float* coeff, int start,
+    int end, float& residual);
+template int solve_springs_avx2<true, true>(float* positions, float* forces,
+    const float* velocities, const float* invmass, const int* vert0,
+    const int* vert1, const float* rest, const float* coeff, int start,
+    int end, float& residual);
+
+}  // namespace yocto